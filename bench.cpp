@@ -0,0 +1,218 @@
+//          Copyright Jesper Dam 2013.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// utf_bench: throughput of the stringview operations on synthetic corpora
+//
+// usage: utf_bench [--large <bytes>] [--filter <text>]
+//
+// For every corpus (ascii, latin1, cyrillic, cjk, emoji, mixed), size (16 B,
+// 1 KiB and 64 MiB by default) and source encoding (Latin-1 only for the
+// corpora it can encode), measures validate(),
+// codepoints(), codeunits<E>() and to<E>() for every destination encoding,
+// and codepoint_iterator iteration. Results are printed as CSV, one line per
+// measurement, with throughput relative to the size of the source buffer.
+// --filter only runs the lines containing the given text, e.g. "cjk,1024".
+// Build with optimizations, e.g. g++ -O2 -march=native bench.cpp -o utf_bench
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "utf.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define UTF_BENCH_RDTSC
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define UTF_BENCH_RDTSC
+#endif
+
+namespace {
+    volatile size_t sink;
+
+    // small deterministic generator, so runs are comparable
+    struct rng {
+        uint32_t state;
+        size_t script;
+        explicit rng(uint32_t seed) : state(seed), script(0) {}
+        uint32_t operator()(uint32_t n) {
+            state = state * 1664525u + 1013904223u;
+            return (state >> 8) % n;
+        }
+    };
+
+    utf::codepoint_type ascii_char(rng& r) {
+        return r(6) == 0 ? 0x20 : 0x61 + r(26);
+    }
+
+    utf::codepoint_type next_codepoint(const std::string& corpus, rng& r) {
+        if (corpus == "ascii") {
+            return ascii_char(r);
+        }
+        if (corpus == "latin1") {
+            return r(8) == 0 ? 0xc0 + r(0x40) : ascii_char(r);
+        }
+        if (corpus == "cyrillic") {
+            return r(6) == 0 ? 0x20 : 0x410 + r(0x40);
+        }
+        if (corpus == "cjk") {
+            return r(10) == 0 ? 0x3001 : 0x4e00 + r(0x5200);
+        }
+        if (corpus == "emoji") {
+            return r(2) == 0 ? 0x1f300 + r(0x350) : ascii_char(r);
+        }
+        // mixed: switch script every few characters
+        const char* scripts[] = { "ascii", "latin1", "cyrillic", "cjk", "emoji" };
+        if (r(5) == 0) {
+            r.script = r(5);
+        }
+        return next_codepoint(scripts[r.script], r);
+    }
+
+    // text of the corpus in encoding E, as close to size bytes as whole codepoints allow
+    template <typename E, typename T>
+    std::vector<T> make_corpus(const std::string& corpus, size_t size) {
+        rng r(42);
+        std::vector<T> res;
+        std::vector<utf::codepoint_type> block;
+        size_t len = 0;
+        bool full = false;
+        while (!full) {
+            block.clear();
+            while (block.size() < 4096) {
+                utf::codepoint_type c = next_codepoint(corpus, r);
+                size_t n = utf::stringview<const utf::codepoint_type*>(&c, &c + 1).codeunits<E>();
+                if ((len + n) * sizeof(T) > size) {
+                    full = true;
+                    break;
+                }
+                len += n;
+                block.push_back(c);
+            }
+            size_t start = res.size();
+            res.resize(len);
+            utf::transcode<utf::utf32, E>(block.data(), block.size(), res.data() + start);
+        }
+        return res;
+    }
+
+    uint64_t cycles() {
+#ifdef UTF_BENCH_RDTSC
+        return __rdtsc();
+#else
+        return 0;
+#endif
+    }
+
+    struct bench_context {
+        std::string filter;
+        std::string corpus;
+        const char* source;
+        size_t bytes;
+    };
+
+    // runs f enough times to take about 0.1s, three times over, and prints the best
+    template <typename F>
+    void measure(const bench_context& ctx, const char* operation, const char* dest, F f) {
+        char prefix[256];
+        std::snprintf(prefix, sizeof(prefix), "%s,%lu,%s,%s,%s,", ctx.corpus.c_str(), static_cast<unsigned long>(ctx.bytes), ctx.source, dest, operation);
+        if (!ctx.filter.empty() && std::string(prefix).find(ctx.filter) == std::string::npos) {
+            return;
+        }
+
+        typedef std::chrono::steady_clock clock;
+        size_t reps = 1;
+        for (;;) {
+            clock::time_point start = clock::now();
+            for (size_t i = 0; i < reps; ++i) { f(); }
+            if (std::chrono::duration<double>(clock::now() - start).count() > 0.02 || reps >= (size_t(1) << 30)) { break; }
+            reps *= 4;
+        }
+        reps *= 5;
+
+        double best_seconds = 1e300;
+        double best_cycles = 1e300;
+        for (int run = 0; run < 3; ++run) {
+            clock::time_point start = clock::now();
+            uint64_t c0 = cycles();
+            for (size_t i = 0; i < reps; ++i) { f(); }
+            uint64_t c1 = cycles();
+            double seconds = std::chrono::duration<double>(clock::now() - start).count() / reps;
+            if (seconds < best_seconds) {
+                best_seconds = seconds;
+                best_cycles = static_cast<double>(c1 - c0) / reps;
+            }
+        }
+        std::printf("%s%.4f,", prefix, ctx.bytes / best_seconds / 1e9);
+#ifdef UTF_BENCH_RDTSC
+        std::printf("%.3f\n", best_cycles / ctx.bytes);
+#else
+        std::printf("\n");
+#endif
+        std::fflush(stdout);
+    }
+
+    template <typename E, typename T, typename EDest, typename TDest>
+    void bench_dest(const bench_context& ctx, const std::vector<T>& text, const char* dest) {
+        utf::stringview<const T*, E> sv(text.data(), text.data() + text.size());
+        std::vector<TDest> out(sv.template codeunits<EDest>() + 1);
+        measure(ctx, "codeunits", dest, [&]() { sink = sv.template codeunits<EDest>(); });
+        measure(ctx, "to", dest, [&]() { sink = sv.template to<EDest>(out.data()) - out.data(); });
+    }
+
+    template <typename E, typename T>
+    void bench_source(const std::string& corpus, size_t size, const char* source, const std::string& filter) {
+        std::vector<T> text = make_corpus<E, T>(corpus, size);
+        bench_context ctx = { filter, corpus, source, text.size() * sizeof(T) };
+        utf::stringview<const T*, E> sv(text.data(), text.data() + text.size());
+
+        measure(ctx, "validate", "", [&]() { sink = sv.validate(); });
+        measure(ctx, "codepoints", "", [&]() { sink = sv.codepoints(); });
+        measure(ctx, "iterate", "", [&]() {
+            utf::codepoint_type sum = 0;
+            for (utf::codepoint_iterator<const T*, utf::policy::unchecked, E> it = sv.begin(); it != sv.end(); ++it) {
+                sum += *it;
+            }
+            sink = sum;
+        });
+        bench_dest<E, T, utf::utf8, char>(ctx, text, "utf8");
+        bench_dest<E, T, utf::utf16, char16_t>(ctx, text, "utf16");
+        bench_dest<E, T, utf::utf32, char32_t>(ctx, text, "utf32");
+        bench_dest<E, T, utf::latin1, char>(ctx, text, "latin1");
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t sizes[] = { 16, 1024, size_t(64) << 20 };
+    std::string filter;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--large") == 0 && i + 1 < argc) {
+            sizes[2] = static_cast<size_t>(std::strtoull(argv[++i], 0, 10));
+        }
+        else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        }
+        else {
+            std::fprintf(stderr, "usage: utf_bench [--large <bytes>] [--filter <text>]\n");
+            return 2;
+        }
+    }
+
+    const char* corpora[] = { "ascii", "latin1", "cyrillic", "cjk", "emoji", "mixed" };
+    std::printf("corpus,bytes,source,dest,operation,gb_per_s,cycles_per_byte\n");
+    for (size_t c = 0; c < sizeof(corpora) / sizeof(*corpora); ++c) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s) {
+            bench_source<utf::utf8, char>(corpora[c], sizes[s], "utf8", filter);
+            bench_source<utf::utf16, char16_t>(corpora[c], sizes[s], "utf16", filter);
+            bench_source<utf::utf32, char32_t>(corpora[c], sizes[s], "utf32", filter);
+            if (c < 2) {
+                bench_source<utf::latin1, char>(corpora[c], sizes[s], "latin1", filter);
+            }
+        }
+    }
+}
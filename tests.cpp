@@ -8,8 +8,19 @@
 #include <catch/catch.hpp>
 
 #include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
 
 #include "utf.hpp"
+#include "utf_codepages.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/wait.h>
+#include "utf_mmap.hpp"
+#define UTFHPP_TEST_FILES
+#endif
 
 using namespace utf;
 using namespace utf::internal;
@@ -308,6 +319,10 @@ TEST_CASE("traits/utf8/validate", "Validate a utf-8 encoded character") {
         unsigned char buf[] = {0xe0, 0x82, 0xac};
         CHECK(!traits_t::validate(buf, buf + elems(buf)));
     }
+    SECTION("shortest 3-byte sequence", "0xe0 is a valid lead when the first continuation starts with 101") {
+        unsigned char buf[] = {0xe0, 0xa0, 0x80};
+        CHECK(traits_t::validate(buf, buf + elems(buf)));
+    }
     SECTION("overlong 4-byte sequence", "lead byte holds all zeros, first continuation starts with 100") {
         unsigned char buf[] = {0xf0, 0x8f, 0x92, 0xa9};
         CHECK(!traits_t::validate(buf, buf + elems(buf)));
@@ -906,3 +921,1615 @@ TEST_CASE("utf/codepoint_iterator", "iterators for decoding a string on the fly"
         CHECK(it == last);
     }
 }
+
+namespace {
+    // reference encoding of a codepoint sequence, one codepoint at a time
+    template <typename E, typename T>
+    std::vector<T> encode_all(const std::vector<codepoint_type>& cps) {
+        std::vector<T> res;
+        for (size_t i = 0; i < cps.size(); ++i) {
+            utf_traits<E>::encode(cps[i], std::back_inserter(res));
+        }
+        return res;
+    }
+
+    // long text with ASCII runs of varying length around multi-byte characters,
+    // so SIMD blocks are split at every possible offset
+    std::vector<codepoint_type> mixed_text() {
+        const codepoint_type specials[] = { 0xf8, 0x20ac, 0x1f4a9, 0x7ff, 0x800, 0xffff, 0x10000, 0x10ffff };
+        std::vector<codepoint_type> cps(3, 0x61);
+        for (size_t run = 0; run < 70; ++run) {
+            for (size_t i = 0; i < run; ++i) {
+                cps.push_back(0x20 + (i % 0x5f));
+            }
+            cps.push_back(specials[run % elems(specials)]);
+        }
+        for (size_t i = 0; i < 200; ++i) {
+            cps.push_back(0x61 + (i % 26));
+        }
+        return cps;
+    }
+
+    // mostly CJK with some Latin, Cyrillic, punctuation and the odd emoji
+    std::vector<codepoint_type> cjk_text() {
+        std::vector<codepoint_type> cps(3, 0x61);
+        for (size_t i = 0; i < 1500; ++i) {
+            if (i % 97 == 0) { cps.push_back(0x1f600 + i % 50); }
+            else if (i % 13 == 0) { cps.push_back(0x3001); }
+            else if (i % 31 < 4) { cps.push_back(0x61 + i % 26); }
+            else if (i % 37 < 3) { cps.push_back(0x430 + i % 32); }
+            else { cps.push_back(0x4e00 + (i * 7919) % 0x5000); }
+        }
+        return cps;
+    }
+
+    template <typename ESrc, typename TSrc, typename EDest, typename TDest>
+    void check_transcode(const std::vector<codepoint_type>& cps) {
+        std::vector<TSrc> src = encode_all<ESrc, TSrc>(cps);
+        std::vector<TDest> expected = encode_all<EDest, TDest>(cps);
+        for (size_t offset = 0; offset < 3; ++offset) {
+            stringview<const TSrc*, ESrc> sv(src.data() + offset, src.data() + src.size());
+            size_t skip = encode_all<EDest, TDest>(std::vector<codepoint_type>(cps.begin(), cps.begin() + offset)).size();
+
+            std::vector<TDest> buf(expected.size() - skip + 1);
+            TDest* end = sv.template to<EDest>(buf.data());
+            CHECK(end == buf.data() + expected.size() - skip);
+            CHECK(std::equal(buf.data(), end, expected.begin() + skip));
+
+            std::vector<TDest> appended;
+            sv.template to<EDest>(std::back_inserter(appended));
+            CHECK(appended == std::vector<TDest>(expected.begin() + skip, expected.end()));
+        }
+    }
+}
+
+TEST_CASE("utf/stringview/to/ascii", "ASCII runs are copied in bulk, mixed with slow path codepoints") {
+    std::vector<codepoint_type> cps = mixed_text();
+
+    check_transcode<utf8, char, utf8, char>(cps);
+    check_transcode<utf8, char, utf16, char16_t>(cps);
+    check_transcode<utf8, char, utf32, char32_t>(cps);
+    check_transcode<utf16, char16_t, utf8, char>(cps);
+    check_transcode<utf16, char16_t, utf16, char16_t>(cps);
+    check_transcode<utf16, char16_t, utf32, char32_t>(cps);
+    check_transcode<utf32, char32_t, utf8, char>(cps);
+    check_transcode<utf32, char32_t, utf16, char16_t>(cps);
+    check_transcode<utf32, char32_t, utf32, char32_t>(cps);
+
+    SECTION("other codeunit types", "") {
+        check_transcode<utf8, unsigned char, utf16, int16_t>(cps);
+        check_transcode<utf16, uint16_t, utf8, signed char>(cps);
+        check_transcode<utf32, int32_t, utf8, unsigned char>(cps);
+    }
+}
+
+TEST_CASE("utf/stringview/validate/utf8", "The block validator must agree with the scalar reference") {
+    // one sequence of each kind, placed at every offset around the block boundaries
+    const unsigned char sequences[][4] = {
+        {0xc3, 0xb8}, {0xe0, 0xa0, 0x80}, {0xe2, 0x82, 0xac}, {0xed, 0x9f, 0xbf}, {0xf0, 0x9f, 0x92, 0xa9}, {0xf4, 0x8f, 0xbf, 0xbf}, // valid
+        {0xc0, 0xb8}, {0xc1, 0xbf}, {0xe0, 0x9f, 0xbf}, {0xf0, 0x8f, 0xbf, 0xbf}, // overlong
+        {0xed, 0xa0, 0x80}, {0xed, 0xbf, 0xbf}, // surrogates
+        {0xf4, 0x90, 0x80, 0x80}, {0xf5, 0x80, 0x80, 0x80}, {0xf8, 0x80, 0x80, 0x80}, {0xff}, // out of range
+        {0xc3}, {0xe2, 0x82}, {0xf0, 0x9f, 0x92}, {0x80}, {0xc3, 0xb8, 0x80} // truncated or stray continuation
+    };
+    const size_t lengths[] = { 2, 3, 3, 3, 4, 4, 2, 2, 3, 4, 3, 3, 4, 4, 4, 1, 1, 2, 3, 1, 3 };
+    const size_t valid = 6;
+
+    for (size_t s = 0; s < elems(lengths); ++s) {
+        for (size_t offset = 0; offset < 70; ++offset) {
+            for (size_t padding = 0; padding < 70; padding += 23) {
+                std::vector<char> buf(offset, 'a');
+                buf.insert(buf.end(), sequences[s], sequences[s] + lengths[s]);
+                buf.insert(buf.end(), padding, 'b');
+
+                stringview<const char*> sv(buf.data(), buf.data() + buf.size());
+                CHECK(sv.validate() == (s < valid));
+                CHECK(sv.validate() == validate_scalar<utf8>(buf.data(), buf.data() + buf.size()));
+            }
+        }
+    }
+}
+
+TEST_CASE("utf/transcode", "Bulk conversion of contiguous buffers") {
+    std::vector<codepoint_type> cps = mixed_text();
+    std::vector<char> s8 = encode_all<utf8, char>(cps);
+    std::vector<char16_t> s16 = encode_all<utf16, char16_t>(cps);
+
+    SECTION("pointers", "") {
+        std::vector<char16_t> buf(s16.size());
+        transcode_result res = transcode<utf8, utf16>(s8.data(), s8.data() + s8.size(), buf.data());
+        CHECK(res.read == s8.size());
+        CHECK(res.written == s16.size());
+        CHECK(buf == s16);
+
+        std::vector<char> back(s8.size());
+        res = transcode<utf16, utf8>(s16.data(), s16.size(), back.data());
+        CHECK(res.read == s16.size());
+        CHECK(res.written == s8.size());
+        CHECK(back == s8);
+    }
+    SECTION("truncated input", "A sequence cut off by the end of the input is not consumed") {
+        const char str[] = { 0x61, (char)0xe2, (char)0x82, (char)0xac, 0x62, (char)0xf0, (char)0x9f, (char)0x92 };
+        char32_t buf[8];
+        transcode_result res = transcode<utf8, utf32>(str, elems(str), buf);
+        CHECK(res.read == 5);
+        CHECK(res.written == 3);
+        CHECK(buf[1] == 0x20ac);
+    }
+    SECTION("container iterators", "stringviews over std::vector and std::string use the contiguous path") {
+        stringview<std::vector<char>::const_iterator> sv(s8.begin(), s8.end());
+        CHECK(sv.validate());
+        std::vector<char16_t> buf(s16.size());
+        CHECK(sv.to<utf16>(buf.begin()) == buf.end());
+        CHECK(buf == s16);
+
+        std::string str(s8.begin(), s8.end());
+        std::string out(str.size(), ' ');
+        CHECK(make_stringview(str.begin(), str.end()).to<utf8>(out.begin()) == out.end());
+        CHECK(out == str);
+    }
+#ifdef UTFHPP_HAS_STRING_VIEW
+    SECTION("string_view", "") {
+        std::vector<char32_t> buf(cps.size());
+        transcode_result res = transcode<utf8, utf32>(std::string_view(s8.data(), s8.size()), buf.data());
+        CHECK(res.read == s8.size());
+        CHECK(res.written == cps.size());
+        CHECK(std::equal(buf.begin(), buf.end(), cps.begin()));
+    }
+#endif
+#ifdef UTFHPP_HAS_SPAN
+    SECTION("span", "") {
+        std::vector<char> buf(s8.size());
+        transcode_result res = transcode<utf16, utf8>(std::span<const char16_t>(s16), std::span<char>(buf));
+        CHECK(res.read == s16.size());
+        CHECK(res.written == s8.size());
+        CHECK(buf == s8);
+
+        // a span too small for the output is filled, and not written past
+        std::vector<char> small(s8.size() / 2);
+        res = transcode<utf16, utf8>(std::span<const char16_t>(s16), std::span<char>(small));
+        CHECK(res.read < s16.size());
+        CHECK(res.written <= small.size());
+        CHECK(res.written + 4 > small.size());
+        CHECK(std::equal(small.begin(), small.begin() + res.written, s8.begin()));
+    }
+#endif
+}
+
+TEST_CASE("utf/stringview/to_checked", "Validate while converting, reporting the first error") {
+    SECTION("valid input", "") {
+        std::vector<codepoint_type> cps = mixed_text();
+        std::vector<char> s8 = encode_all<utf8, char>(cps);
+        std::vector<char16_t> s16 = encode_all<utf16, char16_t>(cps);
+        std::vector<char16_t> buf(s16.size());
+
+        checked_result<char16_t*> res = make_stringview(s8.data(), s8.data() + s8.size()).to_checked<utf16>(buf.data());
+        CHECK(res.ok());
+        CHECK(res.offset == s8.size());
+        CHECK(res.dest == buf.data() + buf.size());
+        CHECK(buf == s16);
+
+        std::string str;
+        checked_result<std::back_insert_iterator<std::string> > res2 = make_stringview(s16.begin(), s16.end()).to_checked<utf8>(std::back_inserter(str));
+        CHECK(res2.ok());
+        CHECK(std::equal(str.begin(), str.end(), s8.begin()));
+    }
+
+    SECTION("utf8 errors", "") {
+        struct {
+            unsigned char seq[4];
+            size_t len;
+            error_kind error;
+        } cases[] = {
+            { {0xc3}, 1, error_kind::truncated },
+            { {0xe2, 0x82, 0x61}, 3, error_kind::truncated },
+            { {0xc1, 0xbf}, 2, error_kind::overlong },
+            { {0xe0, 0x9f, 0xbf}, 3, error_kind::overlong },
+            { {0xf0, 0x8f, 0xbf, 0xbf}, 4, error_kind::overlong },
+            { {0xed, 0xa0, 0x80}, 3, error_kind::surrogate },
+            { {0xf4, 0x90, 0x80, 0x80}, 4, error_kind::out_of_range },
+            { {0xf5, 0x80, 0x80, 0x80}, 4, error_kind::out_of_range },
+            { {0x80}, 1, error_kind::invalid_codeunit },
+            { {0xff}, 1, error_kind::invalid_codeunit }
+        };
+        for (size_t i = 0; i < elems(cases); ++i) {
+            // 40 ASCII bytes and a valid 2-byte sequence in front of the error
+            std::vector<char> buf(40, 'a');
+            buf.push_back((char)0xc3);
+            buf.push_back((char)0xb8);
+            buf.insert(buf.end(), cases[i].seq, cases[i].seq + cases[i].len);
+
+            std::u32string out;
+            stringview<const char*> sv(buf.data(), buf.data() + buf.size());
+            checked_result<std::back_insert_iterator<std::u32string> > res = sv.to_checked<utf32>(std::back_inserter(out));
+            CHECK(res.error == cases[i].error);
+            CHECK(res.offset == 42);
+            CHECK(out.size() == 41);
+            CHECK(!sv.validate());
+        }
+    }
+
+    SECTION("utf16 errors", "") {
+        const char16_t lone_trail[] = { 0x61, 0xdc00, 0x61 };
+        const char16_t lone_lead[] = { 0x61, 0x62, 0xd800, 0x61 };
+        const char16_t cut_off[] = { 0x61, 0xd83d };
+        char buf[16];
+        CHECK(make_stringview(lone_trail).to_checked<utf8>(buf).error == error_kind::surrogate);
+        CHECK(make_stringview(lone_trail).to_checked<utf8>(buf).offset == 1);
+        CHECK(make_stringview(lone_lead).to_checked<utf8>(buf).error == error_kind::surrogate);
+        CHECK(make_stringview(lone_lead).to_checked<utf8>(buf).offset == 2);
+        CHECK(make_stringview(cut_off).to_checked<utf8>(buf).error == error_kind::truncated);
+    }
+
+    SECTION("errors after a block", "The output must fit a buffer sized for the output before the error") {
+        std::u16string s(8, 0xe9);
+        s += std::u16string(16, 0xdc00);
+        const simd_level initial = active_simd_level();
+        for (int i = 0; i <= static_cast<int>(supported_simd_level()); ++i) {
+            set_simd_level(static_cast<simd_level>(i));
+            std::vector<char> out(16);
+            checked_result<char*> res = make_stringview(s.begin(), s.end()).to_checked<utf8>(out.data());
+            CHECK(res.error == error_kind::surrogate);
+            CHECK(res.offset == 8);
+            CHECK(res.dest == out.data() + out.size());
+
+            std::vector<char> skipped(16);
+            CHECK(make_stringview(s.begin(), s.end()).to<utf8, policy::skip>(skipped.data()) == skipped.data() + skipped.size());
+            CHECK(skipped == out);
+        }
+        set_simd_level(initial);
+    }
+
+    SECTION("nothing written to an empty container", "Its iterators must not be dereferenced") {
+        const char bad[] = { (char)0xff, 'a' };
+        std::vector<char16_t> out;
+        checked_result<std::vector<char16_t>::iterator> res = make_stringview(bad, bad + 2).to_checked<utf16>(out.begin());
+        CHECK(res.error == error_kind::invalid_codeunit);
+        CHECK(res.dest == out.begin());
+        CHECK(make_stringview(bad, bad + 2).to<utf16, policy::strict>(out.begin()).dest == out.begin());
+
+        const char cont[] = { (char)0x80, (char)0x80 };
+        std::string skipped;
+        CHECK(make_stringview(cont, cont + 2).to<utf8, policy::skip>(skipped.begin()) == skipped.begin());
+
+        const char empty[] = { 'a' };
+        CHECK(make_stringview(empty, empty).to<utf16>(out.begin()) == out.begin());
+    }
+
+    SECTION("utf32 errors", "") {
+        const char32_t surrogate[] = { 0x61, 0xdfff };
+        const char32_t too_large[] = { 0x110000 };
+        char16_t buf[16];
+        CHECK(make_stringview(surrogate).to_checked<utf16>(buf).error == error_kind::surrogate);
+        CHECK(make_stringview(surrogate).to_checked<utf16>(buf).offset == 1);
+        CHECK(make_stringview(too_large).to_checked<utf16>(buf).error == error_kind::out_of_range);
+    }
+}
+
+TEST_CASE("utf/stringview/codepoints", "Counting codepoints without decoding") {
+    std::vector<codepoint_type> cps = mixed_text();
+    // long enough to flush the vector counters at least once
+    for (size_t i = 0; i < 6; ++i) {
+        std::vector<codepoint_type> copy(cps);
+        cps.insert(cps.end(), copy.begin(), copy.end());
+    }
+    std::vector<char> s8 = encode_all<utf8, char>(cps);
+    std::vector<char16_t> s16 = encode_all<utf16, char16_t>(cps);
+    std::vector<char32_t> s32 = encode_all<utf32, char32_t>(cps);
+
+    for (size_t offset = 0; offset < 3; ++offset) {
+        CHECK(make_stringview(s8.data() + offset, s8.data() + s8.size()).codepoints() == cps.size() - offset);
+        CHECK(make_stringview(s16.data() + offset, s16.data() + s16.size()).codepoints() == cps.size() - offset);
+        CHECK(make_stringview(s32.data() + offset, s32.data() + s32.size()).codepoints() == cps.size() - offset);
+    }
+    std::string str(s8.begin(), s8.end());
+    CHECK(make_stringview(str.begin(), str.end()).codepoints() == cps.size());
+
+    SECTION("empty", "") {
+        CHECK(stringview<const char*>().empty());
+        CHECK(make_stringview(s8.data(), s8.data()).empty());
+        CHECK(!make_stringview(s8.data(), s8.data() + 1).empty());
+    }
+}
+
+TEST_CASE("utf/stringview/compare", "") {
+    const char s8[] = { 0x61, (char)0xc3, (char)0xb8, (char)0xf0, (char)0x9f, (char)0x92, (char)0xa9 };
+    const char16_t s16[] = { 0x61, 0xf8, 0xd83d, 0xdca9 };
+    const char16_t other16[] = { 0x61, 0xf8, 0xd83d, 0xdcaa };
+    const char32_t s32[] = { 0x61, 0xf8, 0x1f4a9 };
+
+    CHECK(make_stringview(s8) == make_stringview(s8));
+    CHECK(make_stringview(s8) == make_stringview(s16));
+    CHECK(make_stringview(s16) == make_stringview(s32));
+    CHECK(!(make_stringview(s8) != make_stringview(s32)));
+    CHECK(make_stringview(s16) != make_stringview(other16));
+    CHECK(make_stringview(s8) != make_stringview(other16));
+    CHECK(make_stringview(s8) != make_stringview(s32, s32 + 2));
+    CHECK(make_stringview(s32, s32 + 2) != make_stringview(s8));
+    CHECK(make_stringview(s8, s8 + 3) != make_stringview(s8));
+}
+
+template <typename ESrc, typename TSrc>
+void check_codeunits(const std::vector<codepoint_type>& cps) {
+    std::vector<TSrc> src = encode_all<ESrc, TSrc>(cps);
+    stringview<const TSrc*, ESrc> sv(src.data(), src.data() + src.size());
+    size_t l8 = encode_all<utf8, char>(cps).size();
+    size_t l16 = encode_all<utf16, char16_t>(cps).size();
+    size_t l32 = cps.size();
+
+    CHECK(sv.template codeunits<utf8>() == l8);
+    CHECK(sv.template codeunits<utf16>() == l16);
+    CHECK(sv.template codeunits<utf32>() == l32);
+    CHECK(sv.template max_codeunits<utf8>() >= l8);
+    CHECK(sv.template max_codeunits<utf16>() >= l16);
+    CHECK(sv.template max_codeunits<utf32>() >= l32);
+
+    typename std::vector<TSrc>::const_iterator first = src.begin();
+    CHECK(make_stringview(first, first + src.size()).template codeunits<utf8>() == l8);
+}
+
+TEST_CASE("utf/stringview/codeunits", "Output lengths computed without decoding") {
+    std::vector<codepoint_type> cps = mixed_text();
+    for (size_t i = 0; i < 8; ++i) {
+        std::vector<codepoint_type> copy(cps);
+        cps.insert(cps.end(), copy.begin(), copy.end());
+    }
+    check_codeunits<utf8, char>(cps);
+    check_codeunits<utf16, char16_t>(cps);
+    check_codeunits<utf32, char32_t>(cps);
+
+    SECTION("worst case expansion", "") {
+        std::vector<char16_t> s16 = encode_all<utf16, char16_t>(std::vector<codepoint_type>(100, 0xffff));
+        CHECK(make_stringview(s16.data(), s16.data() + s16.size()).max_codeunits<utf8>() == 300);
+        std::vector<codepoint_type> astral(100, 0x10ffff);
+        std::vector<char32_t> s32 = encode_all<utf32, char32_t>(astral);
+        CHECK(make_stringview(s32.data(), s32.data() + s32.size()).max_codeunits<utf8>() == 400);
+        CHECK(make_stringview(s32.data(), s32.data() + s32.size()).codeunits<utf8>() == 400);
+    }
+}
+
+TEST_CASE("utf/stringview/to/utf16", "UTF-16 block kernels on non-ASCII text") {
+    std::vector<codepoint_type> cps = cjk_text();
+
+    check_transcode<utf16, char16_t, utf8, char>(cps);
+    check_transcode<utf16, char16_t, utf8, unsigned char>(cps);
+    check_transcode<utf16, char16_t, utf32, char32_t>(cps);
+    check_transcode<utf8, char, utf16, char16_t>(cps);
+
+    std::vector<char16_t> s16 = encode_all<utf16, char16_t>(cps);
+    std::vector<char> s8 = encode_all<utf8, char>(cps);
+    std::vector<char> buf(s8.size());
+    checked_result<char*> res = make_stringview(s16.data(), s16.data() + s16.size()).to_checked<utf8>(buf.data());
+    CHECK(res.ok());
+    CHECK(buf == s8);
+}
+
+TEST_CASE("utf/stringview/validate/utf16", "The block validator must agree with the scalar reference") {
+    const char16_t sequences[][2] = {
+        {0x20ac}, {0xd83d, 0xdca9}, {0xdbff, 0xdfff}, // valid
+        {0xdc00}, {0xd800, 0x61}, {0xd800, 0xd800}, {0xd800} // unpaired
+    };
+    const size_t lengths[] = { 1, 2, 2, 1, 2, 2, 1 };
+    const size_t valid = 3;
+
+    for (size_t s = 0; s < elems(lengths); ++s) {
+        for (size_t offset = 0; offset < 20; ++offset) {
+            for (size_t padding = 0; padding < 20; padding += 7) {
+                std::vector<char16_t> buf(offset, 0x4e00);
+                buf.insert(buf.end(), sequences[s], sequences[s] + lengths[s]);
+                buf.insert(buf.end(), padding, 0x61);
+
+                stringview<const char16_t*> sv(buf.data(), buf.data() + buf.size());
+                CHECK(sv.validate() == (s < valid));
+                CHECK(sv.validate() == validate_scalar<utf16>(buf.data(), buf.data() + buf.size()));
+                std::string out;
+                CHECK(sv.to_checked<utf8>(std::back_inserter(out)).ok() == sv.validate());
+            }
+        }
+    }
+}
+
+namespace {
+    // a block of BMP codepoints followed by lone surrogates, converted into
+    // a buffer exactly the size of the output before the error
+    template <typename E>
+    void check_utf32_error_after_block() {
+        std::vector<codepoint_type> cps(8, 0x4e00);
+        cps.insert(cps.end(), 16, 0xd800);
+        std::vector<char32_t> s32 = encode_all<E, char32_t>(cps);
+        stringview<const char32_t*, E> sv(s32.data(), s32.data() + s32.size());
+        std::vector<char> buf(24);
+        checked_result<char*> res = sv.template to_checked<utf8>(buf.data());
+        CHECK(res.error == error_kind::surrogate);
+        CHECK(res.offset == 8);
+        CHECK(res.dest == buf.data() + buf.size());
+        std::vector<char> skipped(24);
+        CHECK((sv.template to<utf8, policy::skip>(skipped.data())) == skipped.data() + skipped.size());
+    }
+}
+
+TEST_CASE("utf/stringview/to/utf32", "UTF-32 and UTF-8 decoding block kernels on non-ASCII text") {
+    std::vector<codepoint_type> cjk = cjk_text();
+    std::vector<codepoint_type> mixed = mixed_text();
+
+    check_transcode<utf32, char32_t, utf8, char>(cjk);
+    check_transcode<utf32, char32_t, utf16, char16_t>(cjk);
+    check_transcode<utf8, char, utf32, char32_t>(cjk);
+    check_transcode<utf8, char, utf16, char16_t>(mixed);
+    check_transcode<utf8, char, utf32, uint32_t>(mixed);
+    check_transcode<utf16, char16_t, utf32, char32_t>(mixed);
+    check_transcode<utf32, char32_t, utf16, char16_t>(mixed);
+
+    SECTION("invalid UTF-32 inside a block") {
+        const codepoint_type bad[] = { 0xd800, 0xdfff, 0x110000 };
+        for (size_t b = 0; b < elems(bad); ++b) {
+            for (size_t pos = 0; pos < 20; ++pos) {
+                std::vector<char32_t> s32(40, 0x4e00);
+                s32[pos] = bad[b];
+                stringview<const char32_t*> sv(s32.data(), s32.data() + s32.size());
+                std::vector<char> buf(200);
+                checked_result<char*> r8 = sv.to_checked<utf8>(buf.data());
+                CHECK(!r8.ok());
+                CHECK(r8.offset == pos);
+                std::vector<char16_t> buf16(200);
+                checked_result<char16_t*> r16 = sv.to_checked<utf16>(buf16.data());
+                CHECK(!r16.ok());
+                CHECK(r16.offset == pos);
+            }
+        }
+    }
+
+    SECTION("invalid UTF-8 inside a window") {
+        const char* sequences[] = {
+            "\xc0\xaf", "\xe0\x80\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xf8\x88\x80\x80\x80",
+            "\xe4\xb8", "\x80", "\xc3\x61"
+        };
+        for (size_t s = 0; s < elems(sequences); ++s) {
+            for (size_t pos = 0; pos < 12; ++pos) {
+                std::string s8;
+                for (size_t i = 0; i < pos; ++i) { s8 += "\xc3\xa9"; }
+                s8 += sequences[s];
+                for (size_t i = 0; i < 12; ++i) { s8 += "\xe4\xb8\x80"; }
+
+                stringview<const char*> sv(s8.data(), s8.data() + s8.size());
+                std::vector<char32_t> buf32(s8.size());
+                checked_result<char32_t*> r32 = sv.to_checked<utf32>(buf32.data());
+                CHECK(!r32.ok());
+                CHECK(r32.offset == 2 * pos);
+                CHECK(std::vector<char32_t>(buf32.data(), r32.dest) == std::vector<char32_t>(pos, 0xe9));
+                std::vector<char16_t> buf16(s8.size());
+                CHECK(sv.to_checked<utf16>(buf16.data()).offset == 2 * pos);
+            }
+        }
+    }
+
+    SECTION("invalid input after a block", "The output must fit a buffer sized for the output before the error") {
+        // a window of three sequences, and an overlong sequence running past it
+        std::string s8 = "\xe4\xb8\x80\xe4\xb8\x80\xc3\xa9\xf0";
+        s8 += std::string(20, '\x80');
+        stringview<const char*> sv(s8.data(), s8.data() + s8.size());
+        const simd_level initial = active_simd_level();
+        for (int i = 0; i <= static_cast<int>(supported_simd_level()); ++i) {
+            set_simd_level(static_cast<simd_level>(i));
+            std::vector<char32_t> buf32(3);
+            checked_result<char32_t*> r32 = sv.to_checked<utf32>(buf32.data());
+            CHECK(r32.offset == 8);
+            CHECK(r32.dest == buf32.data() + buf32.size());
+            std::vector<char16_t> buf16(3);
+            checked_result<char16_t*> r16 = sv.to_checked<utf16>(buf16.data());
+            CHECK(r16.offset == 8);
+            CHECK(r16.dest == buf16.data() + buf16.size());
+
+            check_utf32_error_after_block<utf32>();
+            check_utf32_error_after_block<utf32be>();
+            check_utf32_error_after_block<utf32le>();
+        }
+        set_simd_level(initial);
+    }
+}
+
+TEST_CASE("utf/stringview/to/latin1", "Latin-1 conversions, and codepoints Latin-1 cannot encode") {
+    // ASCII runs of varying length around characters from the upper half,
+    // then a long stretch without any ASCII
+    std::vector<codepoint_type> cps(3, 0x61);
+    for (size_t run = 0; run < 70; ++run) {
+        for (size_t i = 0; i < run % 23; ++i) {
+            cps.push_back(0x20 + (i % 0x5f));
+        }
+        cps.push_back(0x80 + (run * 37) % 0x80);
+        if (run % 3 == 0) { cps.push_back(0xe9); }
+    }
+    for (size_t i = 0; i < 300; ++i) {
+        cps.push_back(0x80 + (i * 7) % 0x80);
+    }
+
+    check_transcode<latin1, char, utf8, char>(cps);
+    check_transcode<latin1, char, utf16, char16_t>(cps);
+    check_transcode<latin1, char, utf32, char32_t>(cps);
+    check_transcode<latin1, char, utf16be, char16_t>(cps);
+    check_transcode<latin1, char, utf32be, char32_t>(cps);
+    check_transcode<latin1, char, latin1, char>(cps);
+    check_transcode<utf8, char, latin1, char>(cps);
+    check_transcode<utf16, char16_t, latin1, char>(cps);
+    check_transcode<utf32, char32_t, latin1, char>(cps);
+    check_transcode<utf16be, char16_t, latin1, char>(cps);
+    check_transcode<utf32be, char32_t, latin1, char>(cps);
+
+    std::vector<char> s = encode_all<latin1, char>(cps);
+    stringview<const char*, latin1> sv(s.data(), s.data() + s.size());
+    CHECK(s.size() == cps.size());
+    CHECK(sv.validate());
+    CHECK(sv.codepoints() == cps.size());
+    CHECK(sv.codeunits<utf8>() == encode_all<utf8, char>(cps).size());
+    CHECK(sv.codeunits<utf16>() == cps.size());
+    CHECK(sv.codeunits<utf32>() == cps.size());
+    CHECK(std::u32string(sv.begin(), sv.end()) == std::u32string(cps.begin(), cps.end()));
+    CHECK(std::u32string(sv.rbegin(), sv.rend()) == std::u32string(cps.rbegin(), cps.rend()));
+
+    SECTION("every byte is a codepoint") {
+        char bytes[256];
+        for (size_t i = 0; i < 256; ++i) {
+            bytes[i] = static_cast<char>(i);
+        }
+        stringview<const char*, latin1> all(bytes, bytes + 256);
+        CHECK(all.validate());
+        std::u32string decoded;
+        all.to<utf32>(std::back_inserter(decoded));
+        REQUIRE(decoded.size() == 256);
+        for (size_t i = 0; i < 256; ++i) {
+            CHECK(decoded[i] == i);
+        }
+    }
+
+    SECTION("codepoints Latin-1 cannot encode") {
+        std::vector<codepoint_type> text(40, 0x61);
+        const codepoint_type rest[] = { 0xe9, 0x20ac, 0x62, 0x1f4a9, 0x63 };
+        text.insert(text.end(), rest, rest + elems(rest));
+        std::vector<char> s8 = encode_all<utf8, char>(text);
+        std::vector<char16_t> s16 = encode_all<utf16, char16_t>(text);
+        stringview<const char*> sv8(s8.data(), s8.data() + s8.size());
+        stringview<const char16_t*> sv16(s16.data(), s16.data() + s16.size());
+
+        std::string replaced = std::string(40, 'a') + "\xe9?b?c";
+        std::string str;
+        sv8.to<latin1>(std::back_inserter(str));
+        CHECK(str == replaced);
+        CHECK(sv8.codeunits<latin1>() == replaced.size());
+        str.clear();
+        sv16.to<latin1, policy::replace>(std::back_inserter(str));
+        CHECK(str == replaced);
+        str.clear();
+        sv16.to<latin1, policy::skip>(std::back_inserter(str));
+        CHECK(str == std::string(40, 'a') + "\xe9" "bc");
+
+        char buf[64];
+        checked_result<char*> res = sv8.to_checked<latin1>(buf);
+        CHECK(res.error == error_kind::unrepresentable);
+        CHECK(res.offset == 42);
+        CHECK(res.dest == buf + 41);
+        CHECK(sv16.to_checked<latin1>(buf).offset == 41);
+
+        // around the block boundaries of the vector code
+        for (size_t pos = 0; pos < 40; ++pos) {
+            std::vector<codepoint_type> cps2(60, 0xe0);
+            cps2[pos] = 0x4e00;
+            std::vector<char> expected = encode_all<latin1, char>(cps2);
+            std::vector<char> out(cps2.size());
+            std::vector<char> u8 = encode_all<utf8, char>(cps2);
+            CHECK(stringview<const char*>(u8.data(), u8.data() + u8.size()).to<latin1>(out.data()) == out.data() + out.size());
+            CHECK(out == expected);
+            CHECK(expected[pos] == '?');
+        }
+
+        // a block of 2-byte sequences, then 4-byte sequences giving one byte each
+        std::vector<codepoint_type> cps3(8, 0xe9);
+        cps3.insert(cps3.end(), 8, 0x1f600);
+        std::vector<char> u8 = encode_all<utf8, char>(cps3);
+        stringview<const char*> sv3(u8.data(), u8.data() + u8.size());
+        const simd_level initial = active_simd_level();
+        for (int i = 0; i <= static_cast<int>(supported_simd_level()); ++i) {
+            set_simd_level(static_cast<simd_level>(i));
+            std::vector<char> out(sv3.codeunits<latin1>());
+            REQUIRE(out.size() == 16);
+            CHECK(sv3.to<latin1>(out.data()) == out.data() + out.size());
+            CHECK(out == encode_all<latin1, char>(cps3));
+            std::vector<char> checked(8);
+            CHECK(sv3.to_checked<latin1>(checked.data()).dest == checked.data() + checked.size());
+        }
+        set_simd_level(initial);
+    }
+}
+
+namespace {
+    // ASCII runs of varying length around the codepoints the codepage defines
+    template <typename E>
+    std::vector<codepoint_type> codepage_text() {
+        std::vector<codepoint_type> cps(3, 0x61);
+        size_t b = 0;
+        for (size_t run = 0; run < 200; ++run) {
+            for (size_t i = 0; i < run % 19; ++i) {
+                cps.push_back(0x20 + (i % 0x5f));
+            }
+            for (size_t i = 0; i < 1 + run % 4; ++i, b += 37) {
+                char c = static_cast<char>(0x80 + b % 0x80);
+                codepoint_type cp = utf_traits<E>::decode(&c);
+                if (cp != 0xfffd) { cps.push_back(cp); }
+            }
+        }
+        return cps;
+    }
+
+    template <typename E>
+    void check_codepage() {
+        std::vector<codepoint_type> cps = codepage_text<E>();
+        check_transcode<E, char, utf8, char>(cps);
+        check_transcode<E, char, utf16, char16_t>(cps);
+        check_transcode<E, char, utf32be, char32_t>(cps);
+        check_transcode<E, char, E, char>(cps);
+        check_transcode<utf8, char, E, char>(cps);
+        check_transcode<utf16, char16_t, E, char>(cps);
+        check_transcode<utf32, char32_t, E, char>(cps);
+
+        std::vector<char> s = encode_all<E, char>(cps);
+        stringview<const char*, E> sv(s.data(), s.data() + s.size());
+        CHECK(s.size() == cps.size());
+        CHECK(sv.validate());
+        CHECK(sv.codepoints() == cps.size());
+        CHECK(sv.template codeunits<utf8>() == encode_all<utf8, char>(cps).size());
+        CHECK(sv.template codeunits<utf8>() <= sv.template max_codeunits<utf8>());
+        CHECK(sv.template codeunits<utf16>() == cps.size());
+        CHECK(std::u32string(sv.begin(), sv.end()) == std::u32string(cps.begin(), cps.end()));
+    }
+}
+
+TEST_CASE("utf/stringview/to/codepage", "Table-driven single byte codepages") {
+    check_codepage<windows1250>();
+    check_codepage<windows1251>();
+    check_codepage<windows1252>();
+    check_codepage<windows1253>();
+    check_codepage<iso8859_2>();
+    check_codepage<iso8859_7>();
+    check_codepage<iso8859_15>();
+    check_codepage<koi8_r>();
+    check_codepage<koi8_u>();
+
+    // the euro sign, S with caron and the trademark sign
+    std::string s8 = "a\xe2\x82\xac \xc5\xa0\xe2\x84\xa2";
+    std::string s1252;
+    stringview<const char*>(s8.data(), s8.data() + s8.size()).to<windows1252>(std::back_inserter(s1252));
+    CHECK(s1252 == "a\x80 \x8a\x99");
+    std::string back;
+    stringview<const char*, windows1252>(s1252.data(), s1252.data() + s1252.size()).to<utf8>(std::back_inserter(back));
+    CHECK(back == s8);
+
+    // Cyrillic capital A and small a
+    const char koi8[] = "\xe1\xc1";
+    std::u16string s16;
+    stringview<const char*, koi8_r>(koi8, koi8 + 2).to<utf16>(std::back_inserter(s16));
+    CHECK(s16 == u"\u0410\u0430");
+
+    SECTION("undefined bytes") {
+        std::string s = std::string(40, 'a') + "\x81" "b";
+        stringview<const char*, windows1252> sv(s.data(), s.data() + s.size());
+        CHECK(!sv.validate());
+        CHECK(stringview<const char*, koi8_r>(s.data(), s.data() + s.size()).validate());
+
+        std::u32string out;
+        checked_result<std::back_insert_iterator<std::u32string> > res = sv.to_checked<utf32>(std::back_inserter(out));
+        CHECK(res.error == error_kind::invalid_codeunit);
+        CHECK(res.offset == 40);
+        out.clear();
+        sv.to<utf32, policy::replace>(std::back_inserter(out));
+        CHECK(out == std::u32string(40, 'a') + U"\ufffdb");
+    }
+
+    SECTION("codepoints the codepage cannot encode") {
+        std::u32string s32 = U"a\u00e9\u4e00b\U0001f4a9\u0410";
+        std::string out;
+        stringview<const char32_t*>(s32.data(), s32.data() + s32.size()).to<windows1252>(std::back_inserter(out));
+        CHECK(out == "a\xe9?b??");
+        out.clear();
+        stringview<const char32_t*>(s32.data(), s32.data() + s32.size()).to<windows1251, policy::skip>(std::back_inserter(out));
+        CHECK(out == "ab\xc0");
+        char buf[8];
+        checked_result<char*> res = stringview<const char32_t*>(s32.data(), s32.data() + s32.size()).to_checked<koi8_r>(buf);
+        CHECK(res.error == error_kind::unrepresentable);
+        CHECK(res.offset == 1);
+    }
+}
+
+namespace {
+    template <typename E, typename T>
+    encoding_kind detect(const std::vector<codepoint_type>& cps, size_t bytes = size_t(-1)) {
+        std::vector<T> s = encode_all<E, T>(cps);
+        return detect_encoding(s.data(), std::min(bytes, s.size() * sizeof(T))).encoding;
+    }
+}
+
+TEST_CASE("utf/detect_encoding", "Byte order marks, and a scan of the start of the text") {
+    std::vector<codepoint_type> cjk = cjk_text();
+    std::vector<codepoint_type> mixed = mixed_text();
+    std::vector<codepoint_type> latin;
+    for (size_t i = 0; i < 500; ++i) {
+        latin.push_back(i % 7 == 0 ? 0xe9 : 0x61 + i % 26);
+    }
+    const std::vector<codepoint_type>* texts[] = { &cjk, &mixed, &latin };
+
+    for (size_t t = 0; t < elems(texts); ++t) {
+        const std::vector<codepoint_type>& cps = *texts[t];
+        CHECK(detect<utf8, char>(cps) == encoding_kind::utf8);
+        CHECK(detect<utf16le, char16_t>(cps) == encoding_kind::utf16le);
+        CHECK(detect<utf16be, char16_t>(cps) == encoding_kind::utf16be);
+        CHECK(detect<utf32le, char32_t>(cps) == encoding_kind::utf32le);
+        CHECK(detect<utf32be, char32_t>(cps) == encoding_kind::utf32be);
+    }
+
+    SECTION("byte order marks") {
+        const char* boms[] = { "\xef\xbb\xbf", "\xff\xfe", "\xfe\xff", "\xff\xfe\0\0", "\0\0\xfe\xff" };
+        const size_t lengths[] = { 3, 2, 2, 4, 4 };
+        const encoding_kind kinds[] = { encoding_kind::utf8, encoding_kind::utf16le, encoding_kind::utf16be, encoding_kind::utf32le, encoding_kind::utf32be };
+        for (size_t i = 0; i < elems(boms); ++i) {
+            std::string s(boms[i], lengths[i]);
+            s += "abc";
+            detected_encoding res = detect_encoding(s.data(), s.size());
+            CHECK(res.encoding == kinds[i]);
+            CHECK(res.bom_length == lengths[i]);
+        }
+    }
+
+    SECTION("edge cases") {
+        CHECK(detect_encoding("", 0).encoding == encoding_kind::utf8);
+        CHECK(detect_encoding("abc", 3).bom_length == 0);
+        std::string nul(40, 'a');
+        nul[20] = '\0';
+        CHECK(detect_encoding(nul.data(), nul.size()).encoding == encoding_kind::utf8);
+        // an odd number of bytes is not UTF-16
+        CHECK(detect_encoding("a\0b\0c", 5).encoding == encoding_kind::utf8);
+        std::vector<char16_t> unpaired(20, 0xd8d8);
+        CHECK(detect_encoding(unpaired.data(), unpaired.size() * 2).encoding == encoding_kind::unknown);
+    }
+
+    SECTION("only the start of long text is scanned") {
+        std::vector<codepoint_type> cps;
+        while (cps.size() < 100000) {
+            cps.insert(cps.end(), cjk.begin(), cjk.end());
+        }
+        std::vector<codepoint_type> bad(cps);
+        bad.push_back(0xd800);
+        CHECK(detect<utf8, char>(cps) == encoding_kind::utf8);
+        CHECK(detect<utf16be, char16_t>(cps) == encoding_kind::utf16be);
+        CHECK(detect<utf32le, char32_t>(bad) == encoding_kind::utf32le);
+        // a sequence split by the end of the scan is not an error
+        std::vector<char> s8 = encode_all<utf8, char>(cps);
+        for (size_t cut = 1; cut < 4; ++cut) {
+            CHECK(detect_encoding(s8.data(), (size_t(1) << 16) + cut).encoding == encoding_kind::utf8);
+        }
+    }
+
+    SECTION("every SIMD level gives the same guess") {
+        // zero bytes and two digits, often valid UTF-16 in both byte orders,
+        // with repeats straddling the 16-byte blocks of the SIMD scan
+        std::string s;
+        uint32_t seed = 1;
+        const simd_level initial = active_simd_level();
+        for (size_t len = 2; len < 300; ++len) {
+            s.resize(len);
+            for (size_t i = 0; i < len; ++i) {
+                seed = seed * 1103515245 + 12345;
+                s[i] = "\0\0" "01"[seed >> 16 & 3];
+            }
+            set_simd_level(simd_level::scalar);
+            encoding_stats expected;
+            expected.run(reinterpret_cast<const unsigned char*>(s.data()), len);
+            encoding_kind guess = detect_encoding(s.data(), len).encoding;
+            for (int i = 1; i <= static_cast<int>(supported_simd_level()); ++i) {
+                set_simd_level(static_cast<simd_level>(i));
+                encoding_stats stats;
+                stats.run(reinterpret_cast<const unsigned char*>(s.data()), len);
+                CHECK(std::equal(stats.zeros, stats.zeros + 4, expected.zeros));
+                CHECK(std::equal(stats.repeats, stats.repeats + 2, expected.repeats));
+                CHECK(std::equal(stats.utf16_errors, stats.utf16_errors + 2, expected.utf16_errors));
+                CHECK(std::equal(stats.utf32_errors, stats.utf32_errors + 2, expected.utf32_errors));
+                CHECK(detect_encoding(s.data(), len).encoding == guess);
+            }
+        }
+        set_simd_level(initial);
+    }
+}
+
+namespace {
+    // counts the allocations made through it
+    template <typename T>
+    struct counting_allocator {
+        typedef T value_type;
+        size_t* count;
+
+        explicit counting_allocator(size_t* count) : count(count) {}
+        template <typename U>
+        counting_allocator(const counting_allocator<U>& other) : count(other.count) {}
+
+        T* allocate(size_t n) {
+            ++*count;
+            return std::allocator<T>().allocate(n);
+        }
+        void deallocate(T* p, size_t n) { std::allocator<T>().deallocate(p, n); }
+
+        friend bool operator == (const counting_allocator& lhs, const counting_allocator& rhs) { return lhs.count == rhs.count; }
+        friend bool operator != (const counting_allocator& lhs, const counting_allocator& rhs) { return lhs.count != rhs.count; }
+    };
+}
+
+TEST_CASE("utf/convert", "Conversion to a string sized in one allocation") {
+    std::vector<codepoint_type> cps = mixed_text();
+    std::vector<char> s8 = encode_all<utf8, char>(cps);
+    std::vector<char16_t> s16 = encode_all<utf16, char16_t>(cps);
+    std::vector<char32_t> s32 = encode_all<utf32, char32_t>(cps);
+    stringview<const char*> sv8(s8.data(), s8.data() + s8.size());
+    stringview<std::vector<char16_t>::const_iterator> sv16(s16.begin(), s16.end());
+
+    CHECK(convert<utf16>(sv8) == std::u16string(s16.begin(), s16.end()));
+    CHECK(convert<utf32>(sv8) == std::u32string(s32.begin(), s32.end()));
+    CHECK(convert<utf8>(sv16) == std::string(s8.begin(), s8.end()));
+    CHECK(convert<utf8>(stringview<const char*>()).empty());
+
+    SECTION("one allocation") {
+        size_t count = 0;
+        counting_allocator<char16_t> alloc(&count);
+        std::basic_string<char16_t, std::char_traits<char16_t>, counting_allocator<char16_t> > res = convert<utf16>(sv8, alloc);
+        CHECK(res == std::u16string(s16.begin(), s16.end()).c_str());
+        CHECK(count == 1);
+    }
+
+    SECTION("reusing a buffer") {
+        size_t count = 0;
+        std::basic_string<char, std::char_traits<char>, counting_allocator<char> > buf((counting_allocator<char>(&count)));
+        convert_into<utf8>(sv16, buf);
+        CHECK(std::string(buf.begin(), buf.end()) == std::string(s8.begin(), s8.end()));
+        CHECK(count == 1);
+        // shorter and equally long outputs fit in the same storage
+        stringview<std::vector<char16_t>::const_iterator> half(s16.begin(), s16.begin() + s16.size() / 2);
+        convert_into(half, buf);
+        CHECK(buf.size() == half.codeunits<utf8>());
+        convert_into(sv16, buf);
+        CHECK(std::string(buf.begin(), buf.end()) == std::string(s8.begin(), s8.end()));
+        CHECK(count == 1);
+
+        std::vector<char32_t> v;
+        convert_into(sv8, v);
+        CHECK(v == s32);
+        convert_into<latin1>(stringview<const char*>(), buf);
+        CHECK(buf.empty());
+    }
+
+    SECTION("invalid input") {
+        const char truncated[] = "a\xe2\x82";
+        const char euro[] = "\xe2\x82\xac" "b";
+        const char bad_byte[] = "ab\xff" "cd";
+        const char continuation[] = "\x80";
+        CHECK(convert<utf16>(make_stringview(truncated, truncated + 3)) == u"a\ufffd");
+        CHECK(convert<latin1>(make_stringview(euro, euro + 4)) == "?b");
+        CHECK(convert<utf16>(make_stringview(bad_byte, bad_byte + 5)) == u"ab\ufffd" "cd");
+        CHECK(convert<utf32>(make_stringview(continuation, continuation + 1)) == U"\ufffd");
+        std::vector<char16_t> v;
+        convert_into(make_stringview(bad_byte, bad_byte + 5), v);
+        CHECK(std::u16string(v.begin(), v.end()) == u"ab\ufffd" "cd");
+        std::string s(1, 'x');
+        convert_into(make_stringview(continuation, continuation + 1), s);
+        CHECK(s == "\xef\xbf\xbd");
+
+        // valid text with random bytes mixed in converts as to() replacing them
+        unsigned seed = 1;
+        for (size_t round = 0; round < 200; ++round) {
+            std::vector<char> bad = s8;
+            for (size_t i = 0; i < 1 + round % 8; ++i) {
+                seed = seed * 1103515245 + 12345;
+                bad[(seed >> 8) % bad.size()] = static_cast<char>(seed >> 24);
+            }
+            stringview<const char*> sv(bad.data(), bad.data() + bad.size());
+            std::u16string expected;
+            sv.to<utf16, policy::replace>(std::back_inserter(expected));
+            CHECK(convert<utf16>(sv) == expected);
+            std::u32string expected32;
+            sv.to<utf32, policy::replace>(std::back_inserter(expected32));
+            CHECK(convert<utf32>(stringview<std::vector<char>::const_iterator>(bad.begin(), bad.end())) == expected32);
+            std::vector<char32_t> buf;
+            convert_into(sv, buf);
+            CHECK(std::u32string(buf.begin(), buf.end()) == expected32);
+        }
+    }
+
+#ifdef UTFHPP_HAS_PMR
+    SECTION("memory resource") {
+        char storage[1 << 16];
+        std::pmr::monotonic_buffer_resource pool(storage, sizeof(storage), std::pmr::null_memory_resource());
+        std::pmr::u16string res = convert<utf16>(sv8, &pool);
+        CHECK(std::u16string(res.begin(), res.end()) == std::u16string(s16.begin(), s16.end()));
+    }
+#endif
+}
+
+TEST_CASE("utf/stream_transcoder", "Chunked conversion carries split sequences over") {
+    std::vector<codepoint_type> cps = mixed_text();
+    std::vector<char> s8 = encode_all<utf8, char>(cps);
+    std::vector<char16_t> s16 = encode_all<utf16, char16_t>(cps);
+
+    SECTION("every chunk size gives the same output") {
+        for (size_t chunk = 1; chunk < 40; ++chunk) {
+            stream_transcoder<utf8, utf16> conv;
+            std::vector<char16_t> out;
+            for (size_t pos = 0; pos < s8.size(); pos += chunk) {
+                size_t len = std::min(chunk, s8.size() - pos);
+                conv.write(s8.data() + pos, len, std::back_inserter(out));
+                CHECK(conv.pending() < 4);
+            }
+            CHECK(conv.finish());
+            CHECK(out == s16);
+        }
+    }
+    SECTION("pointer output and non-pointer input") {
+        std::deque<char16_t> in(s16.begin(), s16.end());
+        stream_transcoder<utf16, utf8> conv;
+        std::vector<char> out(s8.size());
+        char* dest = out.data();
+        for (size_t pos = 0; pos < in.size(); pos += 7) {
+            dest = conv.write(in.begin() + pos, in.begin() + std::min(pos + 7, in.size()), dest);
+        }
+        CHECK(conv.finish());
+        CHECK(dest == out.data() + out.size());
+        CHECK(out == s8);
+    }
+    SECTION("a stream ending mid-sequence") {
+        const char text[] = "ab\xe2\x82";
+        stream_transcoder<utf8, utf32> conv;
+        std::u32string out;
+        conv.write(text, 3, std::back_inserter(out));
+        conv.write(text + 3, 1, std::back_inserter(out));
+        CHECK(out == U"ab");
+        CHECK(conv.pending() == 2);
+        CHECK(!conv.finish());
+        CHECK(conv.pending() == 0);
+        conv.write(text, 2, std::back_inserter(out));
+        CHECK(out == U"abab");
+    }
+}
+
+#ifndef UTFHPP_NO_THREADS
+TEST_CASE("utf/transcode_parallel", "Multi-threaded conversion matches the sequential one") {
+    std::vector<codepoint_type> cps;
+    std::vector<codepoint_type> text = mixed_text();
+    std::vector<codepoint_type> cjk = cjk_text();
+    while (cps.size() < 300000) {
+        cps.insert(cps.end(), text.begin(), text.end());
+        cps.insert(cps.end(), cjk.begin(), cjk.end());
+    }
+    std::vector<char> s8 = encode_all<utf8, char>(cps);
+    std::vector<char16_t> s16 = encode_all<utf16, char16_t>(cps);
+
+    for (unsigned threads = 1; threads < 8; threads += 2) {
+        std::vector<char16_t> out16(s16.size());
+        transcode_result res = transcode_parallel<utf8, utf16>(s8.data(), s8.size(), out16.data(), threads);
+        CHECK(res.read == s8.size());
+        CHECK(res.written == s16.size());
+        CHECK(out16 == s16);
+
+        std::vector<char> out8(s8.size());
+        res = transcode_parallel<utf16, utf8>(s16.data(), s16.data() + s16.size(), out8.data(), threads);
+        CHECK(res.read == s16.size());
+        CHECK(res.written == s8.size());
+        CHECK(out8 == s8);
+    }
+
+    SECTION("truncated input") {
+        std::vector<char16_t> out16(s16.size());
+        transcode_result res = transcode_parallel<utf8, utf16>(s8.data(), s8.size() - 1, out16.data(), 4);
+        transcode_result expected = transcode<utf8, utf16>(s8.data(), s8.size() - 1, out16.data());
+        CHECK(res.read == expected.read);
+        CHECK(res.written == expected.written);
+    }
+}
+#endif
+
+namespace {
+    // converts src into slabs of slab codeunits back to back, checking that
+    // each slab is filled as far as whole codepoints go, and that nothing
+    // is written past its end
+    template <typename ESrc, typename EDest, typename S, typename D>
+    std::vector<D> fill_slabs(const std::vector<S>& src, size_t slab) {
+        const size_t guard = 64;
+        std::vector<D> res;
+        size_t pos = 0;
+        for (;;) {
+            std::vector<D> buf(slab + guard, D(0x7e));
+            bounded_result r = transcode_bounded<ESrc, EDest>(src.data() + pos, src.size() - pos, buf.data(), slab);
+            CHECK(std::count(buf.begin() + slab, buf.end(), D(0x7e)) == static_cast<std::ptrdiff_t>(guard));
+            res.insert(res.end(), buf.begin(), buf.begin() + r.written);
+            pos += r.read;
+            if (r.status != transcode_status::output_full) {
+                CHECK(r.status == transcode_status::complete);
+                CHECK(pos == src.size());
+                return res;
+            }
+            REQUIRE(r.read > 0);
+            codepoint_type next = utf_traits<ESrc>::decode(src.data() + pos);
+            CHECK(r.written + utf_traits<EDest>::write_length(next) > slab);
+        }
+    }
+}
+
+TEST_CASE("utf/transcode_bounded", "Filling fixed-size output buffers back to back") {
+    std::vector<codepoint_type> cps = mixed_text();
+    std::vector<codepoint_type> cjk = cjk_text();
+    cps.insert(cps.end(), cjk.begin(), cjk.end());
+    std::vector<char> s8 = encode_all<utf8, char>(cps);
+    std::vector<char16_t> s16 = encode_all<utf16, char16_t>(cps);
+    std::vector<char32_t> s32 = encode_all<utf32, char32_t>(cps);
+
+    const size_t slabs[] = { 4, 7, 64, 100, 1000, 16384 };
+    for (size_t i = 0; i < elems(slabs); ++i) {
+        CHECK((fill_slabs<utf16, utf8, char16_t, char>(s16, slabs[i]) == s8));
+        CHECK((fill_slabs<utf32, utf8, char32_t, char>(s32, slabs[i]) == s8));
+        CHECK((fill_slabs<utf8, utf16, char, char16_t>(s8, slabs[i]) == s16));
+        CHECK((fill_slabs<utf32, utf16, char32_t, char16_t>(s32, slabs[i]) == s16));
+        CHECK((fill_slabs<utf8, utf32, char, char32_t>(s8, slabs[i]) == s32));
+    }
+
+    SECTION("truncated input") {
+        std::vector<char16_t> out(s16.size());
+        bounded_result res = transcode_bounded<utf8, utf16>(s8.data(), s8.size() - 1, out.data(), out.size());
+        CHECK(res.status == transcode_status::truncated);
+        CHECK(res.read < s8.size() - 1);
+        CHECK(res.written == s16.size() - 1);
+    }
+
+    SECTION("empty output") {
+        char out[1];
+        bounded_result res = transcode_bounded<utf16, utf8>(s16.data(), s16.size(), out, size_t(0));
+        CHECK(res.status == transcode_status::output_full);
+        CHECK(res.read == 0);
+        CHECK(res.written == 0);
+    }
+}
+
+namespace {
+    // decodes with a checked codepoint_iterator
+    template <typename Policy, typename Iter>
+    std::u32string iterate_all(Iter first, Iter last) {
+        stringview<Iter> sv(first, last);
+        std::u32string res;
+        for (codepoint_iterator<Iter, Policy> it = sv.template begin<Policy>(); it != sv.template end<Policy>(); ++it) {
+            res += *it;
+        }
+        return res;
+    }
+}
+
+TEST_CASE("utf/simd_level", "Every SIMD level gives the same results") {
+    const simd_level initial = active_simd_level();
+    const simd_level supported = supported_simd_level();
+    CHECK(initial <= supported);
+    CHECK(set_simd_level(simd_level::avx2) == supported);
+
+    std::vector<codepoint_type> cps = mixed_text();
+    std::vector<codepoint_type> cjk = cjk_text();
+    cps.insert(cps.end(), cjk.begin(), cjk.end());
+    std::vector<char> s8 = encode_all<utf8, char>(cps);
+    std::vector<char16_t> s16 = encode_all<utf16, char16_t>(cps);
+    std::vector<char> bad8 = s8;
+    bad8[bad8.size() - 100] = '\xff';
+    // runs of astral codepoints of every length, between BMP and ASCII runs
+    std::vector<codepoint_type> astral;
+    for (size_t run = 0; run < 40; ++run) {
+        for (size_t i = 0; i < run; ++i) { astral.push_back(0x1f600 + i); }
+        for (size_t i = 0; i < run % 7; ++i) { astral.push_back(i % 2 ? 0x4e00 + run : 0x41 + i); }
+    }
+
+    for (int i = 0; i <= static_cast<int>(supported); ++i) {
+        const simd_level level = static_cast<simd_level>(i);
+        CHECK(set_simd_level(level) == level);
+        CHECK(active_simd_level() == level);
+
+        check_transcode<utf8, char, utf16, char16_t>(cps);
+        check_transcode<utf8, char, utf32, char32_t>(cps);
+        check_transcode<utf16, char16_t, utf8, char>(cps);
+        check_transcode<utf16be, char16_t, utf32, char32_t>(cps);
+        check_transcode<utf32, char32_t, utf8, char>(cps);
+        check_transcode<utf32, char32_t, utf16, char16_t>(cps);
+        check_transcode<utf32, char32_t, utf8, char>(astral);
+        check_transcode<utf32le, char32_t, utf16be, char16_t>(astral);
+        check_transcode<latin1, char, utf16, char16_t>(std::vector<codepoint_type>(300, 0xe9));
+
+        stringview<const char*> sv8(s8.data(), s8.data() + s8.size());
+        stringview<const char16_t*> sv16(s16.data(), s16.data() + s16.size());
+        CHECK(sv8.validate());
+        CHECK(sv16.validate());
+        CHECK(!stringview<const char*>(bad8.data(), bad8.data() + bad8.size()).validate());
+        CHECK(sv8.codepoints() == cps.size());
+        CHECK(sv16.codepoints() == cps.size());
+        CHECK(sv8.codeunits<utf16>() == s16.size());
+        CHECK(sv16.codeunits<utf8>() == s8.size());
+    }
+    set_simd_level(initial);
+}
+
+#ifdef UTFHPP_STATS
+namespace {
+    const stats_entry* find_stats(const std::vector<stats_entry>& stats, stats_operation op, const char* source, const char* dest) {
+        for (size_t i = 0; i < stats.size(); ++i) {
+            if (stats[i].operation == op && std::strcmp(stats[i].source, source) == 0 && std::strcmp(stats[i].dest, dest) == 0) {
+                return &stats[i];
+            }
+        }
+        return nullptr;
+    }
+}
+
+TEST_CASE("utf/stats", "Counting calls, bytes, fallbacks and errors per encoding pair") {
+    reset_stats();
+    CHECK(collect_stats().empty());
+
+    const char text[] = "h\xc3\xa9llo";
+    const char bad[] = "a\xff" "b\xfe";
+    stringview<const char*> sv(text, text + 6);
+    stringview<const char*> svbad(bad, bad + 4);
+    std::u16string out;
+    sv.to<utf16>(std::back_inserter(out));
+    sv.to<utf16>(std::back_inserter(out));
+    CHECK(!svbad.to<utf16, policy::strict>(std::back_inserter(out)).ok());
+    svbad.to<utf16, policy::replace>(std::back_inserter(out));
+    uint64_t calls = 4;
+#ifndef UTFHPP_NO_THREADS
+    // the counts of threads which have exited are kept
+    std::thread([&] {
+        std::u16string res;
+        sv.to<utf16>(std::back_inserter(res));
+    }).join();
+    ++calls;
+#endif
+    CHECK(sv.validate());
+    CHECK(!svbad.validate());
+    std::u16string s16 = u"h\u00e9llo";
+    std::deque<char16_t> d16(s16.begin(), s16.end());
+    CHECK(stringview<std::deque<char16_t>::const_iterator>(d16.begin(), d16.end()).codepoints() == 5);
+
+    std::vector<stats_entry> stats = collect_stats();
+    CHECK(stats.size() == 3);
+    const stats_entry* to = find_stats(stats, stats_operation::to, "utf8", std::is_same<utf16, utf16le>::value ? "utf16le" : "utf16be");
+    REQUIRE(to != nullptr);
+    CHECK(to->counts.calls == calls);
+    CHECK(to->counts.bytes == 6 * calls - 4);
+    // one scalar stretch for the e-acute in each call on text, and one for
+    // each invalid byte the strict and the replacing conversions reach
+    CHECK(to->counts.fallbacks == calls - 2 + 3);
+    CHECK(to->counts.errors == 3);
+
+    const stats_entry* validate = find_stats(stats, stats_operation::validate, "utf8", "");
+    REQUIRE(validate != nullptr);
+    CHECK(validate->counts.calls == 2);
+    CHECK(validate->counts.bytes == 10);
+    CHECK(validate->counts.fallbacks == 0);
+    CHECK(validate->counts.errors == 1);
+
+    const stats_entry* codepoints = find_stats(stats, stats_operation::codepoints, std::is_same<utf16, utf16le>::value ? "utf16le" : "utf16be", "");
+    REQUIRE(codepoints != nullptr);
+    CHECK(codepoints->counts.calls == 1);
+    CHECK(codepoints->counts.bytes == 10);
+    // a deque is not contiguous, so the vector code cannot take it
+    CHECK(codepoints->counts.fallbacks == 1);
+    CHECK(codepoints->counts.errors == 0);
+
+    reset_stats();
+    CHECK(collect_stats().empty());
+}
+#endif
+
+TEST_CASE("utf/stringview/to/policy", "Replacing, skipping or stopping at invalid input") {
+    // examples from the Unicode standard, section 3.9
+    const char* inputs[] = {
+        "\x61\xf1\x80\x80\xe1\x80\xc2\x62\x80\x63\x80\xbf\x64",
+        "\xc0\xaf\xe0\x80\xbf\xf0\x81\x82\x41",
+        "\xed\xa0\x80\xed\xbf\xbf\xed\xaf\x41",
+        "\xf4\x91\x92\x93\xff\x41\x80\xbf\x42",
+        "\xe1\x80\xe2\xf0\x91\x92\xf1\xbf\x41"
+    };
+    const char32_t* replaced[] = {
+        U"a\xfffd\xfffd\xfffd" U"b\xfffd" U"c\xfffd\xfffd" U"d",
+        U"\xfffd\xfffd\xfffd\xfffd\xfffd\xfffd\xfffd\xfffd" U"A",
+        U"\xfffd\xfffd\xfffd\xfffd\xfffd\xfffd\xfffd\xfffd" U"A",
+        U"\xfffd\xfffd\xfffd\xfffd\xfffd" U"A\xfffd\xfffd" U"B",
+        U"\xfffd\xfffd\xfffd\xfffd" U"A"
+    };
+    const char32_t* skipped[] = { U"abcd", U"A", U"A", U"AB", U"A" };
+
+    for (size_t i = 0; i < elems(inputs); ++i) {
+        // surrounded by text long enough for the block kernels
+        std::string padding = "\xe4\xb8\x80\xe4\xb8\x80\xe4\xb8\x80\xe4\xb8\x80\xe4\xb8\x80\xe4\xb8\x80 abcdefghijklmnopq";
+        std::u32string padding32 = U"\x4e00\x4e00\x4e00\x4e00\x4e00\x4e00 abcdefghijklmnopq";
+        std::string in = padding + inputs[i] + padding;
+        stringview<const char*> sv(in.data(), in.data() + in.size());
+
+        std::u32string expected = padding32 + replaced[i] + padding32;
+        std::vector<char32_t> buf(in.size());
+        char32_t* end = sv.to<utf32, policy::replace>(buf.data());
+        CHECK(std::u32string(buf.data(), end) == expected);
+        std::u32string out;
+        sv.to<utf32, policy::replace>(std::back_inserter(out));
+        CHECK(out == expected);
+        CHECK(iterate_all<policy::replace>(in.data(), in.data() + in.size()) == expected);
+
+        std::u16string out16;
+        sv.to<utf16, policy::replace>(std::back_inserter(out16));
+        std::u16string expected16;
+        make_stringview(expected.begin(), expected.end()).to<utf16>(std::back_inserter(expected16));
+        CHECK(out16 == expected16);
+
+        expected = padding32 + skipped[i] + padding32;
+        end = sv.to<utf32, policy::skip>(buf.data());
+        CHECK(std::u32string(buf.data(), end) == expected);
+        CHECK(iterate_all<policy::skip>(in.data(), in.data() + in.size()) == expected);
+
+        checked_result<char32_t*> res = sv.to<utf32, policy::strict>(buf.data());
+        CHECK(!res.ok());
+        CHECK(res.offset == padding.size() + (i == 0 ? 1 : 0));
+        CHECK(iterate_all<policy::strict>(in.data(), in.data() + in.size()) == std::u32string(buf.data(), res.dest));
+    }
+
+    SECTION("truncated at the end") {
+        const char in[] = "ab\xf0\x9f\x92";
+        stringview<const char*> sv(in, in + 5);
+        std::u32string out;
+        sv.to<utf32, policy::replace>(std::back_inserter(out));
+        CHECK(out == U"ab\xfffd");
+        codepoint_iterator<const char*, policy::strict> it = sv.begin<policy::strict>();
+        ++it;
+        ++it;
+        CHECK(it == sv.end<policy::strict>());
+        CHECK(it.error() == error_kind::truncated);
+    }
+
+    SECTION("unpaired surrogates") {
+        const char16_t in[] = { 0x61, 0xd800, 0x62, 0xdc00, 0xd83d, 0xdca9, 0xd800 };
+        stringview<const char16_t*> sv(in, in + elems(in));
+        std::string out;
+        sv.to<utf8, policy::replace>(std::back_inserter(out));
+        CHECK(out == "a\xef\xbf\xbd" "b\xef\xbf\xbd\xf0\x9f\x92\xa9\xef\xbf\xbd");
+        out.clear();
+        sv.to<utf8, policy::skip>(std::back_inserter(out));
+        CHECK(out == "ab\xf0\x9f\x92\xa9");
+        CHECK(iterate_all<policy::skip>(in, in + elems(in)) == U"ab\x1f4a9");
+    }
+}
+
+TEST_CASE("utf/codepoint_iterator/reverse", "Stepping backwards and reverse iteration") {
+    std::vector<codepoint_type> cps = mixed_text();
+    std::vector<char> s8 = encode_all<utf8, char>(cps);
+    std::vector<char16_t> s16 = encode_all<utf16, char16_t>(cps);
+    std::vector<codepoint_type> reversed(cps.rbegin(), cps.rend());
+
+    stringview<const char*> sv8(s8.data(), s8.data() + s8.size());
+    CHECK(std::vector<codepoint_type>(sv8.rbegin(), sv8.rend()) == reversed);
+    CHECK(std::vector<codepoint_type>(sv8.rbegin<policy::replace>(), sv8.rend<policy::replace>()) == reversed);
+    stringview<const char16_t*> sv16(s16.data(), s16.data() + s16.size());
+    CHECK(std::vector<codepoint_type>(sv16.rbegin(), sv16.rend()) == reversed);
+    CHECK(std::vector<codepoint_type>(sv16.rbegin<policy::strict>(), sv16.rend<policy::strict>()) == reversed);
+
+    SECTION("the last few codepoints") {
+        const char str[] = "ab\xe2\x82\xac\xf0\x9f\x92\xa9";
+        stringview<const char*> sv(str, str + elems(str) - 1);
+        codepoint_iterator<const char*> it = sv.end();
+        --it;
+        CHECK(*it == 0x1f4a9);
+        CHECK(it.base() == str + 5);
+        it--;
+        CHECK(*it == 0x20ac);
+        CHECK(*it++ == 0x20ac);
+        CHECK(*it == 0x1f4a9);
+        CHECK(std::distance(sv.begin(), sv.end()) == 4);
+    }
+
+    SECTION("invalid input with checked iterators") {
+        const char str[] = "a\xe4\xb8\x80\x80\xc3" "b";
+        stringview<const char*> sv(str, str + elems(str) - 1);
+        const codepoint_type replaced[] = { 0x62, 0xfffd, 0xfffd, 0x4e00, 0x61 };
+        CHECK(std::vector<codepoint_type>(sv.rbegin<policy::replace>(), sv.rend<policy::replace>())
+            == std::vector<codepoint_type>(replaced, replaced + elems(replaced)));
+        const codepoint_type skipped[] = { 0x62, 0x4e00, 0x61 };
+        CHECK(std::vector<codepoint_type>(sv.rbegin<policy::skip>(), sv.rend<policy::skip>())
+            == std::vector<codepoint_type>(skipped, skipped + elems(skipped)));
+    }
+}
+
+namespace {
+    template <typename E, typename T>
+    void check_index(const std::vector<codepoint_type>& cps, size_t stride) {
+        std::vector<T> s = encode_all<E, T>(cps);
+        std::vector<size_t> offsets;
+        for (size_t i = 0, pos = 0; i <= cps.size(); ++i) {
+            offsets.push_back(pos);
+            if (i < cps.size()) { pos += utf_traits<E>::write_length(cps[i]); }
+        }
+
+        stringview<const T*, E> sv(s.data(), s.data() + s.size());
+        codepoint_index<const T*, E> index(sv, stride);
+        REQUIRE(index.codepoints() == cps.size());
+        for (size_t i = 0; i <= cps.size(); ++i) {
+            CHECK(index.codeunit_offset(i) == offsets[i]);
+        }
+        for (size_t i = 0; i < cps.size(); ++i) {
+            for (size_t pos = offsets[i]; pos < offsets[i + 1]; ++pos) {
+                CHECK(index.codepoint_offset(pos) == i);
+            }
+        }
+        CHECK(index.codepoint_offset(s.size()) == cps.size());
+        CHECK(*index.at(cps.size() / 2) == cps[cps.size() / 2]);
+    }
+}
+
+TEST_CASE("utf/codepoint_index", "Random access by codepoint offset") {
+    std::vector<codepoint_type> cps = mixed_text();
+    std::vector<codepoint_type> cjk = cjk_text();
+    cps.insert(cps.end(), cjk.begin(), cjk.end());
+
+    const size_t strides[] = { 1, 3, 64, 100, 5000 };
+    for (size_t i = 0; i < elems(strides); ++i) {
+        check_index<utf8, char>(cps, strides[i]);
+        check_index<utf16, char16_t>(cps, strides[i]);
+        check_index<utf32, char32_t>(cps, strides[i]);
+    }
+
+    SECTION("non-contiguous and empty strings") {
+        std::vector<char> s8 = encode_all<utf8, char>(cps);
+        std::deque<char> d(s8.begin(), s8.end());
+        codepoint_index<std::deque<char>::const_iterator> index(make_stringview(d.cbegin(), d.cend()), 10);
+        CHECK(index.codepoints() == cps.size());
+        CHECK(index.codeunit_offset(1234) == codepoint_index<const char*>(stringview<const char*>(s8.data(), s8.data() + s8.size()), 7).codeunit_offset(1234));
+
+        codepoint_index<const char*> empty(stringview<const char*>(), 4);
+        CHECK(empty.codepoints() == 0);
+        CHECK(empty.codeunit_offset(0) == 0);
+        CHECK(empty.codepoint_offset(0) == 0);
+    }
+}
+
+TEST_CASE("utf/stringview/to/byte_order", "UTF-16 and UTF-32 in a fixed byte order") {
+    std::vector<codepoint_type> cjk = cjk_text();
+    std::vector<codepoint_type> mixed = mixed_text();
+
+    std::vector<char16_t> be16 = encode_all<utf16be, char16_t>(std::vector<codepoint_type>(1, 0x20ac));
+    std::vector<char32_t> le32 = encode_all<utf32le, char32_t>(std::vector<codepoint_type>(1, 0x1f4a9));
+    unsigned char bytes[4];
+    std::memcpy(bytes, be16.data(), 2);
+    CHECK((bytes[0] == 0x20 && bytes[1] == 0xac));
+    std::memcpy(bytes, le32.data(), 4);
+    CHECK((bytes[0] == 0xa9 && bytes[1] == 0xf4 && bytes[2] == 0x01 && bytes[3] == 0x00));
+
+    check_transcode<utf16be, char16_t, utf8, char>(cjk);
+    check_transcode<utf16le, char16_t, utf8, char>(mixed);
+    check_transcode<utf8, char, utf16be, char16_t>(cjk);
+    check_transcode<utf8, char, utf32be, char32_t>(mixed);
+    check_transcode<utf32be, char32_t, utf8, char>(cjk);
+    check_transcode<utf16be, char16_t, utf32le, char32_t>(mixed);
+    check_transcode<utf32be, char32_t, utf16le, char16_t>(cjk);
+    check_transcode<utf16le, char16_t, utf16be, char16_t>(cjk);
+    check_transcode<utf16be, char16_t, utf16be, char16_t>(mixed);
+    check_transcode<utf32le, char32_t, utf32be, char32_t>(mixed);
+
+    std::vector<char16_t> s16 = encode_all<utf16be, char16_t>(cjk);
+    stringview<const char16_t*, utf16be> sv(s16.data(), s16.data() + s16.size());
+    CHECK(sv.validate());
+    CHECK(sv.codepoints() == cjk.size());
+    CHECK(sv.codeunits<utf8>() == encode_all<utf8, char>(cjk).size());
+    CHECK(sv.codeunits<utf32be>() == cjk.size());
+    CHECK(std::u32string(sv.begin(), sv.end()) == std::u32string(cjk.begin(), cjk.end()));
+    CHECK(std::u32string(sv.rbegin(), sv.rend()) == std::u32string(cjk.rbegin(), cjk.rend()));
+
+    SECTION("invalid input is found in either byte order") {
+        for (size_t pos = 0; pos < 20; ++pos) {
+            std::vector<codepoint_type> cps(40, 0x4e00);
+            std::vector<char16_t> be = encode_all<utf16be, char16_t>(cps);
+            be[pos] = byteswap(static_cast<char16_t>(0xdc00));
+            stringview<const char16_t*, utf16be> bad(be.data(), be.data() + be.size());
+            CHECK(!bad.validate());
+            std::vector<char> buf(200);
+            checked_result<char*> res = bad.to_checked<utf8>(buf.data());
+            CHECK(!res.ok());
+            CHECK(res.offset == pos);
+
+            std::vector<char32_t> le = encode_all<utf32le, char32_t>(cps);
+            le[pos] = 0x110000;
+            checked_result<char*> res32 = stringview<const char32_t*, utf32le>(le.data(), le.data() + le.size()).to_checked<utf8>(buf.data());
+            CHECK(!res32.ok());
+            CHECK(res32.offset == pos);
+        }
+    }
+}
+
+namespace {
+    constexpr auto hello16 = literal<utf16>(u8"h\u00e9llo \u20ac\U0001F4A9");
+    static_assert(hello16.size() == 9, "");
+    static_assert(hello16[1] == 0xe9 && hello16[6] == 0x20ac, "");
+    static_assert(hello16[7] == 0xd83d && hello16[8] == 0xdca9 && hello16[9] == 0, "");
+
+    constexpr auto hello32 = literal<utf32>(u8"h\u00e9llo \u20ac\U0001F4A9");
+    static_assert(hello32.size() == 8 && hello32[7] == 0x1f4a9, "");
+
+    static_assert(utf_traits<utf8>::read_length('\xe2') == 3, "");
+    static_assert(utf_traits<utf16>::write_length(0x1f4a9) == 2, "");
+    static_assert(validate_codepoint(0x10ffff) && !validate_codepoint(0xd800), "");
+
+#ifdef UTFHPP_HAS_IS_CONSTANT_EVALUATED
+    constexpr bool transcodes_at_compile_time() {
+        const char s[] = "a\xc3\xa9\xf0\x9f\x92\xa9";
+        char16_t out[8] = {};
+        stringview<const char*> sv(s, s + 7);
+        char16_t* end = sv.to<utf16>(out);
+        return end - out == 4 && out[1] == 0xe9 && out[3] == 0xdca9
+            && sv.to<utf16, policy::strict>(out).ok();
+    }
+    static_assert(transcodes_at_compile_time(), "");
+#endif
+}
+
+TEST_CASE("utf/literal", "Literals converted at compile time, or checked at run time") {
+    CHECK(std::u16string(hello16.begin(), hello16.end()) == u"h\u00e9llo \u20ac\U0001F4A9");
+    CHECK(std::u32string(hello32.c_str()) == U"h\u00e9llo \u20ac\U0001F4A9");
+    CHECK(hello16.view().codepoints() == 8);
+#ifdef UTFHPP_HAS_EXCEPTIONS
+    // not a constant expression, so the invalid literal is only found at run time
+    CHECK_THROWS_AS(literal<utf32>("ab\xff" "cd"), std::invalid_argument);
+    CHECK(literal<utf32>("ab\xc3\xa9").size() == 3);
+#endif
+}
+
+#ifdef UTFHPP_TEST_FILES
+namespace {
+    // a temporary file, removed on scope exit
+    struct temp_file {
+        std::string path;
+
+        explicit temp_file(const std::string& contents) {
+            char name[] = "/tmp/utfhpp-test-XXXXXX";
+            int fd = mkstemp(name);
+            REQUIRE(fd >= 0);
+            path = name;
+            REQUIRE(write_all(fd, contents.data(), contents.size()));
+            close(fd);
+        }
+        ~temp_file() { std::remove(path.c_str()); }
+    };
+
+    std::string read_all(const std::string& path) {
+        std::string res;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) { return res; }
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            res.append(buf, static_cast<size_t>(n));
+        }
+        close(fd);
+        return res;
+    }
+
+    template <typename T>
+    std::string bytes_of(const std::vector<T>& v) {
+        return std::string(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+    }
+
+    // converts what a child process writes to a pipe, step bytes at a time
+    template <typename ESrc, typename EDest>
+    file_result transcode_pipe(const std::string& contents, size_t step, std::string& out) {
+        int fds[2];
+        REQUIRE(pipe(fds) == 0);
+        pid_t child = fork();
+        REQUIRE(child >= 0);
+        if (child == 0) {
+            close(fds[0]);
+            for (size_t pos = 0; pos < contents.size(); pos += step) {
+                write_all(fds[1], contents.data() + pos, std::min(step, contents.size() - pos));
+            }
+            _exit(0);
+        }
+        close(fds[1]);
+        temp_file dest("");
+        file_result res = transcode_file<ESrc, EDest>(("/dev/fd/" + std::to_string(fds[0])).c_str(), dest.path.c_str());
+        close(fds[0]);
+        waitpid(child, nullptr, 0);
+        out = read_all(dest.path);
+        return res;
+    }
+}
+
+TEST_CASE("utf/transcode_file", "Converting files, mapped or read from a pipe") {
+    // large enough to span several chunks, with sequences split across them
+    std::vector<codepoint_type> cps;
+    std::vector<codepoint_type> text = mixed_text();
+    std::vector<codepoint_type> cjk = cjk_text();
+    while (cps.size() < 600000) {
+        cps.insert(cps.end(), text.begin(), text.end());
+        cps.insert(cps.end(), cjk.begin(), cjk.end());
+    }
+    std::string s8 = bytes_of(encode_all<utf8, char>(cps));
+    std::string s16 = bytes_of(encode_all<utf16, char16_t>(cps));
+    REQUIRE(s8.size() > 3 * (size_t(1) << 18));
+
+    SECTION("mapped input across chunk boundaries") {
+        temp_file src(s8);
+        temp_file dest("");
+        file_result res = transcode_file<utf8, utf16>(src.path.c_str(), dest.path.c_str());
+        CHECK(res.status == file_status::ok);
+        CHECK(res.read == s8.size());
+        CHECK(res.written * 2 == s16.size());
+        CHECK(read_all(dest.path) == s16);
+    }
+    SECTION("piped input carries split sequences to the next read") {
+        const size_t steps[] = { 4097, 65537 };
+        for (size_t i = 0; i < elems(steps); ++i) {
+            std::string out;
+            file_result res = transcode_pipe<utf8, utf16>(s8, steps[i], out);
+            CHECK(res.status == file_status::ok);
+            CHECK(res.read == s8.size());
+            CHECK(out == s16);
+        }
+        std::string small8 = bytes_of(encode_all<utf8, char>(text));
+        std::string out;
+        CHECK(transcode_pipe<utf8, utf32>(small8, 1, out).status == file_status::ok);
+        CHECK(out == bytes_of(encode_all<utf32, char32_t>(text)));
+        file_result res = transcode_pipe<utf16, utf8>(s16, 4097, out);
+        CHECK(res.status == file_status::ok);
+        CHECK(res.read * 2 == s16.size());
+        CHECK(out == s8);
+    }
+    SECTION("odd trailing bytes are truncated") {
+        temp_file src(s16.substr(0, 1001));
+        temp_file dest("");
+        file_result res = transcode_file<utf16, utf8>(src.path.c_str(), dest.path.c_str());
+        CHECK(res.status == file_status::invalid_input);
+        CHECK(res.error == error_kind::truncated);
+        CHECK(res.read == 500);
+        std::string out;
+        file_result piped = transcode_pipe<utf16, utf8>(s16.substr(0, 1001), 3, out);
+        CHECK(piped.status == file_status::invalid_input);
+        CHECK(piped.error == error_kind::truncated);
+        CHECK(piped.read == 500);
+        CHECK(out == read_all(dest.path));
+    }
+    SECTION("the output may not be the input") {
+        temp_file src(s8.substr(0, 1000));
+        file_result res = transcode_file<utf8, utf16>(src.path.c_str(), src.path.c_str());
+        CHECK(res.status == file_status::same_file);
+        int fd = open(src.path.c_str(), O_WRONLY | O_APPEND);
+        REQUIRE(fd >= 0);
+        CHECK(transcode_file<utf8, utf16>(src.path.c_str(), fd).status == file_status::same_file);
+        close(fd);
+        CHECK(read_all(src.path) == s8.substr(0, 1000));
+    }
+    SECTION("invalid input in a later chunk") {
+        std::string bad = s8;
+        size_t pos = bad.size() - 1000;
+        while ((bad[pos] & 0xc0) == 0x80) { --pos; }
+        bad[pos] = '\xff';
+        std::string expected = bytes_of(encode_all<utf16, char16_t>(std::vector<codepoint_type>(cps.begin(), cps.begin() + stringview<const char*>(s8.data(), s8.data() + pos).codepoints())));
+
+        temp_file src(bad);
+        temp_file dest("");
+        file_result res = transcode_file<utf8, utf16>(src.path.c_str(), dest.path.c_str());
+        CHECK(res.status == file_status::invalid_input);
+        CHECK(res.error == error_kind::invalid_codeunit);
+        CHECK(res.read == pos);
+        CHECK(res.written * 2 == expected.size());
+        CHECK(read_all(dest.path) == expected);
+
+        std::string out;
+        file_result piped = transcode_pipe<utf8, utf16>(bad, 65537, out);
+        CHECK(piped.status == file_status::invalid_input);
+        CHECK(piped.read == pos);
+        CHECK(out == expected);
+    }
+    SECTION("a missing input creates no output") {
+        temp_file dest("");
+        std::remove(dest.path.c_str());
+        CHECK(transcode_file<utf8, utf16>("/nonexistent/utfhpp", dest.path.c_str()).status == file_status::open_failed);
+        CHECK(access(dest.path.c_str(), F_OK) != 0);
+    }
+}
+#endif
@@ -9,9 +9,115 @@
 
 #include <cstddef>
 #include <cassert>
+#include <cstring>
+#include <cstdlib>
 #include <stdint.h>
 #include <iterator>
+#include <memory>
 #include <algorithm>
+#include <type_traits>
+#include <string>
+#include <vector>
+#include <atomic>
+#ifndef UTFHPP_NO_THREADS
+#include <thread>
+#endif
+#ifdef UTFHPP_STATS
+#include <mutex>
+#endif
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define UTFHPP_HAS_STRING_VIEW
+#include <string_view>
+#endif
+#if defined(__cpp_lib_is_constant_evaluated)
+#define UTFHPP_HAS_IS_CONSTANT_EVALUATED
+#endif
+#if defined(__cpp_lib_to_address)
+#define UTFHPP_HAS_TO_ADDRESS
+#endif
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+#define UTFHPP_HAS_EXCEPTIONS
+#include <stdexcept>
+#endif
+#if defined(__cpp_lib_string_resize_and_overwrite)
+#define UTFHPP_HAS_RESIZE_AND_OVERWRITE
+#endif
+#if (__cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)) && defined(__has_include)
+#if __has_include(<memory_resource>)
+#define UTFHPP_HAS_PMR
+#include <memory_resource>
+#endif
+#endif
+#if (__cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)) && defined(__has_include)
+#if __has_include(<span>)
+#define UTFHPP_HAS_SPAN
+#include <span>
+#endif
+#endif
+
+// Define UTFHPP_NO_THREADS to leave out transcode_parallel and the <thread> dependency.
+
+// Define UTFHPP_STATS to count the calls, bytes, fallbacks to scalar code and
+// errors of stringview::to, validate and codepoints, per encoding pair and
+// thread. collect_stats() adds up the counts of every thread. Without it, no
+// counting code is compiled in.
+
+// SIMD code paths are enabled whenever the compiler targets SSE2 (and SSSE3/AVX2).
+// Define UTFHPP_NO_SIMD to force the portable scalar implementation.
+// Define UTFHPP_DISPATCH to also build the SSSE3 and AVX2 code paths when the
+// compiler only targets SSE2, for CPUs which turn out to support them.
+// Of the paths built in, those the CPU supports are used, as determined at
+// first use. set_simd_level(), or the UTFHPP_SIMD_LEVEL environment variable
+// (scalar, sse2, ssse3 or avx2), can restrict them further.
+#ifndef UTFHPP_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UTFHPP_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__) || defined(__AVX2__)
+#define UTFHPP_SSSE3
+#include <tmmintrin.h>
+#elif defined(UTFHPP_DISPATCH) && defined(UTFHPP_SSE2)
+#define UTFHPP_SSSE3
+#define UTFHPP_SSSE3_DISPATCHED
+#include <tmmintrin.h>
+#endif
+#if defined(__AVX2__)
+#define UTFHPP_AVX2
+#include <immintrin.h>
+#elif defined(UTFHPP_DISPATCH) && defined(UTFHPP_SSE2)
+#define UTFHPP_AVX2
+#define UTFHPP_AVX2_DISPATCHED
+#include <immintrin.h>
+#endif
+#if defined(UTFHPP_SSE2) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// Functions using instructions the compiler does not target are compiled for
+// them one by one. Code shared between levels is force inlined into them
+#if defined(__GNUC__) || defined(__clang__)
+#define UTFHPP_FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define UTFHPP_FORCE_INLINE inline
+#endif
+#if defined(UTFHPP_SSSE3_DISPATCHED) && (defined(__GNUC__) || defined(__clang__))
+#define UTFHPP_TARGET_SSSE3 __attribute__((target("ssse3")))
+#else
+#define UTFHPP_TARGET_SSSE3
+#endif
+#if defined(UTFHPP_AVX2_DISPATCHED) && (defined(__GNUC__) || defined(__clang__))
+#define UTFHPP_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define UTFHPP_TARGET_AVX2
+#endif
+
+// byte order of the platform, which utf16 and utf32 codeunits are stored in
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define UTFHPP_BIG_ENDIAN
+#endif
 
 #ifdef UTFHPP_NO_CPP11
 namespace utf {
@@ -24,9 +130,409 @@ namespace utf {
     struct utf8;
     struct utf16; // uses native endianness
     struct utf32;
+    // ISO-8859-1: one byte per codepoint, for U+0000 to U+00FF. Codepoints
+    // above that cannot be encoded, and are written as '?'
+    struct latin1;
+    // A single byte codepage which encodes ASCII as ASCII, and the
+    // codepoints of bytes 0x80 to 0xff as listed in Table::high, a static
+    // constexpr array of 128 char16_t with U+FFFD for undefined bytes.
+    // Undefined bytes are invalid, and codepoints the codepage cannot encode
+    // are written as '?'. See utf_codepages.hpp for the common codepages
+    template <typename Table>
+    struct single_byte_encoding;
+
+    namespace internal {
+        // E with every codeunit stored byte swapped
+        template <typename E>
+        struct byteswapped;
+    }
+
+    // UTF-16 and UTF-32 in a fixed byte order. The ones matching the platform
+    // are simply utf16 and utf32; the others read and write their codeunits
+    // byte swapped
+#ifdef UTFHPP_BIG_ENDIAN
+    typedef internal::byteswapped<utf16> utf16le;
+    typedef utf16 utf16be;
+    typedef internal::byteswapped<utf32> utf32le;
+    typedef utf32 utf32be;
+#else
+    typedef utf16 utf16le;
+    typedef internal::byteswapped<utf16> utf16be;
+    typedef utf32 utf32le;
+    typedef internal::byteswapped<utf32> utf32be;
+#endif
 
     typedef char32_t codepoint_type;
 
+    // the ways in which an encoded sequence can be invalid
+    enum class error_kind {
+        none,
+        truncated, // a lead codeunit is not followed by enough continuations
+        overlong, // the codepoint is encoded with more codeunits than necessary
+        surrogate, // a UTF-16 surrogate codepoint, or an unpaired surrogate codeunit
+        out_of_range, // the codepoint is greater than U+10FFFF
+        invalid_codeunit, // a codeunit which cannot begin a sequence
+        unrepresentable // a valid codepoint which the destination encoding cannot encode
+    };
+
+    // result of a checked conversion. On error, dest holds the output of
+    // everything before the invalid sequence, and offset is the codeunit offset
+    // of that sequence in the input. On success, offset is the input length.
+    template <typename OutIt>
+    struct checked_result {
+        OutIt dest;
+        error_kind error;
+        size_t offset;
+
+        constexpr checked_result(OutIt dest, error_kind error, size_t offset)
+        : dest(dest), error(error), offset(offset) {}
+
+        constexpr bool ok() const { return error == error_kind::none; }
+    };
+
+    // what conversions and codepoint iterators do with invalid input
+    namespace policy {
+        // assume the input is valid (the default). Invalid input gives unspecified output
+        struct unchecked {};
+        // stop at the first invalid sequence and report it
+        struct strict {};
+        // replace each maximal subpart of an invalid sequence with U+FFFD, as
+        // specified by the WHATWG Encoding Standard. Codepoints the destination
+        // cannot encode are replaced too, with '?' in Latin-1
+        struct replace {};
+        // drop invalid sequences, as replace but without the U+FFFD
+        struct skip {};
+    }
+
+    // the instruction sets vectorized code paths are built for, each
+    // including the ones before it
+    enum class simd_level {
+        scalar,
+        sse2,
+        ssse3,
+        avx2
+    };
+
+    namespace internal {
+        // the highest level built in
+        constexpr simd_level built_simd_level() {
+#if defined(UTFHPP_AVX2)
+            return simd_level::avx2;
+#elif defined(UTFHPP_SSSE3)
+            return simd_level::ssse3;
+#elif defined(UTFHPP_SSE2)
+            return simd_level::sse2;
+#else
+            return simd_level::scalar;
+#endif
+        }
+
+        // the highest level the CPU supports, as reported by cpuid. Without a
+        // way to ask, the levels the compiler targets are assumed supported
+        inline simd_level cpu_simd_level() {
+#if defined(UTFHPP_SSE2) && defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 0);
+            int leaves = info[0];
+            __cpuid(info, 1);
+            bool ssse3 = (info[2] & (1 << 9)) != 0;
+            // AVX state must be enabled by the OS (OSXSAVE, AVX, and XCR0 bits 1-2)
+            bool avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+            bool avx2 = false;
+            if (avx && leaves >= 7) {
+                __cpuidex(info, 7, 0);
+                avx2 = (info[1] & (1 << 5)) != 0;
+            }
+            return avx2 ? simd_level::avx2 : ssse3 ? simd_level::ssse3 : simd_level::sse2;
+#elif defined(UTFHPP_SSE2) && (defined(__GNUC__) || defined(__clang__))
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") ? simd_level::avx2
+                 : __builtin_cpu_supports("ssse3") ? simd_level::ssse3 : simd_level::sse2;
+#else
+            return built_simd_level();
+#endif
+        }
+
+        // the level named by UTFHPP_SIMD_LEVEL, or fallback if it is unset or
+        // names none
+        inline simd_level requested_simd_level(simd_level fallback) {
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable : 4996)
+#endif
+            const char* name = std::getenv("UTFHPP_SIMD_LEVEL");
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+            static const char* const names[] = { "scalar", "sse2", "ssse3", "avx2" };
+            for (size_t i = 0; name != nullptr && i < 4; ++i) {
+                if (std::strcmp(name, names[i]) == 0) {
+                    return static_cast<simd_level>(i);
+                }
+            }
+            return fallback;
+        }
+    }
+
+    // the highest SIMD level both built in and supported by the CPU
+    inline simd_level supported_simd_level() {
+        static const simd_level level = std::min(internal::built_simd_level(), internal::cpu_simd_level());
+        return level;
+    }
+
+    namespace internal {
+        // the level in use, or -1 until it is picked at first use. A constant
+        // initialized class static, so reading it needs no initialization guard
+        template <typename T = void>
+        struct simd_level_state {
+            static std::atomic<int> level;
+        };
+
+        template <typename T>
+        std::atomic<int> simd_level_state<T>::level(-1);
+
+#if defined(__GNUC__) || defined(__clang__)
+        __attribute__((noinline, cold))
+#endif
+        inline simd_level pick_simd_level() {
+            simd_level level = std::min(requested_simd_level(simd_level::avx2), supported_simd_level());
+            int unset = -1;
+            // a level set by set_simd_level() in the meantime wins
+            if (!simd_level_state<>::level.compare_exchange_strong(unset, static_cast<int>(level), std::memory_order_relaxed)) {
+                return static_cast<simd_level>(unset);
+            }
+            return level;
+        }
+
+        inline simd_level current_simd_level() {
+            int level = simd_level_state<>::level.load(std::memory_order_relaxed);
+            return level < 0 ? pick_simd_level() : static_cast<simd_level>(level);
+        }
+
+        // whether code paths built for level may be used
+        inline bool simd_enabled(simd_level level) {
+            return level == simd_level::scalar || level <= current_simd_level();
+        }
+    }
+
+    // the SIMD level conversions, validation and counting use
+    inline simd_level active_simd_level() {
+        return internal::current_simd_level();
+    }
+
+    // uses at most the given SIMD level from now on, to compare or debug the
+    // code paths of each. Returns the level used, which is lower if the build
+    // or the CPU does not support the one asked for
+    inline simd_level set_simd_level(simd_level level) {
+        level = std::min(level, supported_simd_level());
+        internal::simd_level_state<>::level.store(static_cast<int>(level), std::memory_order_relaxed);
+        return level;
+    }
+
+#ifdef UTFHPP_STATS
+    // the operations counted with UTFHPP_STATS
+    enum class stats_operation {
+        to, // stringview::to
+        validate, // stringview::validate
+        codepoints // stringview::codepoints
+    };
+
+    // the counts of one operation on one encoding pair
+    struct operation_stats {
+        uint64_t calls;
+        uint64_t bytes; // of input
+        // times the vector code left work to the scalar code: every call on
+        // input which is not contiguous in memory, and in conversions of
+        // contiguous input, every non-ASCII stretch the block kernel stopped at
+        uint64_t fallbacks;
+        // calls of validate which found the input invalid, and the invalid
+        // sequences to() found with a policy other than unchecked.
+        // codepoints assumes valid input, and finds none
+        uint64_t errors;
+    };
+
+    // Validation and codepoint counting only have a source encoding, and an
+    // empty dest. The single byte codepages are all counted as "codepage"
+    struct stats_entry {
+        stats_operation operation;
+        const char* source;
+        const char* dest;
+        operation_stats counts;
+    };
+
+    namespace internal {
+        enum stats_field {
+            stats_calls,
+            stats_bytes,
+            stats_fallbacks,
+            stats_errors,
+            stats_fields
+        };
+
+        static const size_t stats_operations = 3;
+        static const size_t stats_encodings = 7;
+        static const size_t stats_cells = stats_operations * stats_encodings * stats_encodings * stats_fields;
+
+        inline const char* stats_encoding_name(size_t index) {
+            static const char* const names[stats_encodings] = { "utf8", "utf16le", "utf16be", "utf32le", "utf32be", "latin1", "codepage" };
+            return names[index];
+        }
+
+        template <typename E>
+        struct stats_encoding;
+
+        template <>
+        struct stats_encoding<utf8> : std::integral_constant<size_t, 0> {};
+        template <>
+        struct stats_encoding<utf16le> : std::integral_constant<size_t, 1> {};
+        template <>
+        struct stats_encoding<utf16be> : std::integral_constant<size_t, 2> {};
+        template <>
+        struct stats_encoding<utf32le> : std::integral_constant<size_t, 3> {};
+        template <>
+        struct stats_encoding<utf32be> : std::integral_constant<size_t, 4> {};
+        template <>
+        struct stats_encoding<latin1> : std::integral_constant<size_t, 5> {};
+        template <typename Table>
+        struct stats_encoding<single_byte_encoding<Table> > : std::integral_constant<size_t, 6> {};
+
+        // The counters of one thread. Only the thread itself writes them, so
+        // adding is a plain load and store. They are atomic so collect_stats()
+        // can read them meanwhile
+        struct thread_stats {
+            std::atomic<uint64_t> counters[stats_cells];
+            // non-ASCII stretches the block kernels left to the scalar code, in
+            // any conversion. stringview::to counts the ones in its own call
+            uint64_t scalar_stretches;
+            thread_stats* next;
+            thread_stats* prev;
+
+            thread_stats();
+            ~thread_stats();
+
+            void add(size_t cell, uint64_t n) {
+                counters[cell].store(counters[cell].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+        };
+
+        // the threads counting now, and the counts of the threads which have
+        // exited, and of every thread at the last reset_stats()
+        template <typename T = void>
+        struct stats_registry {
+            static std::mutex mutex;
+            static thread_stats* threads;
+            static uint64_t retired[stats_cells];
+            static uint64_t baseline[stats_cells];
+        };
+
+        template <typename T>
+        std::mutex stats_registry<T>::mutex;
+        template <typename T>
+        thread_stats* stats_registry<T>::threads = nullptr;
+        template <typename T>
+        uint64_t stats_registry<T>::retired[stats_cells];
+        template <typename T>
+        uint64_t stats_registry<T>::baseline[stats_cells];
+
+        inline thread_stats::thread_stats() : scalar_stretches(), next(), prev() {
+            for (size_t i = 0; i < stats_cells; ++i) {
+                counters[i].store(0, std::memory_order_relaxed);
+            }
+            std::lock_guard<std::mutex> lock(stats_registry<>::mutex);
+            next = stats_registry<>::threads;
+            if (next != nullptr) {
+                next->prev = this;
+            }
+            stats_registry<>::threads = this;
+        }
+
+        inline thread_stats::~thread_stats() {
+            std::lock_guard<std::mutex> lock(stats_registry<>::mutex);
+            for (size_t i = 0; i < stats_cells; ++i) {
+                stats_registry<>::retired[i] += counters[i].load(std::memory_order_relaxed);
+            }
+            (prev != nullptr ? prev->next : stats_registry<>::threads) = next;
+            if (next != nullptr) {
+                next->prev = prev;
+            }
+        }
+
+        inline thread_stats& local_stats() {
+            static thread_local thread_stats stats;
+            return stats;
+        }
+
+        // the counts of every thread, exited or not. Must be called with the
+        // registry locked
+        inline void total_stats(uint64_t* totals) {
+            std::copy(stats_registry<>::retired, stats_registry<>::retired + stats_cells, totals);
+            for (const thread_stats* t = stats_registry<>::threads; t != nullptr; t = t->next) {
+                for (size_t i = 0; i < stats_cells; ++i) {
+                    totals[i] += t->counters[i].load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // adds n to a counter of op from E to EDest. Operations without a
+        // destination count under EDest = E
+        template <typename E, typename EDest>
+        void count_stat(stats_operation op, stats_field field, uint64_t n = 1) {
+            size_t pair = stats_encoding<E>::value * stats_encodings + stats_encoding<EDest>::value;
+            local_stats().add((static_cast<size_t>(op) * stats_encodings * stats_encodings + pair) * stats_fields + field, n);
+        }
+
+        template <typename E, typename EDest, typename T>
+        void count_call(stats_operation op, size_t codeunits, bool contiguous) {
+            count_stat<E, EDest>(op, stats_calls);
+            count_stat<E, EDest>(op, stats_bytes, codeunits * sizeof(T));
+            if (!contiguous) {
+                count_stat<E, EDest>(op, stats_fallbacks);
+            }
+        }
+    }
+
+    // the counts of every thread since the last reset_stats(), for the
+    // operations and encoding pairs called at least once
+    inline std::vector<stats_entry> collect_stats() {
+        using internal::stats_encodings;
+        using internal::stats_fields;
+        uint64_t totals[internal::stats_cells];
+        {
+            std::lock_guard<std::mutex> lock(internal::stats_registry<>::mutex);
+            internal::total_stats(totals);
+            for (size_t i = 0; i < internal::stats_cells; ++i) {
+                totals[i] -= internal::stats_registry<>::baseline[i];
+            }
+        }
+        std::vector<stats_entry> res;
+        for (size_t op = 0; op < internal::stats_operations; ++op) {
+            for (size_t src = 0; src < stats_encodings; ++src) {
+                for (size_t dest = 0; dest < stats_encodings; ++dest) {
+                    const uint64_t* cell = totals + ((op * stats_encodings + src) * stats_encodings + dest) * stats_fields;
+                    if (cell[internal::stats_calls] == 0) {
+                        continue;
+                    }
+                    stats_operation operation = static_cast<stats_operation>(op);
+                    stats_entry entry = {
+                        operation,
+                        internal::stats_encoding_name(src),
+                        operation == stats_operation::to ? internal::stats_encoding_name(dest) : "",
+                        { cell[internal::stats_calls], cell[internal::stats_bytes], cell[internal::stats_fallbacks], cell[internal::stats_errors] }
+                    };
+                    res.push_back(entry);
+                }
+            }
+        }
+        return res;
+    }
+
+    // counts from zero again
+    inline void reset_stats() {
+        std::lock_guard<std::mutex> lock(internal::stats_registry<>::mutex);
+        internal::total_stats(internal::stats_registry<>::baseline);
+    }
+#endif
+
     namespace internal {
         template <size_t S>
         struct encoding_for_size;
@@ -48,7 +554,105 @@ namespace utf {
             typedef typename encoding_for_size<sizeof(T)>::type type;
         };
 
-        inline bool validate_codepoint(codepoint_type c) {
+        constexpr uint16_t byteswap16(uint16_t c) {
+            return static_cast<uint16_t>((c >> 8) | (c << 8));
+        }
+        constexpr uint32_t byteswap32(uint32_t c) {
+            return (c >> 24) | ((c >> 8) & 0xff00) | ((c << 8) & 0xff0000) | (c << 24);
+        }
+
+        template <typename T>
+        constexpr T byteswap(T c, std::integral_constant<size_t, 1>) { return c; }
+        template <typename T>
+        constexpr T byteswap(T c, std::integral_constant<size_t, 2>) { return static_cast<T>(byteswap16(static_cast<uint16_t>(c))); }
+        template <typename T>
+        constexpr T byteswap(T c, std::integral_constant<size_t, 4>) { return static_cast<T>(byteswap32(static_cast<uint32_t>(c))); }
+        template <typename T>
+        constexpr T byteswap(T c) {
+            return byteswap(c, std::integral_constant<size_t, sizeof(T)>());
+        }
+
+        // The encoding an encoding tag is a byte order of, and whether its
+        // codeunits are swapped. apply() converts a codeunit between the
+        // byte order of E and the native one (in either direction).
+        // Everything which depends on the encoding is specialized on the base
+        // encoding, and uses apply() wherever it reads or writes codeunits.
+        template <typename E>
+        struct byte_order {
+            typedef E base;
+            static const bool swapped = false;
+            template <typename T>
+            static constexpr T apply(T c) { return c; }
+        };
+
+        template <typename E>
+        struct byte_order<byteswapped<E> > {
+            typedef E base;
+            static const bool swapped = true;
+            template <typename T>
+            static constexpr T apply(T c) { return byteswap(c); }
+        };
+
+        template <typename T>
+        struct is_char_type : std::false_type {};
+        template <> struct is_char_type<char> : std::true_type {};
+        template <> struct is_char_type<wchar_t> : std::true_type {};
+        template <> struct is_char_type<char16_t> : std::true_type {};
+        template <> struct is_char_type<char32_t> : std::true_type {};
+
+        template <typename Iter, typename T, bool = is_char_type<T>::value>
+        struct is_string_iterator : std::false_type {};
+        template <typename Iter, typename T>
+        struct is_string_iterator<Iter, T, true>
+            : std::integral_constant<bool, std::is_same<Iter, typename std::basic_string<T>::iterator>::value
+                                        || std::is_same<Iter, typename std::basic_string<T>::const_iterator>::value> {};
+
+        template <typename Iter, typename T, bool = std::is_object<T>::value>
+        struct is_vector_iterator : std::false_type {};
+        template <typename Iter, typename T>
+        struct is_vector_iterator<Iter, T, true>
+            : std::integral_constant<bool, std::is_same<Iter, typename std::vector<T>::iterator>::value
+                                        || std::is_same<Iter, typename std::vector<T>::const_iterator>::value> {};
+
+        // iterators known to address contiguous memory: pointers, and the
+        // iterators of std::vector and std::basic_string
+        template <typename Iter>
+        struct is_contiguous
+            : std::integral_constant<bool, std::is_pointer<Iter>::value
+                                        || is_vector_iterator<Iter, typename std::iterator_traits<Iter>::value_type>::value
+                                        || is_string_iterator<Iter, typename std::iterator_traits<Iter>::value_type>::value> {};
+
+        // must only be called on dereferenceable iterators
+        template <typename Iter>
+        typename std::iterator_traits<Iter>::pointer to_pointer(Iter it) {
+            return &*it;
+        }
+
+        // output iterators written through a raw pointer: pointers, and from
+        // C++20 on the other contiguous iterators, whose address std::to_address
+        // gives without dereferencing them. An output iterator need not be
+        // dereferenceable, as nothing may be written to it
+        template <typename OutIt>
+        struct is_contiguous_output
+            : std::integral_constant<bool, std::is_pointer<OutIt>::value
+#ifdef UTFHPP_HAS_TO_ADDRESS
+                                        || is_contiguous<OutIt>::value
+#endif
+                                        > {};
+
+        template <typename T>
+        T* output_pointer(T* it) {
+            return it;
+        }
+
+#ifdef UTFHPP_HAS_TO_ADDRESS
+        template <typename OutIt>
+        typename std::iterator_traits<OutIt>::pointer output_pointer(OutIt it) {
+            return std::to_address(it);
+        }
+#endif
+
+        constexpr bool validate_codepoint(codepoint_type c) {
             if (c < 0xd800) { return true; }
             if (c < 0xe000) { return false; }
             if (c < 0x110000) { return true; }
@@ -56,13 +660,13 @@ namespace utf {
             return false;
         }
 
-        template <typename E>
+        template <typename E, typename Base = typename byte_order<E>::base>
         struct utf_traits;
 
         template <>
         struct utf_traits<utf8> {
             typedef char codeunit_type;
-            static size_t read_length(codeunit_type c) {
+            static constexpr size_t read_length(codeunit_type c) {
                 if ((c & 0x80) == 0x00) { return 1; }
                 if ((c & 0xe0) == 0xc0) { return 2; }
                 if ((c & 0xf0) == 0xe0) { return 3; }
@@ -70,7 +674,7 @@ namespace utf {
 
                 return 1;
             }
-            static size_t write_length(codepoint_type c) {
+            static constexpr size_t write_length(codepoint_type c) {
                 if (c <= 0x7f) { return 1; }
                 if (c < 0x0800) { return 2; }
                 if (c < 0xd800) { return 3; }
@@ -80,10 +684,12 @@ namespace utf {
 
                 return 0;
             }
+            // whether c can be encoded at all. Every UTF can encode any valid codepoint
+            static constexpr bool representable(codepoint_type) { return true; }
 
             // responsible only for validating the utf8 encoded subsequence, not the codepoint it maps to
             template <typename Iter>
-            static bool validate(Iter first, Iter last) {
+            static constexpr bool validate(Iter first, Iter last) {
                 size_t len = last - first;
                 unsigned char lead = (unsigned char)*first;
                 switch (len) {
@@ -114,7 +720,8 @@ namespace utf {
                         if (((unsigned char)*first) <= 0xc1) { return false; }
                         break;
                     case 3:
-                        if (((unsigned char)*first) == 0xe0) { return false; }
+                        if (((unsigned char)*first) == 0xe0
+                            && ((unsigned char)first[1]) < 0xa0) { return false; }
                         break;
                     case 4:
                         if (((unsigned char)*first) == 0xf0
@@ -127,7 +734,7 @@ namespace utf {
             }
 
             template <typename OutIt>
-            static OutIt encode(codepoint_type c, OutIt dest) {
+            static constexpr OutIt encode(codepoint_type c, OutIt dest) {
 
                 size_t len = write_length(c);
 
@@ -159,7 +766,7 @@ namespace utf {
             }
 
             template <typename Iter>
-            static codepoint_type decode(Iter c) {
+            static constexpr codepoint_type decode(Iter c) {
                 size_t len = read_length(static_cast<codeunit_type>(*c));
 
                 codepoint_type res = 0;
@@ -181,15 +788,16 @@ namespace utf {
             }
         };
 
-        template <>
-        struct utf_traits<utf16> {
+        template <typename E>
+        struct utf_traits<E, utf16> {
             typedef char16_t codeunit_type;
-            static size_t read_length(codeunit_type c) {
+            static constexpr size_t read_length(codeunit_type c) {
+                c = byte_order<E>::apply(c);
                 if (c < 0xd800) { return 1; }
                 if (c < 0xdc00) { return 2; }
                 return 1;
             }
-            static size_t write_length(codepoint_type c) {
+            static constexpr size_t write_length(codepoint_type c) {
                 if (c < 0xd800) { return 1; }
                 if (c < 0xe000) { return 0; }
                 if (c < 0x010000) { return 1; }
@@ -197,21 +805,22 @@ namespace utf {
                 
                 return 0;
             }
+            static constexpr bool representable(codepoint_type) { return true; }
 
             template <typename Iter>
-            static bool validate(Iter first, Iter last) {
+            static constexpr bool validate(Iter first, Iter last) {
                 size_t len = last - first;
                 switch (len) {
                     case 1:
                     {
-                        char16_t lead = *first;
+                        char16_t lead = byte_order<E>::apply(static_cast<char16_t>(*first));
                         if (lead >= 0xd800 && lead < 0xe000) { return false; }
                         break;
                     }
                     case 2:
                     {
-                        char16_t lead = first[0];
-                        char16_t trail = first[1];
+                        char16_t lead = byte_order<E>::apply(static_cast<char16_t>(first[0]));
+                        char16_t trail = byte_order<E>::apply(static_cast<char16_t>(first[1]));
                         if (lead < 0xd800 || lead >= 0xdc00) { return false; }
                         if (trail < 0xdc00 || trail >= 0xe000) { return false; }
                         break;
@@ -222,11 +831,11 @@ namespace utf {
                 return true;
             }
             template <typename OutIt>
-            static OutIt encode(codepoint_type c, OutIt dest) {
+            static constexpr OutIt encode(codepoint_type c, OutIt dest) {
                 size_t len = write_length(c);
                 
                 if (len == 1) {
-                    *dest = c;
+                    *dest = byte_order<E>::apply(static_cast<char16_t>(c));
                     ++dest;
                     return dest;
                 }
@@ -234,18 +843,18 @@ namespace utf {
                 // 20-bit intermediate value
                 size_t tmp = c - 0x10000;
                 
-                *dest = static_cast<char16_t>((tmp >> 10) + 0xd800);
+                *dest = byte_order<E>::apply(static_cast<char16_t>((tmp >> 10) + 0xd800));
                 ++dest;
-                *dest = static_cast<char16_t>((tmp & 0x03ff) + 0xdc00);
+                *dest = byte_order<E>::apply(static_cast<char16_t>((tmp & 0x03ff) + 0xdc00));
                 ++dest;
                 return dest;
             }
 
             template <typename Iter>
-            static codepoint_type decode(Iter c) {
+            static constexpr codepoint_type decode(Iter c) {
                 size_t len = read_length(*c);
                 
-                char16_t lead = *c;
+                char16_t lead = byte_order<E>::apply(static_cast<char16_t>(*c));
                 if (len == 1) {
                     return lead;
                 }
@@ -253,151 +862,3408 @@ namespace utf {
                 codepoint_type res = 0;
                 // 10 most significant bits
                 res = (lead - 0xd800) << 10;
-                char16_t trail = c[1];
+                char16_t trail = byte_order<E>::apply(static_cast<char16_t>(c[1]));
                 // 10 least significant bits
                 res +=  (trail - 0xdc00);
                 return res + 0x10000;
             }
         };
 
-        template <>
-        struct utf_traits<utf32> {
+        template <typename E>
+        struct utf_traits<E, utf32> {
             typedef char32_t codeunit_type;
-            static size_t read_length(codeunit_type c) { return 1; }
-            static size_t write_length(codepoint_type c) {
+            static constexpr size_t read_length(codeunit_type) { return 1; }
+            static constexpr size_t write_length(codepoint_type c) {
                 if (c < 0xd800) { return 1; }
                 if (c < 0xe000) { return 0; }
                 if (c < 0x110000) { return 1; }
                 return 0;
             }
+            static constexpr bool representable(codepoint_type) { return true; }
 
             template <typename T>
-            static bool validate(const T* first, const T* last) {
+            static constexpr bool validate(const T* first, const T* last) {
                 // actually looking at the cp value is done by free validate function.
                 return last - first == 1;
             }
 
             template <typename OutIt>
-            static OutIt encode(codepoint_type c, OutIt dest) {
-                *dest = c;
+            static constexpr OutIt encode(codepoint_type c, OutIt dest) {
+                *dest = byte_order<E>::apply(c);
                 ++dest;
                 return dest;
             }
             template <typename Iter>
-            static codepoint_type decode(Iter c) {
-                return *c;
+            static constexpr codepoint_type decode(Iter c) {
+                return byte_order<E>::apply(static_cast<codepoint_type>(*c));
             }
         };
-    }
-    
-    template <typename It>
-    class codepoint_iterator {
-        typedef typename std::iterator_traits<It>::value_type codeunit_type;
-        typedef typename internal::native_encoding<codeunit_type>::type encoding;
-        typedef internal::utf_traits<encoding> traits_type;
-        codepoint_type val;
-        It pos;
-
-    public:
-        typedef std::input_iterator_tag iterator_category;
-        typedef codepoint_type value_type;
-        typedef std::ptrdiff_t difference_type;
-        typedef std::remove_const_t<codepoint_type>* pointer;
-        typedef codepoint_type& reference;
-
-        explicit codepoint_iterator() : val(), pos() {}
-        explicit codepoint_iterator(It pos) : val(), pos(pos) {}
-        codepoint_iterator(const codepoint_iterator& it) : val(it.val), pos(it.pos) {}
 
-        typename std::iterator_traits<codepoint_iterator>::reference operator*() {
-            val = traits_type::decode(pos);
-            return val;
-        }
-        typename std::iterator_traits<codepoint_iterator>::pointer operator->() const { return (&**this); }
-        codepoint_iterator& operator++() {
-            It next = pos + traits_type::read_length(*pos);
-            pos = next;
-            return *this;
-		}
-        codepoint_iterator operator++(int) {
-            codepoint_type tmp = *this;
-            ++(*this);
-            return tmp;
-        }
-        friend bool operator != (codepoint_iterator lhs, codepoint_iterator rhs) { return lhs.pos != rhs.pos; }
-        friend bool operator == (codepoint_iterator lhs, codepoint_iterator rhs) { return !(lhs != rhs); }
-    };
+        template <>
+        struct utf_traits<latin1> {
+            typedef char codeunit_type;
+            static constexpr size_t read_length(codeunit_type) { return 1; }
+            // codepoints which cannot be encoded still take their '?'
+            static constexpr size_t write_length(codepoint_type) { return 1; }
+            static constexpr bool representable(codepoint_type c) { return c < 0x100; }
 
-    template <typename Iter, typename E = typename internal::native_encoding<typename std::iterator_traits<Iter>::value_type>::type>
-    struct stringview {
-        typedef typename std::iterator_traits<Iter>::value_type codeunit_type;
+            // every byte is a valid codepoint
+            template <typename Iter>
+            static constexpr bool validate(Iter first, Iter last) {
+                return last - first == 1;
+            }
 
-        stringview(const Iter first, const Iter last)
-        : first(first), last(last) {}
+            template <typename OutIt>
+            static constexpr OutIt encode(codepoint_type c, OutIt dest) {
+                *dest = static_cast<char>(representable(c) ? c : '?');
+                ++dest;
+                return dest;
+            }
+            template <typename Iter>
+            static constexpr codepoint_type decode(Iter c) {
+                return static_cast<unsigned char>(*c);
+            }
+        };
 
-        stringview()
-        : first(), last() {}
+        // the number of 256 codepoint pages a codepage encodes codepoints
+        // from, plus one empty page
+        template <typename Table>
+        constexpr size_t codepage_page_count() {
+            bool used[256] = {};
+            size_t n = 1;
+            for (size_t i = 0; i < 0x80; ++i) {
+                char16_t c = Table::high[i];
+                if (c != 0xfffd && !used[c >> 8]) {
+                    used[c >> 8] = true;
+                    ++n;
+                }
+            }
+            return n;
+        }
 
-        Iter raw_begin() const { return first; }
-        Iter raw_end() const { return last; }
+        // Lookup tables of a single byte codepage, built at compile time.
+        // Decoding is a single lookup. Encoding a codepoint below U+10000 is
+        // two: index maps its high byte to one of the pages, and the page maps
+        // its low byte to the encoded byte. Page 0 is empty, for the high bytes
+        // the codepage has no codepoints under. Windows-1252 needs six pages,
+        // for about 2.3 KB in all.
+        template <typename Table, size_t Pages = codepage_page_count<Table>()>
+        struct codepage_tables {
+            char16_t decode[256];
+            unsigned char index[256];
+            unsigned char pages[Pages][256];
+            // whether every byte is defined, so any input is valid
+            bool complete;
 
-        codepoint_iterator<Iter> begin() const { return codepoint_iterator<Iter>(first); }
-        codepoint_iterator<Iter> end() const { return codepoint_iterator<Iter>(last); }
-        
-        bool validate() const {
-            typedef internal::utf_traits<E> traits_t;
-            for (Iter it = first;  it < last;) {
-                size_t len = traits_t::read_length(*it);
-                if (last - it < static_cast<ptrdiff_t>(len)) {
-                    return false;
-                }
-                if (!traits_t::validate(it, it + len)) {
-                    return false;
+            constexpr codepage_tables() : decode(), index(), pages(), complete(true) {
+                for (size_t b = 0; b < 0x80; ++b) {
+                    decode[b] = static_cast<char16_t>(b);
                 }
-                codepoint_type cp = traits_t::decode(it);
-                if (!internal::validate_codepoint(cp)) {
-                    return false;
+                size_t next = 1;
+                for (size_t i = 0; i < 0x80; ++i) {
+                    char16_t c = Table::high[i];
+                    decode[0x80 + i] = c;
+                    if (c == 0xfffd) {
+                        complete = false;
+                        continue;
+                    }
+                    if (index[c >> 8] == 0) {
+                        index[c >> 8] = static_cast<unsigned char>(next++);
+                    }
+                    pages[index[c >> 8]][c & 0xff] = static_cast<unsigned char>(0x80 + i);
                 }
-                it += len;
             }
-            return true;
-        }
-
-        bool empty() const {
-            return begin() == end();
-        }
-        size_t codepoints() const {
-            return std::distance(begin(), end());
-        }
 
-        size_t bytes() const {
-            return codeunits() * sizeof(typename internal::utf_traits<E>::codeunit_type);
-        }
+            // the byte encoding c, or 0 if the codepage cannot encode it
+            constexpr unsigned char encode(codepoint_type c) const {
+                if (c < 0x80) { return static_cast<unsigned char>(c); }
+                if (c >= 0x10000) { return 0; }
+                return pages[index[c >> 8]][c & 0xff];
+            }
+        };
 
-        // length in source encoding
-        template <typename EDest>
-        size_t bytes() const {
-            return codeunits<EDest>() * sizeof(typename internal::utf_traits<EDest>::codeunit_type);
-        }
+        template <typename Table>
+        struct utf_traits<single_byte_encoding<Table> > {
+            typedef char codeunit_type;
+            static constexpr codepage_tables<Table> tables = codepage_tables<Table>();
 
-        size_t codeunits() const { return last - first; }
+            static constexpr size_t read_length(codeunit_type) { return 1; }
+            // codepoints which cannot be encoded still take their '?'
+            static constexpr size_t write_length(codepoint_type) { return 1; }
+            static constexpr bool representable(codepoint_type c) { return c == 0 || tables.encode(c) != 0; }
 
-        template <typename EDest>
-        size_t codeunits() const {
-            size_t cus = 0;
-            for (codepoint_iterator<Iter> it = begin(); it != end(); ++it) {
-                cus += internal::utf_traits<EDest>::write_length(*it);
+            template <typename Iter>
+            static constexpr bool validate(Iter first, Iter last) {
+                return last - first == 1 && tables.decode[static_cast<unsigned char>(*first)] != 0xfffd;
             }
-            return cus;
-        }
 
-        template <typename EDest, typename OutIt>
-        OutIt to(OutIt dest) const {
-            for (codepoint_iterator<Iter> it = begin(); it != end(); ++it) {
-                dest = internal::utf_traits<EDest>::encode(*it, dest);
+            template <typename OutIt>
+            static constexpr OutIt encode(codepoint_type c, OutIt dest) {
+                unsigned char b = tables.encode(c);
+                *dest = static_cast<char>(b != 0 || c == 0 ? b : '?');
+                ++dest;
+                return dest;
             }
-            return dest;
-        }
+            template <typename Iter>
+            static constexpr codepoint_type decode(Iter c) {
+                return tables.decode[static_cast<unsigned char>(*c)];
+            }
+        };
+
+        template <typename Table>
+        constexpr codepage_tables<Table> utf_traits<single_byte_encoding<Table> >::tables;
+
+        template <typename T>
+        inline bool is_ascii(T c) {
+            return static_cast<typename std::make_unsigned<T>::type>(c) < 0x80;
+        }
+
+        // Vectorized ASCII kernels. They operate on raw codeunits of width S
+        // (and D for the destination), byte swapped if SwapSrc (SwapDest),
+        // process whole blocks only, and stop at the first block containing a
+        // non-ASCII codeunit. They return the number of codeunits handled; the
+        // caller finishes the rest.
+        template <size_t S, bool Swap = false>
+        struct ascii_scan {
+            static size_t run(const unsigned char*, size_t) { return 0; }
+        };
+
+        template <size_t S, size_t D, bool SwapSrc, bool SwapDest>
+        struct ascii_copy {
+            static size_t run(const unsigned char*, size_t, unsigned char*) { return 0; }
+        };
+
+#ifdef UTFHPP_SSE2
+        inline __m128i load128(const unsigned char* p) {
+            return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        }
+        inline void store128(unsigned char* p, __m128i v) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+        }
+#ifdef UTFHPP_AVX2
+        UTFHPP_TARGET_AVX2 inline __m256i load256(const unsigned char* p) {
+            return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        }
+        UTFHPP_TARGET_AVX2 inline void store256(unsigned char* p, __m256i v) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), v);
+        }
+#endif
+
+        // byte swaps every codeunit of width S in a vector
+        template <size_t S>
+        struct lane_swap {
+            static __m128i run(__m128i v) { return v; }
+#ifdef UTFHPP_AVX2
+            UTFHPP_TARGET_AVX2 static __m256i run(__m256i v) { return v; }
+#endif
+        };
+
+        template <>
+        struct lane_swap<2> {
+            static __m128i run(__m128i v) {
+#if defined(UTFHPP_SSSE3) && !defined(UTFHPP_SSSE3_DISPATCHED)
+                return _mm_shuffle_epi8(v, _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+#else
+                return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+#endif
+            }
+#ifdef UTFHPP_AVX2
+            UTFHPP_TARGET_AVX2 static __m256i run(__m256i v) {
+                return _mm256_shuffle_epi8(v, _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                                               1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+            }
+#endif
+        };
+
+        template <>
+        struct lane_swap<4> {
+            static __m128i run(__m128i v) {
+#if defined(UTFHPP_SSSE3) && !defined(UTFHPP_SSSE3_DISPATCHED)
+                return _mm_shuffle_epi8(v, _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+#else
+                v = lane_swap<2>::run(v);
+                return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+#endif
+            }
+#ifdef UTFHPP_AVX2
+            UTFHPP_TARGET_AVX2 static __m256i run(__m256i v) {
+                return _mm256_shuffle_epi8(v, _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                                               3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+            }
+#endif
+        };
+
+        // Loads and stores of codeunits of width S, converting between the
+        // native byte order in registers and the byte order in memory, so
+        // kernels for swapped encodings pay a single shuffle per vector
+        template <size_t S, bool Swap>
+        struct lanes {
+            static __m128i order(__m128i v) { return Swap ? lane_swap<S>::run(v) : v; }
+            static __m128i load(const unsigned char* p) { return order(load128(p)); }
+            static void store(unsigned char* p, __m128i v) { store128(p, order(v)); }
+#ifdef UTFHPP_AVX2
+            UTFHPP_TARGET_AVX2 static __m256i order(__m256i v) { return Swap ? lane_swap<S>::run(v) : v; }
+            UTFHPP_TARGET_AVX2 static __m256i load256(const unsigned char* p) { return order(internal::load256(p)); }
+            UTFHPP_TARGET_AVX2 static void store256(unsigned char* p, __m256i v) { internal::store256(p, order(v)); }
+#endif
+        };
+
+        template <bool Swap>
+        struct ascii_scan<1, Swap> {
+#ifdef UTFHPP_AVX2
+            UTFHPP_TARGET_AVX2 static size_t run256(const unsigned char* src, size_t n) {
+                size_t i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    if (_mm256_movemask_epi8(load256(src + i)) != 0) { return i; }
+                }
+                return i;
+            }
+#endif
+
+            static size_t run(const unsigned char* src, size_t n) {
+                size_t i = 0;
+#ifdef UTFHPP_AVX2
+                if (simd_enabled(simd_level::avx2)) {
+                    i = run256(src, n);
+                }
+#endif
+                for (; i + 16 <= n; i += 16) {
+                    if (_mm_movemask_epi8(load128(src + i)) != 0) { return i; }
+                }
+                return i;
+            }
+        };
+
+        // swapped codeunits are tested against a swapped mask
+        template <bool Swap>
+        struct ascii_scan<2, Swap> {
+            static size_t run(const unsigned char* src, size_t n) {
+                const __m128i mask = _mm_set1_epi16(static_cast<short>(Swap ? 0x80ff : 0xff80));
+                const __m128i zero = _mm_setzero_si128();
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    __m128i v = _mm_or_si128(load128(src + 2 * i), load128(src + 2 * i + 16));
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask), zero)) != 0xffff) { return i; }
+                }
+                return i;
+            }
+        };
+
+        template <bool Swap>
+        struct ascii_scan<4, Swap> {
+            static size_t run(const unsigned char* src, size_t n) {
+                const __m128i mask = _mm_set1_epi32(static_cast<int>(Swap ? 0x80ffffff : 0xffffff80));
+                const __m128i zero = _mm_setzero_si128();
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    __m128i v = _mm_or_si128(load128(src + 4 * i), load128(src + 4 * i + 16));
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, mask), zero)) != 0xffff) { return i; }
+                }
+                return i;
+            }
+        };
+
+        // same width: plain copy of ASCII blocks, or byte swapping copy
+        template <size_t S, bool SwapSrc, bool SwapDest>
+        struct ascii_copy<S, S, SwapSrc, SwapDest> {
+            static size_t run(const unsigned char* src, size_t n, unsigned char* dest) {
+                size_t len = ascii_scan<S, SwapSrc>::run(src, n);
+                if (SwapSrc == SwapDest) {
+                    std::memcpy(dest, src, len * S);
+                    return len;
+                }
+                // the scan only stops at whole 16 byte blocks
+                for (size_t i = 0; i < len * S; i += 16) {
+                    store128(dest + i, lane_swap<S>::run(load128(src + i)));
+                }
+                return len;
+            }
+        };
+
+        template <bool SwapSrc, bool SwapDest>
+        struct ascii_copy<1, 2, SwapSrc, SwapDest> {
+            typedef lanes<2, SwapDest> out;
+
+#ifdef UTFHPP_AVX2
+            UTFHPP_TARGET_AVX2 static size_t run256(const unsigned char* src, size_t n, unsigned char* dest) {
+                size_t i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    __m256i v = load256(src + i);
+                    if (_mm256_movemask_epi8(v) != 0) { return i; }
+                    out::store256(dest + 2 * i, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+                    out::store256(dest + 2 * i + 32, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+                }
+                return i;
+            }
+#endif
+
+            static size_t run(const unsigned char* src, size_t n, unsigned char* dest) {
+                size_t i = 0;
+#ifdef UTFHPP_AVX2
+                if (simd_enabled(simd_level::avx2)) {
+                    i = run256(src, n, dest);
+                }
+#endif
+                const __m128i zero = _mm_setzero_si128();
+                for (; i + 16 <= n; i += 16) {
+                    __m128i v = load128(src + i);
+                    if (_mm_movemask_epi8(v) != 0) { return i; }
+                    out::store(dest + 2 * i, _mm_unpacklo_epi8(v, zero));
+                    out::store(dest + 2 * i + 16, _mm_unpackhi_epi8(v, zero));
+                }
+                return i;
+            }
+        };
+
+        template <bool SwapSrc, bool SwapDest>
+        struct ascii_copy<1, 4, SwapSrc, SwapDest> {
+            typedef lanes<4, SwapDest> out;
+
+#ifdef UTFHPP_AVX2
+            UTFHPP_TARGET_AVX2 static size_t run256(const unsigned char* src, size_t n, unsigned char* dest) {
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    __m128i v = load128(src + i);
+                    if (_mm_movemask_epi8(v) != 0) { return i; }
+                    out::store256(dest + 4 * i, _mm256_cvtepu8_epi32(v));
+                    out::store256(dest + 4 * i + 32, _mm256_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+                }
+                return i;
+            }
+#endif
+
+            static size_t run(const unsigned char* src, size_t n, unsigned char* dest) {
+                size_t i = 0;
+#ifdef UTFHPP_AVX2
+                if (simd_enabled(simd_level::avx2)) {
+                    i = run256(src, n, dest);
+                }
+#endif
+                const __m128i zero = _mm_setzero_si128();
+                for (; i + 16 <= n; i += 16) {
+                    __m128i v = load128(src + i);
+                    if (_mm_movemask_epi8(v) != 0) { return i; }
+                    __m128i lo = _mm_unpacklo_epi8(v, zero);
+                    __m128i hi = _mm_unpackhi_epi8(v, zero);
+                    out::store(dest + 4 * i, _mm_unpacklo_epi16(lo, zero));
+                    out::store(dest + 4 * i + 16, _mm_unpackhi_epi16(lo, zero));
+                    out::store(dest + 4 * i + 32, _mm_unpacklo_epi16(hi, zero));
+                    out::store(dest + 4 * i + 48, _mm_unpackhi_epi16(hi, zero));
+                }
+                return i;
+            }
+        };
+
+        template <bool SwapSrc, bool SwapDest>
+        struct ascii_copy<2, 1, SwapSrc, SwapDest> {
+            typedef lanes<2, SwapSrc> in;
+
+#ifdef UTFHPP_AVX2
+            UTFHPP_TARGET_AVX2 static size_t run256(const unsigned char* src, size_t n, unsigned char* dest) {
+                const __m256i mask = _mm256_set1_epi16(static_cast<short>(0xff80));
+                size_t i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    __m256i a = in::load256(src + 2 * i);
+                    __m256i b = in::load256(src + 2 * i + 32);
+                    if (!_mm256_testz_si256(_mm256_or_si256(a, b), mask)) { return i; }
+                    store256(dest + i, _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+                }
+                return i;
+            }
+#endif
+
+            static size_t run(const unsigned char* src, size_t n, unsigned char* dest) {
+                size_t i = 0;
+#ifdef UTFHPP_AVX2
+                if (simd_enabled(simd_level::avx2)) {
+                    i = run256(src, n, dest);
+                }
+#endif
+                const __m128i mask = _mm_set1_epi16(static_cast<short>(0xff80));
+                const __m128i zero = _mm_setzero_si128();
+                for (; i + 16 <= n; i += 16) {
+                    __m128i a = in::load(src + 2 * i);
+                    __m128i b = in::load(src + 2 * i + 16);
+                    __m128i any = _mm_and_si128(_mm_or_si128(a, b), mask);
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(any, zero)) != 0xffff) { return i; }
+                    store128(dest + i, _mm_packus_epi16(a, b));
+                }
+                return i;
+            }
+        };
+
+        template <bool SwapSrc, bool SwapDest>
+        struct ascii_copy<4, 1, SwapSrc, SwapDest> {
+            static size_t run(const unsigned char* src, size_t n, unsigned char* dest) {
+                typedef lanes<4, SwapSrc> in;
+                const __m128i mask = _mm_set1_epi32(static_cast<int>(0xffffff80));
+                const __m128i zero = _mm_setzero_si128();
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    __m128i a = in::load(src + 4 * i);
+                    __m128i b = in::load(src + 4 * i + 16);
+                    __m128i c = in::load(src + 4 * i + 32);
+                    __m128i d = in::load(src + 4 * i + 48);
+                    __m128i any = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)), mask);
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi32(any, zero)) != 0xffff) { return i; }
+                    store128(dest + i, _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+                }
+                return i;
+            }
+        };
+
+        template <bool SwapSrc, bool SwapDest>
+        struct ascii_copy<2, 4, SwapSrc, SwapDest> {
+            static size_t run(const unsigned char* src, size_t n, unsigned char* dest) {
+                typedef lanes<2, SwapSrc> in;
+                typedef lanes<4, SwapDest> out;
+                const __m128i mask = _mm_set1_epi16(static_cast<short>(0xff80));
+                const __m128i zero = _mm_setzero_si128();
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    __m128i v = in::load(src + 2 * i);
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask), zero)) != 0xffff) { return i; }
+                    out::store(dest + 4 * i, _mm_unpacklo_epi16(v, zero));
+                    out::store(dest + 4 * i + 16, _mm_unpackhi_epi16(v, zero));
+                }
+                return i;
+            }
+        };
+
+        template <bool SwapSrc, bool SwapDest>
+        struct ascii_copy<4, 2, SwapSrc, SwapDest> {
+            static size_t run(const unsigned char* src, size_t n, unsigned char* dest) {
+                typedef lanes<4, SwapSrc> in;
+                typedef lanes<2, SwapDest> out;
+                const __m128i mask = _mm_set1_epi32(static_cast<int>(0xffffff80));
+                const __m128i zero = _mm_setzero_si128();
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    __m128i a = in::load(src + 4 * i);
+                    __m128i b = in::load(src + 4 * i + 16);
+                    __m128i any = _mm_and_si128(_mm_or_si128(a, b), mask);
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi32(any, zero)) != 0xffff) { return i; }
+                    out::store(dest + 2 * i, _mm_packs_epi32(a, b));
+                }
+                return i;
+            }
+        };
+
+        // mask of the 32-bit lanes which hold no valid codepoint. Signed
+        // comparisons, so values above 0x7fffffff are caught as negative
+        UTFHPP_FORCE_INLINE __m128i utf32_invalid(__m128i c) {
+            const __m128i invalid = _mm_or_si128(_mm_cmpgt_epi32(c, _mm_set1_epi32(0x10ffff)), _mm_cmplt_epi32(c, _mm_setzero_si128()));
+            return _mm_or_si128(invalid, _mm_cmpeq_epi32(_mm_and_si128(c, _mm_set1_epi32(static_cast<int>(0xfffff800))), _mm_set1_epi32(0xd800)));
+        }
+
+        // encodes four valid codepoints held in 32-bit lanes as UTF-8, each
+        // lane holding its sequence in its low bytes. Sets two, three and four
+        // to the movemasks of the lanes needing at least that many bytes
+        UTFHPP_FORCE_INLINE __m128i utf8_encode_lanes(__m128i c, unsigned& two, unsigned& three, unsigned& four) {
+            const __m128i low6 = _mm_set1_epi32(0x3f);
+            const __m128i cont = _mm_set1_epi32(0x80);
+            const __m128i last = _mm_or_si128(_mm_and_si128(c, low6), cont);
+            const __m128i mid = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(c, 6), low6), cont);
+            const __m128i high = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(c, 12), low6), cont);
+            __m128i seq2 = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(c, 6), _mm_set1_epi32(0xc0)), _mm_slli_epi32(last, 8));
+            __m128i seq3 = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(c, 12), _mm_set1_epi32(0xe0)),
+                                        _mm_or_si128(_mm_slli_epi32(mid, 8), _mm_slli_epi32(last, 16)));
+            __m128i seq4 = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(c, 18), _mm_set1_epi32(0xf0)),
+                                        _mm_or_si128(_mm_slli_epi32(high, 8), _mm_or_si128(_mm_slli_epi32(mid, 16), _mm_slli_epi32(last, 24))));
+            __m128i needs_two = _mm_cmpgt_epi32(c, _mm_set1_epi32(0x7f));
+            __m128i needs_three = _mm_cmpgt_epi32(c, _mm_set1_epi32(0x7ff));
+            __m128i needs_four = _mm_cmpgt_epi32(c, _mm_set1_epi32(0xffff));
+            __m128i res = _mm_or_si128(_mm_andnot_si128(needs_two, c), _mm_and_si128(needs_two, seq2));
+            res = _mm_or_si128(_mm_andnot_si128(needs_three, res), _mm_and_si128(needs_three, seq3));
+            res = _mm_or_si128(_mm_andnot_si128(needs_four, res), _mm_and_si128(needs_four, seq4));
+            two = static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(needs_two)));
+            three = static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(needs_three)));
+            four = static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(needs_four)));
+            return res;
+        }
+#endif
+
+        // length of the run of ASCII codeunits at the start of [first, last)
+        template <typename T>
+        size_t ascii_length(const T* first, const T* last) {
+            size_t n = last - first;
+            size_t i = 0;
+            if (simd_enabled(simd_level::sse2)) {
+                i = ascii_scan<sizeof(T)>::run(reinterpret_cast<const unsigned char*>(first), n);
+            }
+            while (i < n && is_ascii(first[i])) { ++i; }
+            return i;
+        }
+
+        // copy the run of ASCII codeunits at the start of [first, last) from E
+        // to EDest. ASCII is encoded identically by every UTF, so only the
+        // codeunit width and byte order change.
+        template <typename E, typename EDest, typename T, typename OutIt>
+        size_t copy_ascii(const T* first, const T* last, OutIt& dest) {
+            typedef typename utf_traits<EDest>::codeunit_type D;
+            size_t n = last - first;
+            size_t len = 0;
+            if (simd_enabled(simd_level::sse2)) {
+                len = ascii_scan<sizeof(T), byte_order<E>::swapped>::run(reinterpret_cast<const unsigned char*>(first), n);
+            }
+            while (len < n && is_ascii(byte_order<E>::apply(first[len]))) { ++len; }
+            for (size_t i = 0; i < len; ++i) {
+                *dest = byte_order<EDest>::apply(static_cast<D>(byte_order<E>::apply(first[i])));
+                ++dest;
+            }
+            return len;
+        }
+
+        template <typename E, typename EDest, typename T, typename D>
+        typename std::enable_if<std::is_integral<D>::value, size_t>::type
+        copy_ascii(const T* first, const T* last, D*& dest) {
+            size_t n = last - first;
+            size_t i = 0;
+            if (simd_enabled(simd_level::sse2)) {
+                i = ascii_copy<sizeof(T), sizeof(D), byte_order<E>::swapped, byte_order<EDest>::swapped>::run(
+                    reinterpret_cast<const unsigned char*>(first), n, reinterpret_cast<unsigned char*>(dest));
+            }
+            for (; i < n && is_ascii(byte_order<E>::apply(first[i])); ++i) {
+                dest[i] = byte_order<EDest>::apply(static_cast<D>(byte_order<E>::apply(first[i])));
+            }
+            dest += i;
+            return i;
+        }
+
+        // Block kernels for specific encoding pairs, used between the ASCII
+        // runs of a contiguous conversion. run() converts whole blocks from it
+        // for as long as it can, and stops at the first block it cannot handle.
+        // Kernels only ever consume input they have verified to be valid, so
+        // they are safe to use in checked conversions too. Some kernels store
+        // full vectors past the end of their output, counting on the rest of
+        // the input to produce output covering them. trusted tells whether
+        // the input is known to be valid, and if it is not, those kernels
+        // only store what they produce, as the conversion may stop at the
+        // next sequence. After a kernel stops, the scalar code converts at
+        // most scalar_stretch codeunits before handing back to the vector
+        // code. Kernels are specialized on the base encodings, and handle
+        // either byte order of them. Kernels are only used if the SIMD level
+        // they are built for is enabled.
+        template <typename ESrc, typename EDest,
+                  typename Src = typename byte_order<ESrc>::base, typename Dest = typename byte_order<EDest>::base>
+        struct block_transcoder {
+            static const size_t scalar_stretch = static_cast<size_t>(-1);
+            static const simd_level level = simd_level::scalar;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+        };
+
+        // Latin-1 to Latin-1 is a plain copy
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, latin1, latin1> {
+            static const size_t scalar_stretch = static_cast<size_t>(-1);
+            static const simd_level level = simd_level::scalar;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            template <typename T, typename D>
+            static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 1>::type
+            run(const T*& it, const T* last, D*& dest, bool) {
+                size_t n = last - it;
+                std::memcpy(dest, it, n);
+                it += n;
+                dest += n;
+            }
+        };
+
+#ifdef UTFHPP_SSSE3
+        // Compaction of four 32-bit lanes, each holding a 1-4 byte UTF-8
+        // sequence in its low bytes. Indexed by the sequence lengths less one,
+        // two bits per lane, which is the sum of spread[] of the movemasks of
+        // the lanes needing at least 2, 3 and 4 bytes.
+        struct utf8_pack_table {
+            unsigned char shuffle[256][16];
+            unsigned char length[256];
+            unsigned char spread[16];
+
+            utf8_pack_table() {
+                for (size_t key = 0; key < 256; ++key) {
+                    size_t out = 0;
+                    for (size_t lane = 0; lane < 4; ++lane) {
+                        size_t len = 1 + ((key >> (2 * lane)) & 3);
+                        for (size_t b = 0; b < len; ++b) {
+                            shuffle[key][out++] = static_cast<unsigned char>(4 * lane + b);
+                        }
+                    }
+                    length[key] = static_cast<unsigned char>(out);
+                    for (; out < 16; ++out) {
+                        shuffle[key][out] = 0x80;
+                    }
+                }
+                for (size_t mask = 0; mask < 16; ++mask) {
+                    spread[mask] = static_cast<unsigned char>((mask & 1) | (mask & 2) << 1 | (mask & 4) << 2 | (mask & 8) << 3);
+                }
+            }
+
+            static const utf8_pack_table& get() {
+                static const utf8_pack_table table;
+                return table;
+            }
+        };
+
+        // encodes four BMP codepoints (no surrogates) held in 32-bit lanes as
+        // UTF-8, and returns them packed into the low bytes, setting len
+        UTFHPP_TARGET_SSSE3 inline __m128i utf8_encode_bmp4(const utf8_pack_table& table, __m128i c, size_t& len) {
+            const __m128i low6 = _mm_set1_epi32(0x3f);
+            const __m128i last = _mm_or_si128(_mm_and_si128(c, low6), _mm_set1_epi32(0x80));
+            const __m128i mid = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(c, 6), low6), _mm_set1_epi32(0x80));
+            __m128i two = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(c, 6), _mm_set1_epi32(0xc0)), _mm_slli_epi32(last, 8));
+            __m128i three = _mm_or_si128(_mm_or_si128(_mm_srli_epi32(c, 12), _mm_set1_epi32(0xe0)),
+                                         _mm_or_si128(_mm_slli_epi32(mid, 8), _mm_slli_epi32(last, 16)));
+            __m128i needs_two = _mm_cmpgt_epi32(c, _mm_set1_epi32(0x7f));
+            __m128i needs_three = _mm_cmpgt_epi32(c, _mm_set1_epi32(0x7ff));
+            __m128i res = _mm_or_si128(_mm_andnot_si128(needs_two, c), _mm_and_si128(needs_two, two));
+            res = _mm_or_si128(_mm_andnot_si128(needs_three, res), _mm_and_si128(needs_three, three));
+
+            size_t key = table.spread[_mm_movemask_ps(_mm_castsi128_ps(needs_two))]
+                       + table.spread[_mm_movemask_ps(_mm_castsi128_ps(needs_three))];
+            len = table.length[key];
+            return _mm_shuffle_epi8(res, load128(table.shuffle[key]));
+        }
+
+        // encodes four valid codepoints held in 32-bit lanes as UTF-8, and
+        // returns them packed into the low bytes, setting len
+        UTFHPP_TARGET_SSSE3 inline __m128i utf8_encode4(const utf8_pack_table& table, __m128i c, size_t& len) {
+            unsigned two;
+            unsigned three;
+            unsigned four;
+            __m128i res = utf8_encode_lanes(c, two, three, four);
+            size_t key = table.spread[two] + table.spread[three] + table.spread[four];
+            len = table.length[key];
+            return _mm_shuffle_epi8(res, load128(table.shuffle[key]));
+        }
+
+        // stores two packed UTF-8 blocks. Full-width stores may write up to 16
+        // bytes past the output, so they are only used when the caller knows
+        // the rest of the output will cover that space
+        inline unsigned char* store_utf8_pair(unsigned char* out, __m128i lo, size_t len_lo, __m128i hi, size_t len_hi, bool has_room) {
+            if (has_room) {
+                store128(out, lo);
+                store128(out + len_lo, hi);
+            }
+            else {
+                unsigned char buf[32];
+                store128(buf, lo);
+                store128(buf + len_lo, hi);
+                std::memcpy(out, buf, len_lo + len_hi);
+            }
+            return out + len_lo + len_hi;
+        }
+
+        // UTF-16 to UTF-8, eight codeunits at a time. Handles any block free of
+        // surrogates, and leaves pure ASCII blocks to the ASCII copy.
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, utf16, utf8> {
+            static const size_t scalar_stretch = 8;
+            static const simd_level level = simd_level::ssse3;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            template <typename T, typename D>
+            UTFHPP_TARGET_SSSE3 static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 1>::type
+            run(const T*& it, const T* last, D*& dest, bool trusted) {
+                typedef lanes<2, byte_order<ESrc>::swapped> in;
+                const __m128i zero = _mm_setzero_si128();
+                const __m128i surrogate_mask = _mm_set1_epi16(static_cast<short>(0xf800));
+                const __m128i surrogate = _mm_set1_epi16(static_cast<short>(0xd800));
+                const __m128i non_ascii = _mm_set1_epi16(static_cast<short>(0xff80));
+                const utf8_pack_table& table = utf8_pack_table::get();
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+                while (last - it >= 8) {
+                    __m128i v = in::load(reinterpret_cast<const unsigned char*>(it));
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, surrogate_mask), surrogate)) != 0) { break; }
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, non_ascii), zero)) == 0xffff) { break; }
+
+                    size_t len_lo;
+                    size_t len_hi;
+                    __m128i lo = utf8_encode_bmp4(table, _mm_unpacklo_epi16(v, zero), len_lo);
+                    __m128i hi = utf8_encode_bmp4(table, _mm_unpackhi_epi16(v, zero), len_hi);
+                    // every remaining codeunit of valid input produces at least one byte
+                    out = store_utf8_pair(out, lo, len_lo, hi, len_hi, trusted && last - it >= 8 + 16);
+                    it += 8;
+                }
+                dest = reinterpret_cast<D*>(out);
+            }
+        };
+
+        // Decoding of UTF-8 in 12-byte windows. The mask of bytes which end a
+        // sequence (those followed by a non-continuation byte) selects an
+        // entry gathering the first (up to) four sequences of the window into
+        // 32-bit lanes, last byte first. Entries are identified by their
+        // sequence lengths as base-5 digits. check holds the prefix bits each
+        // gathered byte must have (doubling it gives their expected value, e.g.
+        // 0xe0 -> 0xc0), and min the smallest codepoint each lane may encode
+        // without being overlong.
+        struct utf8_unpack_table {
+            struct entry {
+                unsigned char shuffle[16];
+                unsigned char check[16];
+                uint32_t min[4];
+                unsigned char count;
+                unsigned char consumed;
+            };
+            uint16_t index[4096];
+            entry entries[625];
+
+            utf8_unpack_table() {
+                const unsigned char lead_check[5] = { 0, 0x80, 0xe0, 0xf0, 0xf8 };
+                const uint32_t lead_min[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+                for (size_t key = 0; key < 4096; ++key) {
+                    entry e;
+                    std::memset(&e, 0, sizeof(e));
+                    std::memset(e.shuffle, 0x80, sizeof(e.shuffle));
+                    size_t id = 0;
+                    size_t pos = 0;
+                    size_t count = 0;
+                    for (size_t end = 0; end < 12 && count < 4; ++end) {
+                        if (((key >> end) & 1) == 0) { continue; }
+                        size_t len = end - pos + 1;
+                        if (len > 4) { break; }
+                        for (size_t k = 0; k < len; ++k) {
+                            e.shuffle[4 * count + k] = static_cast<unsigned char>(end - k);
+                            e.check[4 * count + k] = k == len - 1 ? lead_check[len] : 0xc0;
+                        }
+                        e.min[count] = lead_min[len];
+                        id = id * 5 + len;
+                        ++count;
+                        pos = end + 1;
+                    }
+                    e.count = static_cast<unsigned char>(count);
+                    e.consumed = static_cast<unsigned char>(pos);
+                    index[key] = static_cast<uint16_t>(id);
+                    entries[id] = e;
+                }
+            }
+
+            static const utf8_unpack_table& get() {
+                static const utf8_unpack_table table;
+                return table;
+            }
+        };
+
+        // Decodes the sequences starting at src into up to four codepoints.
+        // Returns the number of bytes consumed, or 0 if the next 16 bytes are
+        // pure ASCII or the window does not start with valid sequences.
+        UTFHPP_TARGET_SSSE3 inline size_t utf8_decode4(const utf8_unpack_table& table, const unsigned char* src, __m128i& codepoints, size_t& count) {
+            __m128i v = load128(src);
+            if (_mm_movemask_epi8(v) == 0) { return 0; }
+            // signed comparison: ASCII and lead bytes are greater than 0xbf
+            unsigned lead_mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpgt_epi8(v, _mm_set1_epi8(static_cast<char>(0xbf)))));
+            const utf8_unpack_table::entry& e = table.entries[table.index[(lead_mask >> 1) & 0xfff]];
+            if (e.count == 0) { return 0; }
+
+            __m128i check = load128(e.check);
+            __m128i bytes = _mm_shuffle_epi8(v, load128(e.shuffle));
+            __m128i good_prefix = _mm_cmpeq_epi8(_mm_and_si128(bytes, check), _mm_add_epi8(check, check));
+            if (_mm_movemask_epi8(good_prefix) != 0xffff) { return 0; }
+
+            __m128i payload = _mm_andnot_si128(check, bytes);
+            __m128i c = _mm_or_si128(
+                _mm_or_si128(_mm_and_si128(payload, _mm_set1_epi32(0xff)),
+                             _mm_srli_epi32(_mm_and_si128(payload, _mm_set1_epi32(0xff00)), 2)),
+                _mm_or_si128(_mm_srli_epi32(_mm_and_si128(payload, _mm_set1_epi32(0xff0000)), 4),
+                             _mm_srli_epi32(_mm_and_si128(payload, _mm_set1_epi32(static_cast<int>(0xff000000))), 6)));
+
+            __m128i error = _mm_or_si128(
+                _mm_cmpgt_epi32(load128(reinterpret_cast<const unsigned char*>(e.min)), c),
+                _mm_cmpgt_epi32(c, _mm_set1_epi32(0x10ffff)));
+            error = _mm_or_si128(error, _mm_cmpeq_epi32(_mm_and_si128(c, _mm_set1_epi32(static_cast<int>(0xfffff800))), _mm_set1_epi32(0xd800)));
+            if (_mm_movemask_epi8(error) != 0) { return 0; }
+
+            codepoints = c;
+            count = e.count;
+            return e.consumed;
+        }
+
+        // UTF-8 to UTF-32, up to four codepoints per window
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, utf8, utf32> {
+            static const size_t scalar_stretch = 16;
+            static const simd_level level = simd_level::ssse3;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            template <typename T, typename D>
+            UTFHPP_TARGET_SSSE3 static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 4>::type
+            run(const T*& it, const T* last, D*& dest, bool trusted) {
+                const utf8_unpack_table& table = utf8_unpack_table::get();
+                const unsigned char* src = reinterpret_cast<const unsigned char*>(it);
+                const unsigned char* end = reinterpret_cast<const unsigned char*>(last);
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+                while (end - src >= 16) {
+                    __m128i c;
+                    size_t count;
+                    size_t consumed = utf8_decode4(table, src, c, count);
+                    if (consumed == 0) { break; }
+                    c = lanes<4, byte_order<EDest>::swapped>::order(c);
+                    // every 4 bytes left of valid input produce at least one codepoint
+                    if (trusted && end - src >= 24) {
+                        store128(out, c);
+                    }
+                    else {
+                        unsigned char buf[16];
+                        store128(buf, c);
+                        std::memcpy(out, buf, 4 * count);
+                    }
+                    out += 4 * count;
+                    src += consumed;
+                }
+                it = reinterpret_cast<const T*>(src);
+                dest = reinterpret_cast<D*>(out);
+            }
+        };
+
+        // UTF-8 to UTF-16, up to four BMP codepoints per window
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, utf8, utf16> {
+            static const size_t scalar_stretch = 16;
+            static const simd_level level = simd_level::ssse3;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            template <typename T, typename D>
+            UTFHPP_TARGET_SSSE3 static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 2>::type
+            run(const T*& it, const T* last, D*& dest, bool trusted) {
+                const utf8_unpack_table& table = utf8_unpack_table::get();
+                const __m128i offset32 = _mm_set1_epi32(0x8000);
+                const __m128i offset16 = _mm_set1_epi16(static_cast<short>(0x8000));
+                const unsigned char* src = reinterpret_cast<const unsigned char*>(it);
+                const unsigned char* end = reinterpret_cast<const unsigned char*>(last);
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+                while (end - src >= 16) {
+                    __m128i c;
+                    size_t count;
+                    size_t consumed = utf8_decode4(table, src, c, count);
+                    if (consumed == 0) { break; }
+                    if (_mm_movemask_epi8(_mm_cmpgt_epi32(c, _mm_set1_epi32(0xffff))) != 0) { break; }
+                    // pack to 16 bits with signed saturation, offset to stay in range
+                    __m128i packed = _mm_add_epi16(_mm_packs_epi32(_mm_sub_epi32(c, offset32), _mm_setzero_si128()), offset16);
+                    packed = lanes<2, byte_order<EDest>::swapped>::order(packed);
+                    if (trusted && end - src >= 24) {
+                        _mm_storel_epi64(reinterpret_cast<__m128i*>(out), packed);
+                    }
+                    else {
+                        unsigned char buf[16];
+                        store128(buf, packed);
+                        std::memcpy(out, buf, 2 * count);
+                    }
+                    out += 2 * count;
+                    src += consumed;
+                }
+                it = reinterpret_cast<const T*>(src);
+                dest = reinterpret_cast<D*>(out);
+            }
+        };
+
+        // Compaction of the 1 or 2 byte UTF-8 sequences of eight 16-bit
+        // lanes, indexed by the mask of lanes needing 2 bytes
+        struct latin1_pack_table {
+            unsigned char shuffle[256][16];
+            unsigned char length[256];
+
+            latin1_pack_table() {
+                for (size_t key = 0; key < 256; ++key) {
+                    size_t out = 0;
+                    for (size_t lane = 0; lane < 8; ++lane) {
+                        size_t len = 1 + ((key >> lane) & 1);
+                        for (size_t b = 0; b < len; ++b) {
+                            shuffle[key][out++] = static_cast<unsigned char>(2 * lane + b);
+                        }
+                    }
+                    length[key] = static_cast<unsigned char>(out);
+                    for (; out < 16; ++out) {
+                        shuffle[key][out] = 0x80;
+                    }
+                }
+            }
+
+            static const latin1_pack_table& get() {
+                static const latin1_pack_table table;
+                return table;
+            }
+        };
+
+        // encodes eight codepoints below U+0100 held in 16-bit lanes as
+        // UTF-8, and returns them packed into the low bytes, setting len
+        UTFHPP_TARGET_SSSE3 inline __m128i utf8_encode_latin1(const latin1_pack_table& table, __m128i c, size_t& len) {
+            const __m128i trail = _mm_or_si128(_mm_and_si128(c, _mm_set1_epi16(0x3f)), _mm_set1_epi16(0x80));
+            __m128i two = _mm_or_si128(_mm_or_si128(_mm_srli_epi16(c, 6), _mm_set1_epi16(0xc0)), _mm_slli_epi16(trail, 8));
+            __m128i needs_two = _mm_cmpgt_epi16(c, _mm_set1_epi16(0x7f));
+            __m128i res = _mm_or_si128(_mm_andnot_si128(needs_two, c), _mm_and_si128(needs_two, two));
+
+            size_t key = static_cast<size_t>(_mm_movemask_epi8(_mm_packs_epi16(needs_two, needs_two))) & 0xff;
+            len = table.length[key];
+            return _mm_shuffle_epi8(res, load128(table.shuffle[key]));
+        }
+
+        // Latin-1 to UTF-8, sixteen bytes at a time. ASCII is sparse in text
+        // which needs Latin-1 at all, so pure ASCII blocks are copied here
+        // rather than left to the ASCII copy
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, latin1, utf8> {
+            static const size_t scalar_stretch = 16;
+            static const simd_level level = simd_level::ssse3;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            template <typename T, typename D>
+            UTFHPP_TARGET_SSSE3 static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 1>::type
+            run(const T*& it, const T* last, D*& dest, bool) {
+                const __m128i zero = _mm_setzero_si128();
+                const latin1_pack_table& table = latin1_pack_table::get();
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+                while (last - it >= 16) {
+                    __m128i v = load128(reinterpret_cast<const unsigned char*>(it));
+                    if (_mm_movemask_epi8(v) == 0) {
+                        store128(out, v);
+                        out += 16;
+                        it += 16;
+                        continue;
+                    }
+
+                    size_t len_lo;
+                    size_t len_hi;
+                    __m128i lo = utf8_encode_latin1(table, _mm_unpacklo_epi8(v, zero), len_lo);
+                    __m128i hi = utf8_encode_latin1(table, _mm_unpackhi_epi8(v, zero), len_hi);
+                    // every remaining byte produces at least one byte
+                    out = store_utf8_pair(out, lo, len_lo, hi, len_hi, last - it >= 16 + 16);
+                    it += 16;
+                }
+                dest = reinterpret_cast<D*>(out);
+            }
+        };
+
+        // Compaction of eight bytes, dropping those whose bit is set in the index
+        struct byte_drop_table {
+            unsigned char shuffle[256][16];
+            unsigned char length[256];
+
+            byte_drop_table() {
+                for (size_t key = 0; key < 256; ++key) {
+                    size_t out = 0;
+                    for (size_t b = 0; b < 8; ++b) {
+                        if (((key >> b) & 1) == 0) {
+                            shuffle[key][out++] = static_cast<unsigned char>(b);
+                        }
+                    }
+                    length[key] = static_cast<unsigned char>(out);
+                    for (; out < 16; ++out) {
+                        shuffle[key][out] = 0x80;
+                    }
+                }
+            }
+
+            static const byte_drop_table& get() {
+                static const byte_drop_table table;
+                return table;
+            }
+        };
+
+        // UTF-8 to Latin-1, sixteen bytes at a time, for blocks of ASCII and
+        // 2-byte sequences led by 0xc2 or 0xc3 (U+0080 to U+00FF). Each lead
+        // is combined with the continuation after it, and the continuations
+        // are then dropped. A lead in the last byte is left for the next block.
+        // Pure ASCII blocks are copied, as from Latin-1
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, utf8, latin1> {
+            static const size_t scalar_stretch = 16;
+            static const simd_level level = simd_level::ssse3;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            template <typename T, typename D>
+            UTFHPP_TARGET_SSSE3 static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 1>::type
+            run(const T*& it, const T* last, D*& dest, bool trusted) {
+                const __m128i lead_mask = _mm_set1_epi8(static_cast<char>(0xfe));
+                const __m128i lead = _mm_set1_epi8(static_cast<char>(0xc2));
+                const __m128i cont_mask = _mm_set1_epi8(static_cast<char>(0xc0));
+                const __m128i cont = _mm_set1_epi8(static_cast<char>(0x80));
+                const byte_drop_table& table = byte_drop_table::get();
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+                while (last - it >= 16) {
+                    __m128i v = load128(reinterpret_cast<const unsigned char*>(it));
+                    unsigned non_ascii = static_cast<unsigned>(_mm_movemask_epi8(v));
+                    if (non_ascii == 0) {
+                        store128(out, v);
+                        out += 16;
+                        it += 16;
+                        continue;
+                    }
+                    __m128i is_lead = _mm_cmpeq_epi8(_mm_and_si128(v, lead_mask), lead);
+                    unsigned leads = static_cast<unsigned>(_mm_movemask_epi8(is_lead));
+                    unsigned conts = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, cont_mask), cont)));
+                    // continuations must be exactly the bytes after the leads
+                    if ((leads | conts) != non_ascii || conts != ((leads << 1) & 0xffff)) { break; }
+
+                    __m128i low = _mm_and_si128(_mm_srli_si128(v, 1), _mm_set1_epi8(0x3f));
+                    __m128i high = _mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi8(0x03)), 6);
+                    __m128i res = _mm_or_si128(_mm_andnot_si128(is_lead, v), _mm_and_si128(is_lead, _mm_or_si128(high, low)));
+                    unsigned drop = conts | (leads & 0x8000);
+                    size_t len_lo = table.length[drop & 0xff];
+                    size_t len_hi = table.length[drop >> 8];
+                    __m128i lo = _mm_shuffle_epi8(res, load128(table.shuffle[drop & 0xff]));
+                    __m128i hi = _mm_shuffle_epi8(_mm_srli_si128(res, 8), load128(table.shuffle[drop >> 8]));
+                    // every remaining 4 bytes of valid input produce at least one byte
+                    out = store_utf8_pair(out, lo, len_lo, hi, len_hi, trusted && last - it >= 16 + 64);
+                    it += 16 - (leads >> 15);
+                }
+                dest = reinterpret_cast<D*>(out);
+            }
+        };
+#endif
+
+#ifdef UTFHPP_SSE2
+        // encodes four valid codepoints held in 32-bit lanes as UTF-16. BMP
+        // codepoints stay in the low half of their lane, and the others become
+        // a surrogate pair, lead surrogate in the low half. Sets astral to the
+        // mask of the lanes holding a pair
+        UTFHPP_FORCE_INLINE __m128i utf16_encode4(__m128i c, __m128i& astral) {
+            astral = _mm_cmpgt_epi32(c, _mm_set1_epi32(0xffff));
+            const __m128i v = _mm_sub_epi32(c, _mm_set1_epi32(0x10000));
+            const __m128i lead = _mm_or_si128(_mm_srli_epi32(v, 10), _mm_set1_epi32(0xd800));
+            const __m128i trail = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi32(0x3ff)), _mm_set1_epi32(0xdc00));
+            const __m128i pair = _mm_or_si128(lead, _mm_slli_epi32(trail, 16));
+            return _mm_or_si128(_mm_andnot_si128(astral, c), _mm_and_si128(astral, pair));
+        }
+
+        // UTF-32 to UTF-8, eight codepoints at a time, for blocks of valid
+        // codepoints. Leaves pure ASCII blocks to the ASCII copy. The
+        // sequences are compacted by a shuffle, or without SSSE3, by storing
+        // the lanes one at a time
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, utf32, utf8> {
+            static const size_t scalar_stretch = 8;
+            static const simd_level level = simd_level::sse2;
+            typedef lanes<4, byte_order<ESrc>::swapped> in;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            // whether the block of a and b holds codepoints which are all
+            // valid, and not all ASCII
+            UTFHPP_FORCE_INLINE static bool convertible(__m128i a, __m128i b) {
+                const __m128i non_ascii = _mm_set1_epi32(static_cast<int>(0xffffff80));
+                if (_mm_movemask_epi8(_mm_or_si128(utf32_invalid(a), utf32_invalid(b))) != 0) { return false; }
+                return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(a, b), non_ascii), _mm_setzero_si128())) != 0xffff;
+            }
+
+            // stores the four sequences encoded by utf8_encode_lanes one lane
+            // at a time, each lane whole, and the next one overwriting what
+            // is past its sequence. The last lane is only stored whole if
+            // has_room
+            UTFHPP_FORCE_INLINE static unsigned char* store_lanes(unsigned char* out, __m128i v, unsigned two, unsigned three, unsigned four, bool has_room) {
+                for (unsigned i = 0; i < 3; ++i) {
+                    int lane = _mm_cvtsi128_si32(v);
+                    std::memcpy(out, &lane, 4);
+                    out += 1 + ((two >> i) & 1) + ((three >> i) & 1) + ((four >> i) & 1);
+                    v = _mm_srli_si128(v, 4);
+                }
+                int lane = _mm_cvtsi128_si32(v);
+                size_t len = 1 + (two >> 3) + (three >> 3) + (four >> 3);
+                if (has_room) {
+                    std::memcpy(out, &lane, 4);
+                }
+                else {
+                    for (size_t k = 0; k < len; ++k) {
+                        out[k] = static_cast<unsigned char>(static_cast<uint32_t>(lane) >> (8 * k));
+                    }
+                }
+                return out + len;
+            }
+
+#ifdef UTFHPP_SSSE3
+            template <typename T>
+            UTFHPP_TARGET_SSSE3 static unsigned char* run_ssse3(const T*& it, const T* last, unsigned char* out, bool trusted) {
+                const utf8_pack_table& table = utf8_pack_table::get();
+                while (last - it >= 8) {
+                    __m128i a = in::load(reinterpret_cast<const unsigned char*>(it));
+                    __m128i b = in::load(reinterpret_cast<const unsigned char*>(it + 4));
+                    if (!convertible(a, b)) { break; }
+
+                    size_t len_lo;
+                    size_t len_hi;
+                    __m128i lo = utf8_encode4(table, a, len_lo);
+                    __m128i hi = utf8_encode4(table, b, len_hi);
+                    // every remaining codepoint of valid input produces at least one byte
+                    out = store_utf8_pair(out, lo, len_lo, hi, len_hi, trusted && last - it >= 8 + 16);
+                    it += 8;
+                }
+                return out;
+            }
+#endif
+
+            template <typename T, typename D>
+            static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 1>::type
+            run(const T*& it, const T* last, D*& dest, bool trusted) {
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+#ifdef UTFHPP_SSSE3
+                if (simd_enabled(simd_level::ssse3)) {
+                    dest = reinterpret_cast<D*>(run_ssse3(it, last, out, trusted));
+                    return;
+                }
+#endif
+                while (last - it >= 8) {
+                    __m128i a = in::load(reinterpret_cast<const unsigned char*>(it));
+                    __m128i b = in::load(reinterpret_cast<const unsigned char*>(it + 4));
+                    if (!convertible(a, b)) { break; }
+
+                    unsigned two;
+                    unsigned three;
+                    unsigned four;
+                    __m128i lo = utf8_encode_lanes(a, two, three, four);
+                    out = store_lanes(out, lo, two, three, four, true);
+                    __m128i hi = utf8_encode_lanes(b, two, three, four);
+                    // every remaining codepoint of valid input produces at least one byte
+                    out = store_lanes(out, hi, two, three, four, trusted && last - it >= 8 + 3);
+                    it += 8;
+                }
+                dest = reinterpret_cast<D*>(out);
+            }
+        };
+
+#ifdef UTFHPP_SSSE3
+        // Compaction of four 32-bit lanes as encoded by utf16_encode4, indexed
+        // by the movemask of the lanes holding a surrogate pair. length is in bytes
+        struct utf16_pack_table {
+            unsigned char shuffle[16][16];
+            unsigned char length[16];
+
+            utf16_pack_table() {
+                for (size_t key = 0; key < 16; ++key) {
+                    size_t out = 0;
+                    for (size_t lane = 0; lane < 4; ++lane) {
+                        size_t len = (key >> lane) & 1 ? 4 : 2;
+                        for (size_t b = 0; b < len; ++b) {
+                            shuffle[key][out++] = static_cast<unsigned char>(4 * lane + b);
+                        }
+                    }
+                    length[key] = static_cast<unsigned char>(out);
+                    for (; out < 16; ++out) {
+                        shuffle[key][out] = 0x80;
+                    }
+                }
+            }
+
+            static const utf16_pack_table& get() {
+                static const utf16_pack_table table;
+                return table;
+            }
+        };
+#endif
+
+        // UTF-32 to UTF-16, eight codepoints at a time, for blocks of valid
+        // codepoints. Blocks of BMP codepoints are packed, ASCII included, as
+        // the ASCII copy does no better. Blocks with surrogate pairs are
+        // compacted by a shuffle, or without SSSE3, four codepoints at a time
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, utf32, utf16> {
+            static const size_t scalar_stretch = 8;
+            static const simd_level level = simd_level::sse2;
+            typedef lanes<4, byte_order<ESrc>::swapped> in;
+            typedef lanes<2, byte_order<EDest>::swapped> out_lanes;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            UTFHPP_FORCE_INLINE static bool is_bmp(__m128i a, __m128i b) {
+                const __m128i non_bmp = _mm_set1_epi32(static_cast<int>(0xffff0000));
+                return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(a, b), non_bmp), _mm_setzero_si128())) == 0xffff;
+            }
+
+            // packs a block of BMP codepoints, unless it holds a surrogate
+            UTFHPP_FORCE_INLINE static bool pack_bmp(__m128i a, __m128i b, unsigned char*& out) {
+                const __m128i surrogate_mask = _mm_set1_epi32(static_cast<int>(0xfffff800));
+                const __m128i surrogate = _mm_set1_epi32(0xd800);
+                const __m128i offset32 = _mm_set1_epi32(0x8000);
+                __m128i is_surrogate = _mm_or_si128(_mm_cmpeq_epi32(_mm_and_si128(a, surrogate_mask), surrogate),
+                                                    _mm_cmpeq_epi32(_mm_and_si128(b, surrogate_mask), surrogate));
+                if (_mm_movemask_epi8(is_surrogate) != 0) { return false; }
+                __m128i packed = _mm_packs_epi32(_mm_sub_epi32(a, offset32), _mm_sub_epi32(b, offset32));
+                out_lanes::store(out, _mm_add_epi16(packed, _mm_set1_epi16(static_cast<short>(0x8000))));
+                out += 16;
+                return true;
+            }
+
+            // stores a lane as encoded by utf16_encode4 whole, and returns the
+            // end of the codeunits it holds
+            UTFHPP_FORCE_INLINE static unsigned char* store_lane(unsigned char* out, int lane, unsigned astral) {
+                std::memcpy(out, &lane, 4);
+                return out + 2 + 2 * (astral & 1);
+            }
+
+            // encodes and stores four valid codepoints without a shuffle. If
+            // only some are above the BMP, each lane is stored whole, and the
+            // next one overwrites the unused half of a BMP codepoint. The last
+            // lane is only stored whole if has_room
+            UTFHPP_FORCE_INLINE static unsigned char* store_half(unsigned char* out, __m128i c, bool has_room) {
+                __m128i astral_mask;
+                __m128i v = utf16_encode4(c, astral_mask);
+                unsigned astral = static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(astral_mask)));
+                if (astral == 0) {
+                    const __m128i offset32 = _mm_set1_epi32(0x8000);
+                    __m128i packed = _mm_add_epi16(_mm_packs_epi32(_mm_sub_epi32(c, offset32), offset32), _mm_set1_epi16(static_cast<short>(0x8000)));
+                    _mm_storel_epi64(reinterpret_cast<__m128i*>(out), out_lanes::order(packed));
+                    return out + 8;
+                }
+                v = out_lanes::order(v);
+                if (astral == 0xf) {
+                    store128(out, v);
+                    return out + 16;
+                }
+                out = store_lane(out, _mm_cvtsi128_si32(v), astral);
+                out = store_lane(out, _mm_cvtsi128_si32(_mm_srli_si128(v, 4)), astral >> 1);
+                out = store_lane(out, _mm_cvtsi128_si32(_mm_srli_si128(v, 8)), astral >> 2);
+                int tail = _mm_cvtsi128_si32(_mm_srli_si128(v, 12));
+                if ((astral & 0x8) || has_room) {
+                    std::memcpy(out, &tail, 4);
+                }
+                else {
+                    uint16_t unit = static_cast<uint16_t>(tail);
+                    std::memcpy(out, &unit, 2);
+                }
+                return out + 2 + 2 * (astral >> 3);
+            }
+
+#ifdef UTFHPP_SSSE3
+            template <typename T>
+            UTFHPP_TARGET_SSSE3 static unsigned char* run_ssse3(const T*& it, const T* last, unsigned char* out, bool trusted) {
+                const utf16_pack_table& table = utf16_pack_table::get();
+                while (last - it >= 8) {
+                    __m128i a = in::load(reinterpret_cast<const unsigned char*>(it));
+                    __m128i b = in::load(reinterpret_cast<const unsigned char*>(it + 4));
+                    if (is_bmp(a, b)) {
+                        if (!pack_bmp(a, b, out)) { break; }
+                        it += 8;
+                        continue;
+                    }
+                    if (_mm_movemask_epi8(_mm_or_si128(utf32_invalid(a), utf32_invalid(b))) != 0) { break; }
+                    __m128i astral_a;
+                    __m128i astral_b;
+                    a = utf16_encode4(a, astral_a);
+                    b = utf16_encode4(b, astral_b);
+                    size_t key_a = static_cast<size_t>(_mm_movemask_ps(_mm_castsi128_ps(astral_a)));
+                    size_t key_b = static_cast<size_t>(_mm_movemask_ps(_mm_castsi128_ps(astral_b)));
+                    if ((key_a & key_b) == 0xf) {
+                        out_lanes::store(out, a);
+                        out_lanes::store(out + 16, b);
+                        out += 32;
+                        it += 8;
+                        continue;
+                    }
+                    __m128i lo = out_lanes::order(_mm_shuffle_epi8(a, load128(table.shuffle[key_a])));
+                    __m128i hi = out_lanes::order(_mm_shuffle_epi8(b, load128(table.shuffle[key_b])));
+                    // every remaining codepoint of valid input produces at least two bytes
+                    out = store_utf8_pair(out, lo, table.length[key_a], hi, table.length[key_b], trusted && last - it >= 8 + 8);
+                    it += 8;
+                }
+                return out;
+            }
+#endif
+
+            template <typename T, typename D>
+            static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 2>::type
+            run(const T*& it, const T* last, D*& dest, bool trusted) {
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+#ifdef UTFHPP_SSSE3
+                if (simd_enabled(simd_level::ssse3)) {
+                    dest = reinterpret_cast<D*>(run_ssse3(it, last, out, trusted));
+                    return;
+                }
+#endif
+                while (last - it >= 8) {
+                    __m128i a = in::load(reinterpret_cast<const unsigned char*>(it));
+                    __m128i b = in::load(reinterpret_cast<const unsigned char*>(it + 4));
+                    if (is_bmp(a, b)) {
+                        if (!pack_bmp(a, b, out)) { break; }
+                        it += 8;
+                        continue;
+                    }
+                    if (_mm_movemask_epi8(_mm_or_si128(utf32_invalid(a), utf32_invalid(b))) != 0) { break; }
+                    // every remaining codepoint of valid input produces at least two bytes
+                    out = store_half(out, a, true);
+                    out = store_half(out, b, trusted && last - it > 8);
+                    it += 8;
+                }
+                dest = reinterpret_cast<D*>(out);
+            }
+        };
+
+        // UTF-16 to UTF-32, eight codeunits at a time, for blocks free of surrogates
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, utf16, utf32> {
+            static const size_t scalar_stretch = 8;
+            static const simd_level level = simd_level::sse2;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            template <typename T, typename D>
+            static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 4>::type
+            run(const T*& it, const T* last, D*& dest, bool) {
+                typedef lanes<2, byte_order<ESrc>::swapped> in;
+                typedef lanes<4, byte_order<EDest>::swapped> out_lanes;
+                const __m128i zero = _mm_setzero_si128();
+                const __m128i surrogate_mask = _mm_set1_epi16(static_cast<short>(0xf800));
+                const __m128i surrogate = _mm_set1_epi16(static_cast<short>(0xd800));
+                const __m128i non_ascii = _mm_set1_epi16(static_cast<short>(0xff80));
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+                while (last - it >= 8) {
+                    __m128i v = in::load(reinterpret_cast<const unsigned char*>(it));
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, surrogate_mask), surrogate)) != 0) { break; }
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, non_ascii), zero)) == 0xffff) { break; }
+                    out_lanes::store(out, _mm_unpacklo_epi16(v, zero));
+                    out_lanes::store(out + 16, _mm_unpackhi_epi16(v, zero));
+                    out += 32;
+                    it += 8;
+                }
+                dest = reinterpret_cast<D*>(out);
+            }
+        };
+
+        // UTF-16 to UTF-16 in the other (or the same) byte order, eight
+        // codeunits at a time, for blocks free of surrogates
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, utf16, utf16> {
+            static const size_t scalar_stretch = 8;
+            static const simd_level level = simd_level::sse2;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            template <typename T, typename D>
+            static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 2>::type
+            run(const T*& it, const T* last, D*& dest, bool) {
+                typedef lanes<2, byte_order<ESrc>::swapped> in;
+                typedef lanes<2, byte_order<EDest>::swapped> out_lanes;
+                const __m128i surrogate_mask = _mm_set1_epi16(static_cast<short>(0xf800));
+                const __m128i surrogate = _mm_set1_epi16(static_cast<short>(0xd800));
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+                while (last - it >= 8) {
+                    __m128i v = in::load(reinterpret_cast<const unsigned char*>(it));
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, surrogate_mask), surrogate)) != 0) { break; }
+                    out_lanes::store(out, v);
+                    out += 16;
+                    it += 8;
+                }
+                dest = reinterpret_cast<D*>(out);
+            }
+        };
+
+        // UTF-32 to UTF-32 in the other (or the same) byte order, eight
+        // codepoints at a time, for blocks of valid codepoints
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, utf32, utf32> {
+            static const size_t scalar_stretch = 8;
+            static const simd_level level = simd_level::sse2;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            template <typename T, typename D>
+            static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 4>::type
+            run(const T*& it, const T* last, D*& dest, bool) {
+                typedef lanes<4, byte_order<ESrc>::swapped> in;
+                typedef lanes<4, byte_order<EDest>::swapped> out_lanes;
+                const __m128i zero = _mm_setzero_si128();
+                const __m128i max = _mm_set1_epi32(0x10ffff);
+                const __m128i surrogate_mask = _mm_set1_epi32(static_cast<int>(0xfffff800));
+                const __m128i surrogate = _mm_set1_epi32(0xd800);
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+                while (last - it >= 8) {
+                    __m128i a = in::load(reinterpret_cast<const unsigned char*>(it));
+                    __m128i b = in::load(reinterpret_cast<const unsigned char*>(it + 4));
+                    // signed comparisons, so values above 0x7fffffff are caught as negative
+                    __m128i invalid = _mm_or_si128(_mm_or_si128(_mm_cmpgt_epi32(a, max), _mm_cmplt_epi32(a, zero)),
+                                                   _mm_or_si128(_mm_cmpgt_epi32(b, max), _mm_cmplt_epi32(b, zero)));
+                    invalid = _mm_or_si128(invalid, _mm_or_si128(_mm_cmpeq_epi32(_mm_and_si128(a, surrogate_mask), surrogate),
+                                                                 _mm_cmpeq_epi32(_mm_and_si128(b, surrogate_mask), surrogate)));
+                    if (_mm_movemask_epi8(invalid) != 0) { break; }
+                    out_lanes::store(out, a);
+                    out_lanes::store(out + 16, b);
+                    out += 32;
+                    it += 8;
+                }
+                dest = reinterpret_cast<D*>(out);
+            }
+        };
+
+        // Latin-1 to UTF-16, sixteen bytes at a time. Every byte is a
+        // codepoint of its own, so the bytes are only widened
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, latin1, utf16> {
+            static const size_t scalar_stretch = 16;
+            static const simd_level level = simd_level::sse2;
+            typedef lanes<2, byte_order<EDest>::swapped> out_lanes;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+#ifdef UTFHPP_AVX2
+            UTFHPP_TARGET_AVX2 static size_t run256(const unsigned char* src, size_t n, unsigned char* out) {
+                size_t i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    __m256i v = load256(src + i);
+                    out_lanes::store256(out + 2 * i, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+                    out_lanes::store256(out + 2 * i + 32, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+                }
+                return i;
+            }
+#endif
+
+            template <typename T, typename D>
+            static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 2>::type
+            run(const T*& it, const T* last, D*& dest, bool) {
+                const unsigned char* src = reinterpret_cast<const unsigned char*>(it);
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+                size_t n = last - it;
+                size_t i = 0;
+#ifdef UTFHPP_AVX2
+                if (simd_enabled(simd_level::avx2)) {
+                    i = run256(src, n, out);
+                }
+#endif
+                const __m128i zero = _mm_setzero_si128();
+                for (; i + 16 <= n; i += 16) {
+                    __m128i v = load128(src + i);
+                    out_lanes::store(out + 2 * i, _mm_unpacklo_epi8(v, zero));
+                    out_lanes::store(out + 2 * i + 16, _mm_unpackhi_epi8(v, zero));
+                }
+                it += i;
+                dest += i;
+            }
+        };
+
+        // Latin-1 to UTF-32, sixteen bytes at a time
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, latin1, utf32> {
+            static const size_t scalar_stretch = 16;
+            static const simd_level level = simd_level::sse2;
+            typedef lanes<4, byte_order<EDest>::swapped> out_lanes;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+#ifdef UTFHPP_AVX2
+            UTFHPP_TARGET_AVX2 static size_t run256(const unsigned char* src, size_t n, unsigned char* out) {
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    __m128i v = load128(src + i);
+                    out_lanes::store256(out + 4 * i, _mm256_cvtepu8_epi32(v));
+                    out_lanes::store256(out + 4 * i + 32, _mm256_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+                }
+                return i;
+            }
+#endif
+
+            template <typename T, typename D>
+            static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 4>::type
+            run(const T*& it, const T* last, D*& dest, bool) {
+                const unsigned char* src = reinterpret_cast<const unsigned char*>(it);
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+                size_t n = last - it;
+                size_t i = 0;
+#ifdef UTFHPP_AVX2
+                if (simd_enabled(simd_level::avx2)) {
+                    i = run256(src, n, out);
+                }
+#endif
+                const __m128i zero = _mm_setzero_si128();
+                for (; i + 16 <= n; i += 16) {
+                    __m128i v = load128(src + i);
+                    __m128i lo = _mm_unpacklo_epi8(v, zero);
+                    __m128i hi = _mm_unpackhi_epi8(v, zero);
+                    out_lanes::store(out + 4 * i, _mm_unpacklo_epi16(lo, zero));
+                    out_lanes::store(out + 4 * i + 16, _mm_unpackhi_epi16(lo, zero));
+                    out_lanes::store(out + 4 * i + 32, _mm_unpacklo_epi16(hi, zero));
+                    out_lanes::store(out + 4 * i + 48, _mm_unpackhi_epi16(hi, zero));
+                }
+                it += i;
+                dest += i;
+            }
+        };
+
+        // UTF-16 to Latin-1, sixteen codeunits at a time, for blocks of
+        // codeunits below 0x100
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, utf16, latin1> {
+            static const size_t scalar_stretch = 16;
+            static const simd_level level = simd_level::sse2;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            template <typename T, typename D>
+            static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 1>::type
+            run(const T*& it, const T* last, D*& dest, bool) {
+                typedef lanes<2, byte_order<ESrc>::swapped> in;
+                const unsigned char* src = reinterpret_cast<const unsigned char*>(it);
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+                const __m128i mask = _mm_set1_epi16(static_cast<short>(0xff00));
+                const __m128i zero = _mm_setzero_si128();
+                size_t n = last - it;
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    __m128i a = in::load(src + 2 * i);
+                    __m128i b = in::load(src + 2 * i + 16);
+                    __m128i any = _mm_and_si128(_mm_or_si128(a, b), mask);
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi16(any, zero)) != 0xffff) { break; }
+                    store128(out + i, _mm_packus_epi16(a, b));
+                }
+                it += i;
+                dest += i;
+            }
+        };
+
+        // UTF-32 to Latin-1, sixteen codepoints at a time, for blocks of
+        // codepoints below U+0100
+        template <typename ESrc, typename EDest>
+        struct block_transcoder<ESrc, EDest, utf32, latin1> {
+            static const size_t scalar_stretch = 16;
+            static const simd_level level = simd_level::sse2;
+
+            template <typename T, typename OutIt>
+            static void run(const T*&, const T*, OutIt&, bool) {}
+
+            template <typename T, typename D>
+            static typename std::enable_if<std::is_integral<D>::value && sizeof(D) == 1>::type
+            run(const T*& it, const T* last, D*& dest, bool) {
+                typedef lanes<4, byte_order<ESrc>::swapped> in;
+                const unsigned char* src = reinterpret_cast<const unsigned char*>(it);
+                unsigned char* out = reinterpret_cast<unsigned char*>(dest);
+                const __m128i mask = _mm_set1_epi32(static_cast<int>(0xffffff00));
+                const __m128i zero = _mm_setzero_si128();
+                size_t n = last - it;
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    __m128i a = in::load(src + 4 * i);
+                    __m128i b = in::load(src + 4 * i + 16);
+                    __m128i c = in::load(src + 4 * i + 32);
+                    __m128i d = in::load(src + 4 * i + 48);
+                    __m128i any = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)), mask);
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi32(any, zero)) != 0xffff) { break; }
+                    store128(out + i, _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+                }
+                it += i;
+                dest += i;
+            }
+        };
+#endif
+
+        // Hoehrmann's UTF-8 decoder ("Flexible and Economical UTF-8 Decoder").
+        // Each byte maps to one of 12 classes, and the class and the current
+        // state select the next state, so a sequence is validated and decoded
+        // with two table lookups per byte, without branching on the bytes.
+        // States are multiples of 12: accept between sequences, reject (which
+        // is never left) on invalid input, and the others within a sequence.
+        // Both tables take 364 bytes.
+        template <typename T = void>
+        struct utf8_dfa_tables {
+            static constexpr unsigned char classes[256] = {
+                0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9,
+                7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+                8, 8, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+                10, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 3, 3, 11, 6, 6, 6, 5, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8
+            };
+            static constexpr unsigned char transitions[108] = {
+                0, 12, 24, 36, 60, 96, 84, 12, 12, 12, 48, 72, // accept
+                12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, // reject
+                12, 0, 12, 12, 12, 12, 12, 0, 12, 0, 12, 12, // one continuation left
+                12, 24, 12, 12, 12, 12, 12, 24, 12, 24, 12, 12, // two left
+                12, 12, 12, 12, 12, 12, 12, 24, 12, 12, 12, 12, // after E0: A0 to BF
+                12, 24, 12, 12, 12, 12, 12, 12, 12, 24, 12, 12, // after ED: 80 to 9F
+                12, 12, 12, 12, 12, 12, 12, 36, 12, 36, 12, 12, // after F0: 90 to BF
+                12, 36, 12, 12, 12, 12, 12, 36, 12, 36, 12, 12, // after F1 to F3: 80 to BF
+                12, 36, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12 // after F4: 80 to 8F
+            };
+        };
+        template <typename T>
+        constexpr unsigned char utf8_dfa_tables<T>::classes[256];
+        template <typename T>
+        constexpr unsigned char utf8_dfa_tables<T>::transitions[108];
+
+        struct utf8_dfa {
+            static const uint32_t accept = 0;
+            static const uint32_t reject = 12;
+
+            static constexpr uint32_t step(uint32_t state, unsigned char b) {
+                return utf8_dfa_tables<>::transitions[state + utf8_dfa_tables<>::classes[b]];
+            }
+
+            // as above, adding the codepoint bits of b to c
+            static constexpr uint32_t step(uint32_t state, unsigned char b, codepoint_type& c) {
+                uint32_t type = utf8_dfa_tables<>::classes[b];
+                c = state != accept ? (b & 0x3fu) | (c << 6) : (0xffu >> type) & b;
+                return utf8_dfa_tables<>::transitions[state + type];
+            }
+
+            // decodes from it until the decoder accepts or rejects, or last is
+            // reached. Returns the number of bytes read, and sets state to the
+            // final state
+            template <typename Iter>
+            static constexpr size_t run(Iter it, Iter last, uint32_t& state, codepoint_type& c) {
+                size_t n = 0;
+                state = accept;
+                do {
+                    state = step(state, static_cast<unsigned char>(it[n]), c);
+                    ++n;
+                } while (state > reject && static_cast<size_t>(last - it) > n);
+                return n;
+            }
+        };
+
+        // decodes the sequence at it for the scalar code, in a single pass where
+        // the encoding allows it (defined below, with sequence_checker)
+        template <typename E, typename Base = typename byte_order<E>::base>
+        struct sequence_decoder;
+
+        // generic transcoding loop, one codepoint at a time
+        template <typename E, typename EDest, typename Iter, typename OutIt>
+        constexpr OutIt transcode(Iter first, Iter last, OutIt dest, std::false_type) {
+            typedef utf_traits<E> src_traits;
+            for (Iter it = first; it != last; it += src_traits::read_length(*it)) {
+                dest = utf_traits<EDest>::encode(src_traits::decode(it), dest);
+            }
+            return dest;
+        }
+
+        // contiguous input: ASCII runs are copied in bulk, other runs go
+        // through the block kernel for the encoding pair, and only what is
+        // left is decoded and re-encoded one codepoint at a time.
+        // Stops before a sequence truncated by the end of the input, and
+        // returns the end of the consumed input.
+        template <typename E, typename EDest, typename T, typename OutIt>
+        const T* transcode_contiguous(const T* first, const T* last, OutIt& dest) {
+            typedef block_transcoder<E, EDest> kernel;
+            // without the kernel, the scalar code takes every non-ASCII run whole
+            const bool vector = simd_enabled(kernel::level);
+            const size_t stretch = vector ? kernel::scalar_stretch : static_cast<size_t>(-1);
+            const T* it = first;
+            while (it < last) {
+                it += copy_ascii<E, EDest>(it, last, dest);
+                if (vector) {
+                    kernel::run(it, last, dest, true);
+                }
+                const T* stop = static_cast<size_t>(last - it) > stretch ? it + stretch : last;
+#ifdef UTFHPP_STATS
+                if (it < stop && !is_ascii(byte_order<E>::apply(*it))) {
+                    ++local_stats().scalar_stretches;
+                }
+#endif
+                while (it < stop && !is_ascii(byte_order<E>::apply(*it))) {
+                    codepoint_type c = 0;
+                    size_t len = sequence_decoder<E>::next(it, last, c);
+                    if (len == 0) {
+                        return it;
+                    }
+                    dest = utf_traits<EDest>::encode(c, dest);
+                    it += len;
+                }
+            }
+            return it;
+        }
+
+        template <typename E, typename EDest, typename T, typename OutIt>
+        OutIt transcode_to(const T* first, const T* last, OutIt dest, std::false_type) {
+            transcode_contiguous<E, EDest>(first, last, dest);
+            return dest;
+        }
+
+        template <typename E, typename EDest, typename T, typename OutIt>
+        OutIt transcode_to(const T* first, const T* last, OutIt dest, std::true_type) {
+            typename std::iterator_traits<OutIt>::pointer out = output_pointer(dest);
+            typename std::iterator_traits<OutIt>::pointer start = out;
+            transcode_contiguous<E, EDest>(first, last, out);
+            return dest + (out - start);
+        }
+
+        template <typename E, typename EDest, typename Iter, typename OutIt>
+        OutIt transcode(Iter first, Iter last, OutIt dest, std::true_type) {
+            if (first == last) {
+                return dest;
+            }
+            const typename std::iterator_traits<Iter>::value_type* src = to_pointer(first);
+            return transcode_to<E, EDest>(src, src + (last - first), dest, is_contiguous_output<OutIt>());
+        }
+
+        // converts the complete sequences in [first, last), and returns the start
+        // of a sequence truncated by the end of the input (or last)
+        template <typename E, typename EDest, typename Iter, typename OutIt>
+        Iter transcode_complete(Iter first, Iter last, OutIt& dest, std::false_type) {
+            typedef utf_traits<E> src_traits;
+            Iter it = first;
+            while (it != last) {
+                size_t len = src_traits::read_length(*it);
+                if (static_cast<size_t>(last - it) < len) {
+                    break;
+                }
+                dest = utf_traits<EDest>::encode(src_traits::decode(it), dest);
+                it += len;
+            }
+            return it;
+        }
+
+        template <typename E, typename EDest, typename Iter, typename OutIt>
+        Iter transcode_complete(Iter first, Iter last, OutIt& dest, std::true_type) {
+            if (first == last) {
+                return last;
+            }
+            const typename std::iterator_traits<Iter>::value_type* src = to_pointer(first);
+            return first + (transcode_contiguous<E, EDest>(src, src + (last - first), dest) - src);
+        }
+
+        // classifies the sequence starting at it, and on success sets len to its length
+        template <typename E, typename Base = typename byte_order<E>::base>
+        struct sequence_checker;
+
+        template <>
+        struct sequence_checker<utf8> {
+            template <typename Iter>
+            static constexpr error_kind check(Iter it, Iter last, size_t& len) {
+                unsigned char lead = static_cast<unsigned char>(*it);
+                len = utf_traits<utf8>::read_length(static_cast<char>(lead));
+                if (len == 1) {
+                    return lead < 0x80 ? error_kind::none : error_kind::invalid_codeunit;
+                }
+                for (size_t i = 1; i < len; ++i) {
+                    if (static_cast<size_t>(last - it) <= i) { return error_kind::truncated; }
+                    if ((static_cast<unsigned char>(it[i]) & 0xc0) != 0x80) { return error_kind::truncated; }
+                }
+                unsigned char second = static_cast<unsigned char>(it[1]);
+                if (lead < 0xc2
+                    || (lead == 0xe0 && second < 0xa0)
+                    || (lead == 0xf0 && second < 0x90)) { return error_kind::overlong; }
+                if (lead == 0xed && second >= 0xa0) { return error_kind::surrogate; }
+                if (lead > 0xf4 || (lead == 0xf4 && second >= 0x90)) { return error_kind::out_of_range; }
+                return error_kind::none;
+            }
+
+            // the length of an invalid sequence when it is replaced or skipped:
+            // the longest prefix of a valid sequence, or 1 if there is none
+            template <typename Iter>
+            static constexpr size_t maximal_subpart(Iter it, Iter last) {
+                unsigned char lead = static_cast<unsigned char>(*it);
+                size_t len = utf_traits<utf8>::read_length(static_cast<char>(lead));
+                if (len == 1 || lead < 0xc2 || lead > 0xf4) {
+                    return 1;
+                }
+                unsigned char lo = lead == 0xe0 ? 0xa0 : lead == 0xf0 ? 0x90 : 0x80;
+                unsigned char hi = lead == 0xed ? 0x9f : lead == 0xf4 ? 0x8f : 0xbf;
+                size_t n = 1;
+                for (; n < len && static_cast<size_t>(last - it) > n; ++n) {
+                    unsigned char c = static_cast<unsigned char>(it[n]);
+                    if (c < lo || c > hi) { break; }
+                    lo = 0x80;
+                    hi = 0xbf;
+                }
+                return n;
+            }
+        };
+
+        template <typename E>
+        struct sequence_checker<E, utf16> {
+            template <typename Iter>
+            static constexpr error_kind check(Iter it, Iter last, size_t& len) {
+                char16_t lead = byte_order<E>::apply(static_cast<char16_t>(*it));
+                len = 1;
+                if (lead < 0xd800 || lead >= 0xe000) { return error_kind::none; }
+                if (lead >= 0xdc00) { return error_kind::surrogate; }
+                if (last - it < 2) { return error_kind::truncated; }
+                char16_t trail = byte_order<E>::apply(static_cast<char16_t>(it[1]));
+                if (trail < 0xdc00 || trail >= 0xe000) { return error_kind::surrogate; }
+                len = 2;
+                return error_kind::none;
+            }
+
+            template <typename Iter>
+            static constexpr size_t maximal_subpart(Iter, Iter) { return 1; }
+        };
+
+        template <typename E>
+        struct sequence_checker<E, utf32> {
+            template <typename Iter>
+            static constexpr error_kind check(Iter it, Iter, size_t& len) {
+                codepoint_type c = byte_order<E>::apply(static_cast<codepoint_type>(*it));
+                len = 1;
+                if (c >= 0xd800 && c < 0xe000) { return error_kind::surrogate; }
+                if (c >= 0x110000) { return error_kind::out_of_range; }
+                return error_kind::none;
+            }
+
+            template <typename Iter>
+            static constexpr size_t maximal_subpart(Iter, Iter) { return 1; }
+        };
+
+        template <>
+        struct sequence_checker<latin1> {
+            template <typename Iter>
+            static constexpr error_kind check(Iter, Iter, size_t& len) {
+                len = 1;
+                return error_kind::none;
+            }
+
+            template <typename Iter>
+            static constexpr size_t maximal_subpart(Iter, Iter) { return 1; }
+        };
+
+        template <typename Table>
+        struct sequence_checker<single_byte_encoding<Table> > {
+            template <typename Iter>
+            static constexpr error_kind check(Iter it, Iter, size_t& len) {
+                len = 1;
+                return utf_traits<single_byte_encoding<Table> >::validate(it, it + 1) ? error_kind::none : error_kind::invalid_codeunit;
+            }
+
+            template <typename Iter>
+            static constexpr size_t maximal_subpart(Iter, Iter) { return 1; }
+        };
+
+        // next() decodes a sequence assumed to be valid, and returns its
+        // length, or 0 if it is cut off by last. check() validates it as well,
+        // returning the error sequence_checker::check() would, and on success
+        // sets len and c
+        template <typename E, typename Base>
+        struct sequence_decoder {
+            template <typename Iter>
+            static size_t next(Iter it, Iter last, codepoint_type& c) {
+                size_t len = utf_traits<E>::read_length(*it);
+                if (static_cast<size_t>(last - it) < len) {
+                    return 0;
+                }
+                c = utf_traits<E>::decode(it);
+                return len;
+            }
+
+            // as above, for input without a known end
+            template <typename Iter>
+            static size_t next(Iter it, codepoint_type& c) {
+                c = utf_traits<E>::decode(it);
+                return utf_traits<E>::read_length(*it);
+            }
+
+            template <typename Iter>
+            static constexpr error_kind check(Iter it, Iter last, size_t& len, codepoint_type& c) {
+                error_kind err = sequence_checker<E>::check(it, last, len);
+                if (err == error_kind::none) {
+                    c = utf_traits<E>::decode(it);
+                }
+                return err;
+            }
+        };
+
+        // UTF-8 is checked through the DFA, and only invalid input takes the
+        // branching sequence_checker, to tell what is wrong. next() is the
+        // generic one: on input assumed to be valid, read_length() and decode()
+        // predict well, while each DFA step waits for the one before it
+        template <>
+        struct sequence_decoder<utf8> : sequence_decoder<utf8, void> {
+            template <typename Iter>
+            static constexpr error_kind check(Iter it, Iter last, size_t& len, codepoint_type& c) {
+                uint32_t state = utf8_dfa::accept;
+                size_t n = utf8_dfa::run(it, last, state, c);
+                if (state == utf8_dfa::accept) {
+                    len = n;
+                    return error_kind::none;
+                }
+                return sequence_checker<utf8>::check(it, last, len);
+            }
+        };
+
+        // validates and transcodes the sequence at it. If the sequence is
+        // invalid, or EDest cannot encode it, returns the error and leaves it
+        // untouched
+        template <typename E, typename EDest, typename Iter, typename OutIt>
+        constexpr error_kind transcode_next_checked(Iter& it, Iter last, OutIt& dest) {
+            size_t len = 0;
+            codepoint_type c = 0;
+            error_kind err = sequence_decoder<E>::check(it, last, len, c);
+            if (err == error_kind::none) {
+                if (!utf_traits<EDest>::representable(c)) {
+                    return error_kind::unrepresentable;
+                }
+                dest = utf_traits<EDest>::encode(c, dest);
+                it += len;
+            }
+            return err;
+        }
+
+        template <typename E, typename EDest, typename Iter, typename OutIt>
+        constexpr checked_result<OutIt> transcode_checked(Iter first, Iter last, OutIt dest, std::false_type) {
+            for (Iter it = first; it != last;) {
+                error_kind err = transcode_next_checked<E, EDest>(it, last, dest);
+                if (err != error_kind::none) {
+                    return checked_result<OutIt>(dest, err, it - first);
+                }
+            }
+            return checked_result<OutIt>(dest, error_kind::none, last - first);
+        }
+
+        // contiguous input: ASCII runs are always valid, and are copied in bulk.
+        // Block kernels validate what they convert
+        template <typename E, typename EDest, typename T, typename OutIt>
+        checked_result<OutIt> transcode_checked_contiguous(const T* first, const T* last, OutIt dest) {
+            typedef block_transcoder<E, EDest> kernel;
+            const bool vector = simd_enabled(kernel::level);
+            const size_t stretch = vector ? kernel::scalar_stretch : static_cast<size_t>(-1);
+            const T* it = first;
+            while (it < last) {
+                it += copy_ascii<E, EDest>(it, last, dest);
+                if (vector) {
+                    kernel::run(it, last, dest, false);
+                }
+                const T* stop = static_cast<size_t>(last - it) > stretch ? it + stretch : last;
+#ifdef UTFHPP_STATS
+                if (it < stop && !is_ascii(byte_order<E>::apply(*it))) {
+                    ++local_stats().scalar_stretches;
+                }
+#endif
+                while (it < stop && !is_ascii(byte_order<E>::apply(*it))) {
+                    error_kind err = transcode_next_checked<E, EDest>(it, last, dest);
+                    if (err != error_kind::none) {
+                        return checked_result<OutIt>(dest, err, it - first);
+                    }
+                }
+            }
+            return checked_result<OutIt>(dest, error_kind::none, last - first);
+        }
+
+        template <typename E, typename EDest, typename T, typename OutIt>
+        checked_result<OutIt> transcode_checked_to(const T* first, const T* last, OutIt dest, std::false_type) {
+            return transcode_checked_contiguous<E, EDest>(first, last, dest);
+        }
+
+        template <typename E, typename EDest, typename T, typename OutIt>
+        checked_result<OutIt> transcode_checked_to(const T* first, const T* last, OutIt dest, std::true_type) {
+            typename std::iterator_traits<OutIt>::pointer start = output_pointer(dest);
+            checked_result<typename std::iterator_traits<OutIt>::pointer> res = transcode_checked_contiguous<E, EDest>(first, last, start);
+            return checked_result<OutIt>(dest + (res.dest - start), res.error, res.offset);
+        }
+
+        template <typename E, typename EDest, typename Iter, typename OutIt>
+        checked_result<OutIt> transcode_checked(Iter first, Iter last, OutIt dest, std::true_type) {
+            if (first == last) {
+                return checked_result<OutIt>(dest, error_kind::none, 0);
+            }
+            const typename std::iterator_traits<Iter>::value_type* src = to_pointer(first);
+            return transcode_checked_to<E, EDest>(src, src + (last - first), dest, is_contiguous_output<OutIt>());
+        }
+
+        template <typename EDest, typename OutIt>
+        constexpr OutIt on_invalid(OutIt dest, policy::replace) {
+            return utf_traits<EDest>::encode(0xfffd, dest);
+        }
+
+        template <typename EDest, typename OutIt>
+        constexpr OutIt on_invalid(OutIt dest, policy::skip) {
+            return dest;
+        }
+
+        // Whether the caller is being evaluated at compile time. Only known from
+        // C++20 on, so before that, conversions of contiguous strings are never
+        // constant expressions
+        constexpr bool is_constant_evaluated() {
+#ifdef UTFHPP_HAS_IS_CONSTANT_EVALUATED
+            return std::is_constant_evaluated();
+#else
+            return false;
+#endif
+        }
+
+        // converts the valid stretches with the checked fast path, and resumes
+        // past each invalid sequence after applying the policy to it
+        template <typename E, typename EDest, typename Iter, typename OutIt, typename Policy, typename Contiguous>
+        constexpr OutIt transcode_repaired(Iter first, Iter last, OutIt dest, Policy, Contiguous) {
+            for (;;) {
+                checked_result<OutIt> res = transcode_checked<E, EDest>(first, last, dest, Contiguous());
+                dest = res.dest;
+                if (res.ok()) {
+                    return dest;
+                }
+                first += res.offset;
+#ifdef UTFHPP_STATS
+                if (!is_constant_evaluated()) {
+                    count_stat<E, EDest>(stats_operation::to, stats_errors);
+                }
+#endif
+                // a valid sequence which EDest cannot encode is replaced as a whole
+                size_t len = 0;
+                if (res.error != error_kind::unrepresentable) {
+                    len = sequence_checker<E>::maximal_subpart(first, last);
+                }
+                else {
+                    sequence_checker<E>::check(first, last, len);
+                }
+                first += len;
+                dest = on_invalid<EDest>(dest, Policy());
+            }
+        }
+
+        // strict conversions report errors, the others return the end of the output
+        template <typename Policy, typename OutIt>
+        struct policy_result {
+            typedef OutIt type;
+        };
+
+        template <typename OutIt>
+        struct policy_result<policy::strict, OutIt> {
+            typedef checked_result<OutIt> type;
+        };
+
+        // the SIMD paths cannot run at compile time, so constant evaluation
+        // takes the generic loops
+        template <typename E, typename EDest, typename Iter, typename OutIt>
+        constexpr OutIt transcode_with(Iter first, Iter last, OutIt dest, policy::unchecked) {
+            if (is_constant_evaluated()) {
+                return transcode<E, EDest>(first, last, dest, std::false_type());
+            }
+            return transcode<E, EDest>(first, last, dest, is_contiguous<Iter>());
+        }
+
+        template <typename E, typename EDest, typename Iter, typename OutIt>
+        constexpr checked_result<OutIt> transcode_with(Iter first, Iter last, OutIt dest, policy::strict) {
+            if (is_constant_evaluated()) {
+                return transcode_checked<E, EDest>(first, last, dest, std::false_type());
+            }
+#ifdef UTFHPP_STATS
+            checked_result<OutIt> res = transcode_checked<E, EDest>(first, last, dest, is_contiguous<Iter>());
+            if (!res.ok()) {
+                count_stat<E, EDest>(stats_operation::to, stats_errors);
+            }
+            return res;
+#else
+            return transcode_checked<E, EDest>(first, last, dest, is_contiguous<Iter>());
+#endif
+        }
+
+        template <typename E, typename EDest, typename Iter, typename OutIt, typename Policy>
+        constexpr OutIt transcode_with(Iter first, Iter last, OutIt dest, Policy) {
+            if (is_constant_evaluated()) {
+                return transcode_repaired<E, EDest>(first, last, dest, Policy(), std::false_type());
+            }
+            return transcode_repaired<E, EDest>(first, last, dest, Policy(), is_contiguous<Iter>());
+        }
+
+#ifdef UTFHPP_STATS
+        // transcode_with, counted as a call of stringview::to
+        template <typename E, typename EDest, typename Iter, typename OutIt, typename Policy>
+        typename policy_result<Policy, OutIt>::type transcode_counted(Iter first, Iter last, OutIt dest, Policy) {
+            thread_stats& stats = local_stats();
+            uint64_t stretches = stats.scalar_stretches;
+            count_call<E, EDest, typename std::iterator_traits<Iter>::value_type>(stats_operation::to, last - first, is_contiguous<Iter>::value);
+            typename policy_result<Policy, OutIt>::type res = transcode_with<E, EDest>(first, last, dest, Policy());
+            count_stat<E, EDest>(stats_operation::to, stats_fallbacks, stats.scalar_stretches - stretches);
+            return res;
+        }
+#endif
+
+        // validates the sequence starting at it, and advances it past the sequence
+        template <typename E, typename Iter>
+        bool validate_next(Iter& it, Iter last) {
+            typedef utf_traits<E> traits_t;
+            size_t len = traits_t::read_length(*it);
+            if (last - it < static_cast<ptrdiff_t>(len)) {
+                return false;
+            }
+            if (!traits_t::validate(it, it + len)) {
+                return false;
+            }
+            codepoint_type cp = traits_t::decode(it);
+            if (!validate_codepoint(cp)) {
+                return false;
+            }
+            it += len;
+            return true;
+        }
+
+        // reference validator, one sequence at a time
+        template <typename E, typename Iter>
+        bool validate_scalar(Iter first, Iter last) {
+            for (Iter it = first; it < last;) {
+                if (!validate_next<E>(it, last)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+#ifdef UTFHPP_SSSE3
+        // Lookup-based UTF-8 validation (Keiser & Lemire, "Validating UTF-8 In
+        // Less Than One Instruction Per Byte"). Each byte is classified together
+        // with the byte before it by three 16-entry nibble lookups; the AND of the
+        // three results is non-zero exactly when the pair cannot occur in valid
+        // UTF-8. The remaining errors (missing 3rd/4th bytes, and continuations
+        // where none are allowed) are caught by comparing the bytes two and three
+        // positions back against the continuation bits found by the lookups.
+        struct utf8_lookup {
+            enum {
+                too_short = 1 << 0, // 11______ 0_______ or 11______ 11______
+                too_long = 1 << 1, // 0_______ 10______
+                overlong_3 = 1 << 2, // 11100000 100_____
+                too_large = 1 << 3, // 11110100 1001____, 11110100 101_____, 11110101+ 1_______
+                surrogate = 1 << 4, // 11101101 101_____
+                overlong_2 = 1 << 5, // 1100000_ 10______
+                too_large_1000 = 1 << 6, // 11110101+ 1000____
+                overlong_4 = 1 << 6, // 11110000 1000____
+                two_conts = 1 << 7, // 10______ 10______
+                carry = too_short | too_long | two_conts
+            };
+
+            static const unsigned char* byte_1_high() {
+                static const unsigned char table[16] = {
+                    // 0_______ ________
+                    too_long, too_long, too_long, too_long,
+                    too_long, too_long, too_long, too_long,
+                    // 10______ ________
+                    two_conts, two_conts, two_conts, two_conts,
+                    // 1100____ ________
+                    too_short | overlong_2,
+                    // 1101____ ________
+                    too_short,
+                    // 1110____ ________
+                    too_short | overlong_3 | surrogate,
+                    // 1111____ ________
+                    too_short | too_large | too_large_1000 | overlong_4
+                };
+                return table;
+            }
+            static const unsigned char* byte_1_low() {
+                static const unsigned char table[16] = {
+                    // ____0000 ________
+                    carry | overlong_3 | overlong_2 | overlong_4,
+                    // ____0001 ________
+                    carry | overlong_2,
+                    // ____001_ ________
+                    carry,
+                    carry,
+                    // ____0100 ________
+                    carry | too_large,
+                    // ____0101 ________ and up
+                    carry | too_large | too_large_1000,
+                    carry | too_large | too_large_1000,
+                    carry | too_large | too_large_1000,
+                    carry | too_large | too_large_1000,
+                    carry | too_large | too_large_1000,
+                    carry | too_large | too_large_1000,
+                    carry | too_large | too_large_1000,
+                    carry | too_large | too_large_1000,
+                    // ____1101 ________
+                    carry | too_large | too_large_1000 | surrogate,
+                    carry | too_large | too_large_1000,
+                    carry | too_large | too_large_1000
+                };
+                return table;
+            }
+            static const unsigned char* byte_2_high() {
+                static const unsigned char table[16] = {
+                    // ________ 0_______
+                    too_short, too_short, too_short, too_short,
+                    too_short, too_short, too_short, too_short,
+                    // ________ 1000____
+                    too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+                    // ________ 1001____
+                    too_long | overlong_2 | two_conts | overlong_3 | too_large,
+                    // ________ 101_____
+                    too_long | overlong_2 | two_conts | surrogate | too_large,
+                    too_long | overlong_2 | two_conts | surrogate | too_large,
+                    // ________ 11______
+                    too_short, too_short, too_short, too_short
+                };
+                return table;
+            }
+        };
+
+        // the bytes which, at the end of a block, still expect continuations
+        inline const unsigned char* utf8_incomplete_limits() {
+            static const unsigned char table[32] = {
+                0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1
+            };
+            return table;
+        }
+
+        // the lookups on 16 bytes at a time
+        struct utf8_checker128 {
+            static const size_t width = 16;
+
+            __m128i error;
+            __m128i prev_input;
+            __m128i prev_incomplete;
+
+            UTFHPP_TARGET_SSSE3 utf8_checker128() : error(_mm_setzero_si128()), prev_input(_mm_setzero_si128()), prev_incomplete(_mm_setzero_si128()) {}
+
+            UTFHPP_TARGET_SSSE3 static bool is_ascii(__m128i v) { return _mm_movemask_epi8(v) == 0; }
+
+            UTFHPP_TARGET_SSSE3 void check(__m128i input) {
+                const __m128i low_nibble = _mm_set1_epi8(0x0f);
+                __m128i prev1 = _mm_alignr_epi8(input, prev_input, 16 - 1);
+                __m128i byte_1_high = _mm_shuffle_epi8(load128(utf8_lookup::byte_1_high()), _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble));
+                __m128i byte_1_low = _mm_shuffle_epi8(load128(utf8_lookup::byte_1_low()), _mm_and_si128(prev1, low_nibble));
+                __m128i byte_2_high = _mm_shuffle_epi8(load128(utf8_lookup::byte_2_high()), _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble));
+                __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+                __m128i is_third_byte = _mm_subs_epu8(_mm_alignr_epi8(input, prev_input, 16 - 2), _mm_set1_epi8(static_cast<char>(0xe0 - 0x80)));
+                __m128i is_fourth_byte = _mm_subs_epu8(_mm_alignr_epi8(input, prev_input, 16 - 3), _mm_set1_epi8(static_cast<char>(0xf0 - 0x80)));
+                __m128i must_be_continuation = _mm_and_si128(_mm_or_si128(is_third_byte, is_fourth_byte), _mm_set1_epi8(static_cast<char>(0x80)));
+
+                error = _mm_or_si128(error, _mm_xor_si128(must_be_continuation, special_cases));
+                prev_incomplete = _mm_subs_epu8(input, load128(utf8_incomplete_limits() + 16));
+                prev_input = input;
+            }
+            UTFHPP_TARGET_SSSE3 void check_ascii(__m128i input) {
+                error = _mm_or_si128(error, prev_incomplete);
+                prev_incomplete = _mm_setzero_si128();
+                prev_input = input;
+            }
+            // checks the two vectors from p, with a shortcut if both are ASCII
+            UTFHPP_TARGET_SSSE3 void check_block(const unsigned char* p) {
+                __m128i a = load128(p);
+                __m128i b = load128(p + width);
+                if (is_ascii(a) && is_ascii(b)) {
+                    check_ascii(b);
+                }
+                else {
+                    check(a);
+                    check(b);
+                }
+            }
+            UTFHPP_TARGET_SSSE3 bool has_error() const { return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xffff; }
+        };
+
+#ifdef UTFHPP_AVX2
+        // the lookups on 32 bytes at a time
+        struct utf8_checker256 {
+            static const size_t width = 32;
+
+            __m256i error;
+            __m256i prev_input;
+            __m256i prev_incomplete;
+
+            UTFHPP_TARGET_AVX2 utf8_checker256() : error(_mm256_setzero_si256()), prev_input(_mm256_setzero_si256()), prev_incomplete(_mm256_setzero_si256()) {}
+
+            UTFHPP_TARGET_AVX2 static __m256i table(const unsigned char* t) {
+                return _mm256_broadcastsi128_si256(load128(t));
+            }
+            UTFHPP_TARGET_AVX2 static bool is_ascii(__m256i v) { return _mm256_movemask_epi8(v) == 0; }
+
+            template <int N>
+            UTFHPP_TARGET_AVX2 static __m256i prev(__m256i input, __m256i prev_input) {
+                return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev_input, input, 0x21), 16 - N);
+            }
+
+            UTFHPP_TARGET_AVX2 void check(__m256i input) {
+                const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+                __m256i prev1 = prev<1>(input, prev_input);
+                __m256i byte_1_high = _mm256_shuffle_epi8(table(utf8_lookup::byte_1_high()), _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+                __m256i byte_1_low = _mm256_shuffle_epi8(table(utf8_lookup::byte_1_low()), _mm256_and_si256(prev1, low_nibble));
+                __m256i byte_2_high = _mm256_shuffle_epi8(table(utf8_lookup::byte_2_high()), _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+                __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+                __m256i is_third_byte = _mm256_subs_epu8(prev<2>(input, prev_input), _mm256_set1_epi8(static_cast<char>(0xe0 - 0x80)));
+                __m256i is_fourth_byte = _mm256_subs_epu8(prev<3>(input, prev_input), _mm256_set1_epi8(static_cast<char>(0xf0 - 0x80)));
+                __m256i must_be_continuation = _mm256_and_si256(_mm256_or_si256(is_third_byte, is_fourth_byte), _mm256_set1_epi8(static_cast<char>(0x80)));
+
+                error = _mm256_or_si256(error, _mm256_xor_si256(must_be_continuation, special_cases));
+                prev_incomplete = _mm256_subs_epu8(input, load256(utf8_incomplete_limits()));
+                prev_input = input;
+            }
+            UTFHPP_TARGET_AVX2 void check_ascii(__m256i input) {
+                error = _mm256_or_si256(error, prev_incomplete);
+                prev_incomplete = _mm256_setzero_si256();
+                prev_input = input;
+            }
+            UTFHPP_TARGET_AVX2 void check_block(const unsigned char* p) {
+                __m256i a = load256(p);
+                __m256i b = load256(p + width);
+                if (is_ascii(a) && is_ascii(b)) {
+                    check_ascii(b);
+                }
+                else {
+                    check(a);
+                    check(b);
+                }
+            }
+            UTFHPP_TARGET_AVX2 bool has_error() const { return !_mm256_testz_si256(error, error); }
+        };
+#endif
+
+        // Validates [first, last) two vectors at a time. On success, sets resume to
+        // the position the scalar validator must continue from (the start of the
+        // last sequence that may be cut off by the end of the final block).
+        template <typename Checker>
+        UTFHPP_FORCE_INLINE bool validate_utf8_blocks(const unsigned char* first, const unsigned char* last, const unsigned char*& resume) {
+            const size_t step = 2 * Checker::width;
+            Checker checker;
+            const unsigned char* it = first;
+            for (; static_cast<size_t>(last - it) >= step; it += step) {
+                checker.check_block(it);
+            }
+            if (checker.has_error()) {
+                return false;
+            }
+            // back up to a lead byte whose continuations may lie beyond the last block
+            for (size_t i = 1; i <= 3 && i <= static_cast<size_t>(it - first); ++i) {
+                unsigned char c = *(it - i);
+                if ((c & 0xc0) != 0x80) {
+                    resume = c >= 0xc0 ? it - i : it;
+                    return true;
+                }
+            }
+            resume = it;
+            return true;
+        }
+
+        UTFHPP_TARGET_SSSE3 inline bool validate_utf8_blocks128(const unsigned char* first, const unsigned char* last, const unsigned char*& resume) {
+            return validate_utf8_blocks<utf8_checker128>(first, last, resume);
+        }
+#ifdef UTFHPP_AVX2
+        UTFHPP_TARGET_AVX2 inline bool validate_utf8_blocks256(const unsigned char* first, const unsigned char* last, const unsigned char*& resume) {
+            return validate_utf8_blocks<utf8_checker256>(first, last, resume);
+        }
+#endif
+#endif
+
+        template <typename E, typename Base = typename byte_order<E>::base>
+        struct contiguous_validator {
+            template <typename T>
+            static bool run(const T* first, const T* last) {
+                return validate_scalar<E>(first, last);
+            }
+        };
+
+        // a trail surrogate must appear exactly where the previous codeunit is
+        // a lead surrogate, which is checked eight codeunits at a time
+        template <typename E>
+        struct contiguous_validator<E, utf16> {
+            template <typename T>
+            static bool run(const T* first, const T* last) {
+                size_t i = 0;
+#ifdef UTFHPP_SSE2
+                if (simd_enabled(simd_level::sse2)) {
+                    typedef lanes<2, byte_order<E>::swapped> in;
+                    const unsigned char* src = reinterpret_cast<const unsigned char*>(first);
+                    size_t len = last - first;
+                    const __m128i mask = _mm_set1_epi16(static_cast<short>(0xfc00));
+                    const __m128i lead = _mm_set1_epi16(static_cast<short>(0xd800));
+                    const __m128i trail = _mm_set1_epi16(static_cast<short>(0xdc00));
+                    __m128i prev_is_lead = _mm_setzero_si128();
+                    __m128i error = _mm_setzero_si128();
+                    for (; len - i >= 8; i += 8) {
+                        __m128i v = _mm_and_si128(in::load(src + 2 * i), mask);
+                        __m128i is_lead = _mm_cmpeq_epi16(v, lead);
+                        __m128i is_trail = _mm_cmpeq_epi16(v, trail);
+                        __m128i follows_lead = _mm_or_si128(_mm_slli_si128(is_lead, 2), _mm_srli_si128(prev_is_lead, 14));
+                        error = _mm_or_si128(error, _mm_xor_si128(is_trail, follows_lead));
+                        prev_is_lead = is_lead;
+                    }
+                    if (_mm_movemask_epi8(error) != 0) {
+                        return false;
+                    }
+                    // a lead surrogate ending the last block is checked by the scalar code
+                    if (i > 0 && (byte_order<E>::apply(static_cast<char16_t>(first[i - 1])) & 0xfc00) == 0xd800) {
+                        --i;
+                    }
+                }
+#endif
+                return validate_scalar<E>(first + i, last);
+            }
+        };
+
+        template <>
+        struct contiguous_validator<utf8> {
+            template <typename T>
+            static bool run(const T* first, const T* last) {
+                const unsigned char* it = reinterpret_cast<const unsigned char*>(first);
+                const unsigned char* end = reinterpret_cast<const unsigned char*>(last);
+#ifdef UTFHPP_AVX2
+                if (simd_enabled(simd_level::avx2) && !validate_utf8_blocks256(it, end, it)) {
+                    return false;
+                }
+#endif
+#ifdef UTFHPP_SSSE3
+                // also takes the blocks left over by the AVX2 pass
+                if (simd_enabled(simd_level::ssse3) && !validate_utf8_blocks128(it, end, it)) {
+                    return false;
+                }
+#endif
+                // scalar tail through the DFA, skipping over ASCII runs in bulk
+                while (it < end) {
+                    it += ascii_length(it, end);
+                    uint32_t state = utf8_dfa::accept;
+                    for (; it < end && (state != utf8_dfa::accept || !is_ascii(*it)); ++it) {
+                        state = utf8_dfa::step(state, *it);
+                        if (state == utf8_dfa::reject) {
+                            return false;
+                        }
+                    }
+                    if (state != utf8_dfa::accept) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+        };
+
+        template <>
+        struct contiguous_validator<latin1> {
+            template <typename T>
+            static bool run(const T*, const T*) { return true; }
+        };
+
+        // only codepages with undefined bytes need checking, and only their
+        // non-ASCII bytes
+        template <typename Table>
+        struct contiguous_validator<single_byte_encoding<Table> > {
+            template <typename T>
+            static bool run(const T* first, const T* last) {
+                typedef utf_traits<single_byte_encoding<Table> > traits_t;
+                if (traits_t::tables.complete) {
+                    return true;
+                }
+                const unsigned char* it = reinterpret_cast<const unsigned char*>(first);
+                const unsigned char* end = reinterpret_cast<const unsigned char*>(last);
+                while (it < end) {
+                    it += ascii_length(it, end);
+                    for (; it < end && !is_ascii(*it); ++it) {
+                        if (traits_t::tables.decode[*it] == 0xfffd) {
+                            return false;
+                        }
+                    }
+                }
+                return true;
+            }
+        };
+
+        template <typename E, typename Iter>
+        bool validate_range(Iter first, Iter last, std::false_type) {
+            return validate_scalar<E>(first, last);
+        }
+
+        template <typename E, typename Iter>
+        bool validate_range(Iter first, Iter last, std::true_type) {
+            if (first == last) {
+                return true;
+            }
+            const typename std::iterator_traits<Iter>::value_type* src = to_pointer(first);
+            return contiguous_validator<E>::run(src, src + (last - first));
+        }
+
+        // Codepoint counting. Valid UTF-8 has one non-continuation byte per
+        // codepoint, and valid UTF-16 one codeunit per codepoint, plus one
+        // extra for every lead surrogate, so neither needs to decode anything.
+        template <typename E, typename Base = typename byte_order<E>::base>
+        struct codepoint_counter {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                size_t n = 0;
+                for (const T* it = first; it < last; it += utf_traits<E>::read_length(*it)) {
+                    ++n;
+                }
+                return n;
+            }
+        };
+
+        template <>
+        struct codepoint_counter<utf8> {
+#ifdef UTFHPP_AVX2
+            // counts the codepoints of the whole 32 byte blocks from src[i],
+            // advancing i past them
+            UTFHPP_TARGET_AVX2 static size_t run256(const unsigned char* src, size_t len, size_t& i) {
+                size_t n = 0;
+                // per-byte counters are flushed before they can overflow
+                const __m256i cont_limit = _mm256_set1_epi8(static_cast<char>(0xbf));
+                while (len - i >= 32) {
+                    size_t blocks = std::min<size_t>((len - i) / 32, 255);
+                    __m256i acc = _mm256_setzero_si256();
+                    for (size_t b = 0; b < blocks; ++b, i += 32) {
+                        acc = _mm256_sub_epi8(acc, _mm256_cmpgt_epi8(load256(src + i), cont_limit));
+                    }
+                    __m256i sums = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+                    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+                    n += static_cast<size_t>(_mm_cvtsi128_si32(sum)) + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+                }
+                return n;
+            }
+#endif
+
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                const unsigned char* src = reinterpret_cast<const unsigned char*>(first);
+                size_t len = last - first;
+                size_t n = 0;
+                size_t i = 0;
+#ifdef UTFHPP_AVX2
+                if (simd_enabled(simd_level::avx2)) {
+                    n += run256(src, len, i);
+                }
+#endif
+#ifdef UTFHPP_SSE2
+                if (simd_enabled(simd_level::sse2)) {
+                    // bytes 0x80-0xbf are exactly those less than -64 as signed chars
+                    const __m128i cont_limit128 = _mm_set1_epi8(static_cast<char>(0xbf));
+                    while (len - i >= 16) {
+                        size_t blocks = std::min<size_t>((len - i) / 16, 255);
+                        __m128i acc = _mm_setzero_si128();
+                        for (size_t b = 0; b < blocks; ++b, i += 16) {
+                            acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(load128(src + i), cont_limit128));
+                        }
+                        __m128i sum = _mm_sad_epu8(acc, _mm_setzero_si128());
+                        n += static_cast<size_t>(_mm_cvtsi128_si32(sum)) + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+                    }
+                }
+#endif
+                for (; i < len; ++i) {
+                    n += (src[i] & 0xc0) != 0x80;
+                }
+                return n;
+            }
+        };
+
+        template <typename E>
+        struct codepoint_counter<E, utf16> {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                size_t len = last - first;
+                size_t leads = 0;
+                size_t i = 0;
+#ifdef UTFHPP_SSE2
+                if (simd_enabled(simd_level::sse2)) {
+                    typedef lanes<2, byte_order<E>::swapped> in;
+                    const unsigned char* src = reinterpret_cast<const unsigned char*>(first);
+                    const __m128i mask = _mm_set1_epi16(static_cast<short>(0xfc00));
+                    const __m128i lead = _mm_set1_epi16(static_cast<short>(0xd800));
+                    while (len - i >= 8) {
+                        size_t blocks = std::min<size_t>((len - i) / 8, 0x7fff);
+                        __m128i acc = _mm_setzero_si128();
+                        for (size_t b = 0; b < blocks; ++b, i += 8) {
+                            acc = _mm_sub_epi16(acc, _mm_cmpeq_epi16(_mm_and_si128(in::load(src + 2 * i), mask), lead));
+                        }
+                        __m128i sum = _mm_madd_epi16(acc, _mm_set1_epi16(1));
+                        sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 8));
+                        sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 4));
+                        leads += static_cast<size_t>(_mm_cvtsi128_si32(sum));
+                    }
+                }
+#endif
+                for (; i < len; ++i) {
+                    leads += (byte_order<E>::apply(static_cast<char16_t>(first[i])) & 0xfc00) == 0xd800;
+                }
+                return len - leads;
+            }
+        };
+
+        template <typename E>
+        struct codepoint_counter<E, utf32> {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                return last - first;
+            }
+        };
+
+        template <>
+        struct codepoint_counter<latin1> {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                return last - first;
+            }
+        };
+
+        template <typename Table>
+        struct codepoint_counter<single_byte_encoding<Table> > {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                return last - first;
+            }
+        };
+
+        template <typename E, typename Iter>
+        size_t count_codepoints(Iter first, Iter last, std::false_type) {
+            size_t n = 0;
+            for (Iter it = first; it != last; it += utf_traits<E>::read_length(*it)) {
+                ++n;
+            }
+            return n;
+        }
+
+        template <typename E, typename Iter>
+        size_t count_codepoints(Iter first, Iter last, std::true_type) {
+            if (first == last) {
+                return 0;
+            }
+            const typename std::iterator_traits<Iter>::value_type* src = to_pointer(first);
+            return codepoint_counter<E>::run(src, src + (last - first));
+        }
+
+        inline size_t popcount64(uint64_t m) {
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<size_t>(__builtin_popcountll(m));
+#else
+            size_t n = 0;
+            for (; m != 0; m &= m - 1) { ++n; }
+            return n;
+#endif
+        }
+
+        // the position of set bit n (counting from 0) in m
+        inline size_t nth_bit(uint64_t m, size_t n) {
+            for (; n > 0; --n) {
+                m &= m - 1;
+            }
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<size_t>(__builtin_ctzll(m));
+#else
+            size_t pos = 0;
+            for (; (m & 1) == 0; m >>= 1) { ++pos; }
+            return pos;
+#endif
+        }
+
+        // Which codeunits begin a sequence, assuming valid input. mask64 sets
+        // bit i if p[i] does, for the 64 codeunits from p
+        template <typename E, typename Base = typename byte_order<E>::base>
+        struct sequence_starts {
+            template <typename T>
+            static bool is_start(T) { return true; }
+            template <typename T>
+            static uint64_t mask64(const T*) { return ~uint64_t(0); }
+        };
+
+        template <>
+        struct sequence_starts<utf8> {
+            template <typename T>
+            static bool is_start(T c) { return (static_cast<unsigned char>(c) & 0xc0) != 0x80; }
+
+            template <typename T>
+            static uint64_t mask64(const T* p) {
+                uint64_t m = 0;
+#ifdef UTFHPP_SSE2
+                if (simd_enabled(simd_level::sse2)) {
+                    const unsigned char* src = reinterpret_cast<const unsigned char*>(p);
+                    const __m128i cont_limit = _mm_set1_epi8(static_cast<char>(0xbf));
+                    for (size_t i = 0; i < 4; ++i) {
+                        uint64_t bits = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpgt_epi8(load128(src + 16 * i), cont_limit)));
+                        m |= bits << (16 * i);
+                    }
+                    return m;
+                }
+#endif
+                for (size_t i = 0; i < 64; ++i) {
+                    m |= static_cast<uint64_t>(is_start(p[i])) << i;
+                }
+                return m;
+            }
+        };
+
+        template <typename E>
+        struct sequence_starts<E, utf16> {
+            template <typename T>
+            static bool is_start(T c) { return (byte_order<E>::apply(static_cast<char16_t>(c)) & 0xfc00) != 0xdc00; }
+
+            template <typename T>
+            static uint64_t mask64(const T* p) {
+                uint64_t m = 0;
+#ifdef UTFHPP_SSE2
+                if (simd_enabled(simd_level::sse2)) {
+                    typedef lanes<2, byte_order<E>::swapped> in;
+                    const unsigned char* src = reinterpret_cast<const unsigned char*>(p);
+                    const __m128i mask = _mm_set1_epi16(static_cast<short>(0xfc00));
+                    const __m128i trail = _mm_set1_epi16(static_cast<short>(0xdc00));
+                    for (size_t i = 0; i < 4; ++i) {
+                        __m128i lo = _mm_cmpeq_epi16(_mm_and_si128(in::load(src + 32 * i), mask), trail);
+                        __m128i hi = _mm_cmpeq_epi16(_mm_and_si128(in::load(src + 32 * i + 16), mask), trail);
+                        uint64_t bits = static_cast<uint16_t>(~_mm_movemask_epi8(_mm_packs_epi16(lo, hi)));
+                        m |= bits << (16 * i);
+                    }
+                    return m;
+                }
+#endif
+                for (size_t i = 0; i < 64; ++i) {
+                    m |= static_cast<uint64_t>(is_start(p[i])) << i;
+                }
+                return m;
+            }
+        };
+
+        // Appends the codeunit offset of every stride'th codepoint to marks,
+        // and returns the number of codepoints. Sequence starts are found 64
+        // codeunits at a time, and only blocks containing a mark are looked into
+        template <typename E, typename T>
+        size_t index_codepoints(const T* first, const T* last, size_t stride, std::vector<size_t>& marks) {
+            size_t len = last - first;
+            size_t count = 0;
+            size_t next = 0;
+            size_t i = 0;
+            for (; len - i >= 64; i += 64) {
+                uint64_t starts = sequence_starts<E>::mask64(first + i);
+                size_t n = popcount64(starts);
+                for (; next < count + n; next += stride) {
+                    marks.push_back(i + nth_bit(starts, next - count));
+                }
+                count += n;
+            }
+            for (; i < len; ++i) {
+                if (sequence_starts<E>::is_start(first[i])) {
+                    if (count == next) {
+                        marks.push_back(i);
+                        next += stride;
+                    }
+                    ++count;
+                }
+            }
+            return count;
+        }
+
+        template <typename E, typename Iter>
+        size_t index_codepoints(Iter first, Iter last, size_t stride, std::vector<size_t>& marks, std::false_type) {
+            size_t count = 0;
+            for (Iter it = first; it != last; it += utf_traits<E>::read_length(*it), ++count) {
+                if (count % stride == 0) {
+                    marks.push_back(it - first);
+                }
+            }
+            return count;
+        }
+
+        template <typename E, typename Iter>
+        size_t index_codepoints(Iter first, Iter last, size_t stride, std::vector<size_t>& marks, std::true_type) {
+            if (first == last) {
+                return 0;
+            }
+            const typename std::iterator_traits<Iter>::value_type* src = to_pointer(first);
+            return index_codepoints<E>(src, src + (last - first), stride, marks);
+        }
+
+        // Output length of a conversion, computed from the source codeunits
+        // alone. Like codepoint_counter, the specializations assume valid input.
+        template <typename ESrc, typename EDest,
+                  typename Src = typename byte_order<ESrc>::base, typename Dest = typename byte_order<EDest>::base>
+        struct length_counter {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                size_t n = 0;
+                for (const T* it = first; it < last; it += utf_traits<ESrc>::read_length(*it)) {
+                    n += utf_traits<EDest>::write_length(utf_traits<ESrc>::decode(it));
+                }
+                return n;
+            }
+        };
+
+        template <typename ESrc, typename EDest, typename E>
+        struct length_counter<ESrc, EDest, E, E> {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                return last - first;
+            }
+        };
+
+        template <typename ESrc, typename EDest>
+        struct length_counter<ESrc, EDest, utf8, utf32> : codepoint_counter<ESrc> {};
+
+        template <typename ESrc, typename EDest>
+        struct length_counter<ESrc, EDest, utf16, utf32> : codepoint_counter<ESrc> {};
+
+        // one UTF-16 codeunit per codepoint, plus one for each 4-byte sequence
+        template <typename ESrc, typename EDest>
+        struct length_counter<ESrc, EDest, utf8, utf16> {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                const unsigned char* src = reinterpret_cast<const unsigned char*>(first);
+                size_t len = last - first;
+                size_t n = 0;
+                size_t i = 0;
+#ifdef UTFHPP_SSE2
+                if (simd_enabled(simd_level::sse2)) {
+                    const __m128i cont_limit = _mm_set1_epi8(static_cast<char>(0xbf));
+                    const __m128i four_lead = _mm_set1_epi8(static_cast<char>(0xf0));
+                    while (len - i >= 16) {
+                        // each byte adds at most 2 to its counter
+                        size_t blocks = std::min<size_t>((len - i) / 16, 127);
+                        __m128i acc = _mm_setzero_si128();
+                        for (size_t b = 0; b < blocks; ++b, i += 16) {
+                            __m128i v = load128(src + i);
+                            acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(v, cont_limit));
+                            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_max_epu8(v, four_lead), v));
+                        }
+                        __m128i sum = _mm_sad_epu8(acc, _mm_setzero_si128());
+                        n += static_cast<size_t>(_mm_cvtsi128_si32(sum)) + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+                    }
+                }
+#endif
+                for (; i < len; ++i) {
+                    n += ((src[i] & 0xc0) != 0x80) + (src[i] >= 0xf0);
+                }
+                return n;
+            }
+        };
+
+        // 1, 2 or 3 bytes per BMP codeunit depending on its value, 2 per surrogate
+        template <typename ESrc, typename EDest>
+        struct length_counter<ESrc, EDest, utf16, utf8> {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                size_t len = last - first;
+                size_t n = len;
+                size_t i = 0;
+#ifdef UTFHPP_SSE2
+                if (simd_enabled(simd_level::sse2)) {
+                    typedef lanes<2, byte_order<ESrc>::swapped> in;
+                    const unsigned char* src = reinterpret_cast<const unsigned char*>(first);
+                    // unsigned comparisons are done as signed ones on values offset by 0x8000
+                    const __m128i offset = _mm_set1_epi16(static_cast<short>(0x8000));
+                    const __m128i limit_2 = _mm_set1_epi16(static_cast<short>(0x807f));
+                    const __m128i limit_3 = _mm_set1_epi16(static_cast<short>(0x87ff));
+                    const __m128i surrogate_mask = _mm_set1_epi16(static_cast<short>(0xf800));
+                    const __m128i surrogate = _mm_set1_epi16(static_cast<short>(0xd800));
+                    while (len - i >= 8) {
+                        // each codeunit adds at most 2 to its counter
+                        size_t blocks = std::min<size_t>((len - i) / 8, 0x3fff);
+                        __m128i acc = _mm_setzero_si128();
+                        for (size_t b = 0; b < blocks; ++b, i += 8) {
+                            __m128i v = in::load(src + 2 * i);
+                            __m128i shifted = _mm_xor_si128(v, offset);
+                            acc = _mm_sub_epi16(acc, _mm_cmpgt_epi16(shifted, limit_2));
+                            acc = _mm_sub_epi16(acc, _mm_cmpgt_epi16(shifted, limit_3));
+                            acc = _mm_add_epi16(acc, _mm_cmpeq_epi16(_mm_and_si128(v, surrogate_mask), surrogate));
+                        }
+                        __m128i sum = _mm_madd_epi16(acc, _mm_set1_epi16(1));
+                        sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 8));
+                        sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 4));
+                        n += static_cast<size_t>(_mm_cvtsi128_si32(sum));
+                    }
+                }
+#endif
+                for (; i < len; ++i) {
+                    char16_t c = byte_order<ESrc>::apply(static_cast<char16_t>(first[i]));
+                    n += (c >= 0x80) + (c >= 0x800) - ((c & 0xf800) == 0xd800);
+                }
+                return n;
+            }
+        };
+
+        template <typename ESrc, typename EDest>
+        struct length_counter<ESrc, EDest, utf32, utf8> {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                size_t len = last - first;
+                size_t n = len;
+                size_t i = 0;
+#ifdef UTFHPP_SSE2
+                if (simd_enabled(simd_level::sse2)) {
+                    typedef lanes<4, byte_order<ESrc>::swapped> in;
+                    const unsigned char* src = reinterpret_cast<const unsigned char*>(first);
+                    const __m128i limit_2 = _mm_set1_epi32(0x7f);
+                    const __m128i limit_3 = _mm_set1_epi32(0x7ff);
+                    const __m128i limit_4 = _mm_set1_epi32(0xffff);
+                    while (len - i >= 4) {
+                        // each codepoint adds at most 3 to its counter
+                        size_t blocks = std::min<size_t>((len - i) / 4, size_t(1) << 28);
+                        __m128i acc = _mm_setzero_si128();
+                        for (size_t b = 0; b < blocks; ++b, i += 4) {
+                            __m128i v = in::load(src + 4 * i);
+                            acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(v, limit_2));
+                            acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(v, limit_3));
+                            acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(v, limit_4));
+                        }
+                        uint32_t lanes[4];
+                        std::memcpy(lanes, &acc, sizeof(lanes));
+                        n += static_cast<size_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+                    }
+                }
+#endif
+                for (; i < len; ++i) {
+                    codepoint_type c = byte_order<ESrc>::apply(static_cast<codepoint_type>(first[i]));
+                    n += (c >= 0x80) + (c >= 0x800) + (c >= 0x10000);
+                }
+                return n;
+            }
+        };
+
+        template <typename ESrc, typename EDest>
+        struct length_counter<ESrc, EDest, utf32, utf16> {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                size_t len = last - first;
+                size_t n = len;
+                size_t i = 0;
+#ifdef UTFHPP_SSE2
+                if (simd_enabled(simd_level::sse2)) {
+                    typedef lanes<4, byte_order<ESrc>::swapped> in;
+                    const unsigned char* src = reinterpret_cast<const unsigned char*>(first);
+                    const __m128i limit = _mm_set1_epi32(0xffff);
+                    while (len - i >= 4) {
+                        // each codepoint adds at most 1 to its counter
+                        size_t blocks = std::min<size_t>((len - i) / 4, size_t(1) << 28);
+                        __m128i acc = _mm_setzero_si128();
+                        for (size_t b = 0; b < blocks; ++b, i += 4) {
+                            acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(in::load(src + 4 * i), limit));
+                        }
+                        uint32_t lanes[4];
+                        std::memcpy(lanes, &acc, sizeof(lanes));
+                        n += static_cast<size_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+                    }
+                }
+#endif
+                for (; i < len; ++i) {
+                    n += byte_order<ESrc>::apply(static_cast<codepoint_type>(first[i])) >= 0x10000;
+                }
+                return n;
+            }
+        };
+
+        // one byte per codepoint, or two for those above U+007F
+        template <typename ESrc, typename EDest>
+        struct length_counter<ESrc, EDest, latin1, utf8> {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                const unsigned char* src = reinterpret_cast<const unsigned char*>(first);
+                size_t len = last - first;
+                size_t n = len;
+                size_t i = 0;
+#ifdef UTFHPP_SSE2
+                if (simd_enabled(simd_level::sse2)) {
+                    const __m128i zero = _mm_setzero_si128();
+                    while (len - i >= 16) {
+                        size_t blocks = std::min<size_t>((len - i) / 16, 255);
+                        __m128i acc = _mm_setzero_si128();
+                        for (size_t b = 0; b < blocks; ++b, i += 16) {
+                            acc = _mm_sub_epi8(acc, _mm_cmplt_epi8(load128(src + i), zero));
+                        }
+                        __m128i sum = _mm_sad_epu8(acc, zero);
+                        n += static_cast<size_t>(_mm_cvtsi128_si32(sum)) + static_cast<size_t>(_mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+                    }
+                }
+#endif
+                for (; i < len; ++i) {
+                    n += src[i] >= 0x80;
+                }
+                return n;
+            }
+        };
+
+        template <typename ESrc, typename EDest>
+        struct length_counter<ESrc, EDest, latin1, utf16> : codepoint_counter<ESrc> {};
+
+        template <typename ESrc, typename EDest>
+        struct length_counter<ESrc, EDest, latin1, utf32> : codepoint_counter<ESrc> {};
+
+        // one byte per codepoint, whether Latin-1 can encode it or not
+        template <typename ESrc, typename EDest>
+        struct length_counter<ESrc, EDest, utf8, latin1> : codepoint_counter<ESrc> {};
+
+        template <typename ESrc, typename EDest>
+        struct length_counter<ESrc, EDest, utf16, latin1> : codepoint_counter<ESrc> {};
+
+        template <typename ESrc, typename EDest>
+        struct length_counter<ESrc, EDest, utf32, latin1> : codepoint_counter<ESrc> {};
+
+        // one byte per ASCII codepoint, and two or three for the others
+        template <typename ESrc, typename EDest, typename Table>
+        struct length_counter<ESrc, EDest, single_byte_encoding<Table>, utf8> {
+            template <typename T>
+            static size_t run(const T* first, const T* last) {
+                typedef utf_traits<single_byte_encoding<Table> > traits_t;
+                const unsigned char* it = reinterpret_cast<const unsigned char*>(first);
+                const unsigned char* end = reinterpret_cast<const unsigned char*>(last);
+                size_t n = last - first;
+                while (it < end) {
+                    it += ascii_length(it, end);
+                    for (; it < end && !is_ascii(*it); ++it) {
+                        n += traits_t::tables.decode[*it] < 0x800 ? 1 : 2;
+                    }
+                }
+                return n;
+            }
+        };
+
+        // every codepage codepoint is in the BMP
+        template <typename ESrc, typename EDest, typename Table>
+        struct length_counter<ESrc, EDest, single_byte_encoding<Table>, utf16> : codepoint_counter<ESrc> {};
+
+        template <typename ESrc, typename EDest, typename Table>
+        struct length_counter<ESrc, EDest, single_byte_encoding<Table>, utf32> : codepoint_counter<ESrc> {};
+
+        template <typename ESrc, typename EDest, typename Table>
+        struct length_counter<ESrc, EDest, utf8, single_byte_encoding<Table> > : codepoint_counter<ESrc> {};
+
+        template <typename ESrc, typename EDest, typename Table>
+        struct length_counter<ESrc, EDest, utf16, single_byte_encoding<Table> > : codepoint_counter<ESrc> {};
+
+        template <typename ESrc, typename EDest, typename Table>
+        struct length_counter<ESrc, EDest, utf32, single_byte_encoding<Table> > : codepoint_counter<ESrc> {};
+
+        template <typename E, typename EDest, typename Iter>
+        size_t count_codeunits(Iter first, Iter last, std::false_type) {
+            size_t n = 0;
+            for (Iter it = first; it != last; it += utf_traits<E>::read_length(*it)) {
+                n += utf_traits<EDest>::write_length(utf_traits<E>::decode(it));
+            }
+            return n;
+        }
+
+        template <typename E, typename EDest, typename Iter>
+        size_t count_codeunits(Iter first, Iter last, std::true_type) {
+            if (first == last) {
+                return 0;
+            }
+            const typename std::iterator_traits<Iter>::value_type* src = to_pointer(first);
+            return length_counter<E, EDest>::run(src, src + (last - first));
+        }
+
+        // the most EDest codeunits a single ESrc codeunit can turn into
+        template <typename ESrc, typename EDest,
+                  typename Src = typename byte_order<ESrc>::base, typename Dest = typename byte_order<EDest>::base>
+        struct expansion_factor {
+            static const size_t value = 1;
+        };
+        template <typename ESrc, typename EDest> struct expansion_factor<ESrc, EDest, utf16, utf8> { static const size_t value = 3; };
+        template <typename ESrc, typename EDest> struct expansion_factor<ESrc, EDest, utf32, utf8> { static const size_t value = 4; };
+        template <typename ESrc, typename EDest> struct expansion_factor<ESrc, EDest, utf32, utf16> { static const size_t value = 2; };
+        template <typename ESrc, typename EDest> struct expansion_factor<ESrc, EDest, latin1, utf8> { static const size_t value = 2; };
+        template <typename ESrc, typename EDest, typename Table> struct expansion_factor<ESrc, EDest, single_byte_encoding<Table>, utf8> { static const size_t value = 3; };
+
+        // next moves p forward to the first sequence starting at or after it.
+        // prev returns the start of the sequence ending just before it, looking
+        // at most avail codeunits back
+        template <typename E, typename Base = typename byte_order<E>::base>
+        struct sequence_boundary {
+            template <typename T>
+            static const T* next(const T* p, const T*) { return p; }
+
+            template <typename Iter>
+            static Iter prev(Iter it, size_t) { return it - 1; }
+        };
+
+        template <>
+        struct sequence_boundary<utf8> {
+            template <typename T>
+            static const T* next(const T* p, const T* last) {
+                for (size_t i = 0; i < 3 && p < last && (static_cast<unsigned char>(*p) & 0xc0) == 0x80; ++i) {
+                    ++p;
+                }
+                return p;
+            }
+
+            template <typename Iter>
+            static Iter prev(Iter it, size_t avail) {
+                std::ptrdiff_t n = 1;
+                while (static_cast<size_t>(n) < avail && n < 4 && (static_cast<unsigned char>(it[-n]) & 0xc0) == 0x80) {
+                    ++n;
+                }
+                return it - n;
+            }
+        };
+
+        template <typename E>
+        struct sequence_boundary<E, utf16> {
+            template <typename T>
+            static const T* next(const T* p, const T* last) {
+                if (p < last && (byte_order<E>::apply(static_cast<uint16_t>(*p)) & 0xfc00) == 0xdc00) {
+                    ++p;
+                }
+                return p;
+            }
+
+            template <typename Iter>
+            static Iter prev(Iter it, size_t avail) {
+                if (avail >= 2 && (byte_order<E>::apply(static_cast<uint16_t>(it[-1])) & 0xfc00) == 0xdc00
+                    && (byte_order<E>::apply(static_cast<uint16_t>(it[-2])) & 0xfc00) == 0xd800) {
+                    return it - 2;
+                }
+                return it - 1;
+            }
+        };
+
+#ifndef UTFHPP_NO_THREADS
+        // calls f(0) .. f(n - 1), f(0) on the calling thread and the rest on
+        // threads of their own. If no more threads can be started, the calling
+        // thread does the remaining work
+        template <typename F>
+        void run_parallel(size_t n, const F& f) {
+            std::vector<std::thread> workers;
+            workers.reserve(n);
+            size_t i = 1;
+            try {
+                for (; i < n; ++i) {
+                    workers.push_back(std::thread(f, i));
+                }
+            }
+            catch (const std::system_error&) {}
+            for (size_t j = i; j < n; ++j) {
+                f(j);
+            }
+            f(0);
+            for (size_t j = 0; j < workers.size(); ++j) {
+                workers[j].join();
+            }
+        }
+#endif
+    }
+    
+    // Decodes a string on the fly, decoding each sequence once. Unchecked
+    // iterators decode whatever they point to; with any other policy the
+    // iterator also knows the bounds of the string, and never reads outside
+    // them. Strict iterators end the iteration at the first invalid sequence,
+    // and error() then tells what was wrong with it.
+    // Stepping backwards over invalid input, checked iterators treat each
+    // codeunit which does not end a valid sequence as an invalid sequence
+    // of its own. The string is in encoding E, by default the one of its
+    // codeunit type.
+    template <typename It, typename Policy = policy::unchecked,
+              typename E = typename internal::native_encoding<typename std::iterator_traits<It>::value_type>::type>
+    class codepoint_iterator {
+        typedef E encoding;
+        typedef internal::utf_traits<encoding> traits_type;
+        typedef internal::sequence_checker<encoding> checker_type;
+        typedef internal::sequence_decoder<encoding> decoder_type;
+        typedef internal::sequence_boundary<encoding> boundary_type;
+        // the decoded codepoint and its length, once known (len is 0 until then)
+        mutable codepoint_type val;
+        mutable size_t len;
+        It pos;
+        It first;
+        It last;
+        error_kind err;
+
+        // decodes the sequence at pos, applying the policy if it is invalid
+        void settle(policy::unchecked) {
+            len = 0;
+        }
+        template <typename P>
+        void settle(P) {
+            while (pos != last) {
+                err = decoder_type::check(pos, last, len, val);
+                if (err == error_kind::none) {
+                    return;
+                }
+                if (!recover(P())) {
+                    return;
+                }
+            }
+        }
+
+        // returns true if the iterator has moved on and must settle again
+        bool recover(policy::strict) {
+            pos = last;
+            return false;
+        }
+        bool recover(policy::replace) {
+            val = 0xfffd;
+            len = checker_type::maximal_subpart(pos, last);
+            return false;
+        }
+        bool recover(policy::skip) {
+            pos += checker_type::maximal_subpart(pos, last);
+            return true;
+        }
+
+        codepoint_type& dereference(policy::unchecked) const {
+            if (len == 0) {
+                len = decoder_type::next(pos, val);
+            }
+            return val;
+        }
+        template <typename P>
+        codepoint_type& dereference(P) const { return val; }
+
+        void increment(policy::unchecked) {
+            pos += len != 0 ? len : traits_type::read_length(*pos);
+            len = 0;
+        }
+        template <typename P>
+        void increment(P) {
+            pos += len;
+            settle(P());
+        }
+
+        void decrement(policy::unchecked) {
+            pos = boundary_type::prev(pos, 4);
+            len = 0;
+        }
+        template <typename P>
+        void decrement(P) {
+            It end = pos;
+            while (pos != first) {
+                pos = boundary_type::prev(end, end - first);
+                err = decoder_type::check(pos, last, len, val);
+                if (err == error_kind::none && pos + len == end) {
+                    return;
+                }
+                pos = end - 1;
+                len = 1;
+                err = error_kind::invalid_codeunit;
+                if (!recover_back(P())) {
+                    return;
+                }
+                end = pos;
+            }
+        }
+
+        bool recover_back(policy::skip) { return true; }
+        template <typename P>
+        bool recover_back(P) {
+            val = 0xfffd;
+            return false;
+        }
+
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef codepoint_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const codepoint_type* pointer;
+        // codepoints are returned by value, so std::reverse_iterator is safe to use
+        typedef codepoint_type reference;
+
+        explicit codepoint_iterator() : val(), len(), pos(), first(), last(), err(error_kind::none) {}
+        explicit codepoint_iterator(It pos) : val(), len(), pos(pos), first(pos), last(pos), err(error_kind::none) {}
+        codepoint_iterator(It pos, It first, It last) : val(), len(), pos(pos), first(first), last(last), err(error_kind::none) {
+            settle(Policy());
+        }
+        codepoint_iterator(const codepoint_iterator& it) : val(it.val), len(it.len), pos(it.pos), first(it.first), last(it.last), err(it.err) {}
+
+        reference operator*() const {
+            return dereference(Policy());
+        }
+        pointer operator->() const { return &dereference(Policy()); }
+        codepoint_iterator& operator++() {
+            increment(Policy());
+            return *this;
+		}
+        codepoint_iterator operator++(int) {
+            codepoint_iterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+        codepoint_iterator& operator--() {
+            decrement(Policy());
+            return *this;
+        }
+        codepoint_iterator operator--(int) {
+            codepoint_iterator tmp = *this;
+            --(*this);
+            return tmp;
+        }
+
+        // the position in the underlying string
+        It base() const { return pos; }
+
+        // the kind of the invalid sequence replaced (replace) or stopped at
+        // (strict), or none for a valid sequence
+        error_kind error() const { return err; }
+
+        friend bool operator != (codepoint_iterator lhs, codepoint_iterator rhs) { return lhs.pos != rhs.pos; }
+        friend bool operator == (codepoint_iterator lhs, codepoint_iterator rhs) { return !(lhs != rhs); }
+    };
+
+    template <typename Iter, typename E = typename internal::native_encoding<typename std::iterator_traits<Iter>::value_type>::type>
+    struct stringview {
+        typedef typename std::iterator_traits<Iter>::value_type codeunit_type;
+
+        constexpr stringview(const Iter first, const Iter last)
+        : first(first), last(last) {}
+
+        constexpr stringview()
+        : first(), last() {}
+
+        constexpr Iter raw_begin() const { return first; }
+        constexpr Iter raw_end() const { return last; }
+
+        codepoint_iterator<Iter, policy::unchecked, E> begin() const { return codepoint_iterator<Iter, policy::unchecked, E>(first); }
+        codepoint_iterator<Iter, policy::unchecked, E> end() const { return codepoint_iterator<Iter, policy::unchecked, E>(last); }
+
+        // iterators which treat invalid input according to Policy
+        template <typename Policy>
+        codepoint_iterator<Iter, Policy, E> begin() const { return codepoint_iterator<Iter, Policy, E>(first, first, last); }
+        template <typename Policy>
+        codepoint_iterator<Iter, Policy, E> end() const { return codepoint_iterator<Iter, Policy, E>(last, first, last); }
+
+        // reverse traversal, so the last codepoints are reached without decoding the rest
+        std::reverse_iterator<codepoint_iterator<Iter, policy::unchecked, E> > rbegin() const { return std::reverse_iterator<codepoint_iterator<Iter, policy::unchecked, E> >(end()); }
+        std::reverse_iterator<codepoint_iterator<Iter, policy::unchecked, E> > rend() const { return std::reverse_iterator<codepoint_iterator<Iter, policy::unchecked, E> >(begin()); }
+        template <typename Policy>
+        std::reverse_iterator<codepoint_iterator<Iter, Policy, E> > rbegin() const { return std::reverse_iterator<codepoint_iterator<Iter, Policy, E> >(end<Policy>()); }
+        template <typename Policy>
+        std::reverse_iterator<codepoint_iterator<Iter, Policy, E> > rend() const { return std::reverse_iterator<codepoint_iterator<Iter, Policy, E> >(begin<Policy>()); }
+        
+        bool validate() const {
+            bool valid = internal::validate_range<E>(first, last, internal::is_contiguous<Iter>());
+#ifdef UTFHPP_STATS
+            internal::count_call<E, E, codeunit_type>(stats_operation::validate, codeunits(), internal::is_contiguous<Iter>::value);
+            if (!valid) {
+                internal::count_stat<E, E>(stats_operation::validate, internal::stats_errors);
+            }
+#endif
+            return valid;
+        }
+
+        constexpr bool empty() const {
+            return first == last;
+        }
+        // the number of codepoints, assuming the string is valid
+        size_t codepoints() const {
+#ifdef UTFHPP_STATS
+            internal::count_call<E, E, codeunit_type>(stats_operation::codepoints, codeunits(), internal::is_contiguous<Iter>::value);
+#endif
+            return internal::count_codepoints<E>(first, last, internal::is_contiguous<Iter>());
+        }
+
+        size_t bytes() const {
+            return codeunits() * sizeof(typename internal::utf_traits<E>::codeunit_type);
+        }
+
+        // length in source encoding
+        template <typename EDest>
+        size_t bytes() const {
+            return codeunits<EDest>() * sizeof(typename internal::utf_traits<EDest>::codeunit_type);
+        }
+
+        constexpr size_t codeunits() const { return last - first; }
+
+        // length in EDest, assuming the string is valid
+        template <typename EDest>
+        size_t codeunits() const {
+            return internal::count_codeunits<E, EDest>(first, last, internal::is_contiguous<Iter>());
+        }
+
+        // an upper bound for codeunits<EDest>(), computed in constant time
+        template <typename EDest>
+        size_t max_codeunits() const {
+            return codeunits() * internal::expansion_factor<E, EDest>::value;
+        }
+
+        // converts to EDest, treating invalid input according to Policy.
+        // With policy::strict, returns a checked_result as to_checked does.
+        // Usable in constant expressions from C++20 on
+        template <typename EDest, typename Policy = policy::unchecked, typename OutIt>
+        constexpr typename internal::policy_result<Policy, OutIt>::type to(OutIt dest) const {
+#ifdef UTFHPP_STATS
+            if (!internal::is_constant_evaluated()) {
+                return internal::transcode_counted<E, EDest>(first, last, dest, Policy());
+            }
+#endif
+            return internal::transcode_with<E, EDest>(first, last, dest, Policy());
+        }
+
+        // validates while converting, in a single pass over the input
+        template <typename EDest, typename OutIt>
+        checked_result<OutIt> to_checked(OutIt dest) const {
+            return internal::transcode_checked<E, EDest>(first, last, dest, internal::is_contiguous<Iter>());
+        }
 
     private:
         Iter first;
@@ -406,20 +4272,730 @@ namespace utf {
 
     template <typename IterL, typename IterR, typename E>
     inline bool operator == (const stringview<IterL, E>& lhs, const stringview<IterR, E>& rhs) {
-        return lhs.codepoints() == rhs.codepoints() && std::equal(lhs.raw_begin(), lhs.raw_end(), rhs.raw_begin());
+        return lhs.codeunits() == rhs.codeunits() && std::equal(lhs.raw_begin(), lhs.raw_end(), rhs.raw_begin());
     }
     template <typename IterL, typename IterR, typename E>
     inline bool operator != (const stringview<IterL, E>& lhs, const stringview<IterR, E>& rhs) {
         return !(lhs == rhs);
     }
 
+    // compare codepoints in lockstep, without counting either string first
     template <typename IterL, typename EL, typename IterR, typename ER>
-    inline bool operator != (const stringview<IterL, EL>& lhs, const stringview<IterR, ER>& rhs) {
-        return lhs.codepoints() == rhs.codepoints() && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+    inline bool operator == (const stringview<IterL, EL>& lhs, const stringview<IterR, ER>& rhs) {
+        codepoint_iterator<IterL, policy::unchecked, EL> l = lhs.begin();
+        codepoint_iterator<IterL, policy::unchecked, EL> lend = lhs.end();
+        codepoint_iterator<IterR, policy::unchecked, ER> r = rhs.begin();
+        codepoint_iterator<IterR, policy::unchecked, ER> rend = rhs.end();
+        for (; l != lend && r != rend; ++l, ++r) {
+            if (*l != *r) { return false; }
+        }
+        return l == lend && r == rend;
     }
     template <typename IterL, typename EL, typename IterR, typename ER>
-    inline bool operator == (const stringview<IterL, EL>& lhs, const stringview<IterR, ER>& rhs) {
-        return !(lhs != rhs);
+    inline bool operator != (const stringview<IterL, EL>& lhs, const stringview<IterR, ER>& rhs) {
+        return !(lhs == rhs);
+    }
+
+    namespace internal {
+        // the string type convert<EDest>() returns
+        template <typename EDest, typename Alloc = std::allocator<typename utf_traits<EDest>::codeunit_type> >
+        struct converted_string {
+            typedef typename utf_traits<EDest>::codeunit_type codeunit_type;
+            typedef std::basic_string<codeunit_type, std::char_traits<codeunit_type>, Alloc> type;
+        };
+
+        // converts sv to p as stringview::to does, but stops at the first
+        // invalid sequence, so the output never outgrows codeunits<EDest>(),
+        // which is only exact for valid input. Returns the end of the output,
+        // and the offset of the invalid sequence if there is one
+        template <typename EDest, typename Iter, typename E, typename D>
+        checked_result<D*> transcode_valid(const stringview<Iter, E>& sv, D* p) {
+            Iter first = sv.raw_begin();
+            Iter last = sv.raw_end();
+            for (;;) {
+                checked_result<D*> res = transcode_checked<E, EDest>(first, last, p, is_contiguous<Iter>());
+                if (res.error != error_kind::unrepresentable) {
+                    res.offset += first - sv.raw_begin();
+                    return res;
+                }
+                // as in to(), what EDest cannot encode is replaced
+                first += res.offset;
+                size_t len = 0;
+                sequence_checker<E>::check(first, last, len);
+                first += len;
+                p = on_invalid<EDest>(res.dest, policy::replace());
+            }
+        }
+
+        // an output iterator which only counts the codeunits written through it
+        struct counting_output {
+            typedef std::output_iterator_tag iterator_category;
+            typedef void value_type;
+            typedef void difference_type;
+            typedef void pointer;
+            typedef void reference;
+
+            size_t count;
+
+            counting_output() : count(0) {}
+            counting_output& operator * () { return *this; }
+            template <typename T>
+            counting_output& operator = (T) { return *this; }
+            counting_output& operator ++ () { ++count; return *this; }
+            counting_output operator ++ (int) { counting_output res = *this; ++count; return res; }
+        };
+
+        // appends sv from offset on to buffer, with invalid sequences replaced
+        // as by stringview::to<EDest, policy::replace>. The output is counted
+        // first, so the buffer grows once
+        template <typename EDest, typename Iter, typename E, typename Buffer>
+        void append_replaced(const stringview<Iter, E>& sv, size_t offset, Buffer& buffer) {
+            Iter first = sv.raw_begin() + offset;
+            Iter last = sv.raw_end();
+            size_t size = buffer.size();
+            size_t n = transcode_repaired<E, EDest>(first, last, counting_output(), policy::replace(), is_contiguous<Iter>()).count;
+            buffer.resize(size + n);
+            transcode_repaired<E, EDest>(first, last, &buffer[0] + size, policy::replace(), is_contiguous<Iter>());
+        }
+
+        // replaces the contents of buffer with what sv converts to, written
+        // straight into its storage, which is sized for the n codeunits
+        // valid input converts to. The old contents are dropped first, so
+        // growing the buffer allocates but copies nothing, and a buffer with
+        // room for n codeunits is reused as it is. From the first invalid
+        // sequence on, the rest is appended with append_replaced
+        template <typename EDest, typename Iter, typename E, typename T, typename Traits, typename Alloc>
+        void overwrite(const stringview<Iter, E>& sv, size_t n, std::basic_string<T, Traits, Alloc>& buffer) {
+            buffer.clear();
+            size_t read = 0;
+#ifdef UTFHPP_HAS_RESIZE_AND_OVERWRITE
+            buffer.resize_and_overwrite(n, [&](T* p, size_t) {
+                checked_result<T*> res = transcode_valid<EDest>(sv, p);
+                read = res.ok() ? sv.codeunits() : res.offset;
+                return static_cast<size_t>(res.dest - p);
+            });
+#else
+            buffer.resize(n);
+            if (n != 0) {
+                checked_result<T*> res = transcode_valid<EDest>(sv, &buffer[0]);
+                read = res.ok() ? sv.codeunits() : res.offset;
+                buffer.resize(res.dest - &buffer[0]);
+            }
+#endif
+            if (read != sv.codeunits()) {
+                append_replaced<EDest>(sv, read, buffer);
+            }
+        }
+
+        template <typename EDest, typename Iter, typename E, typename T, typename Alloc>
+        void overwrite(const stringview<Iter, E>& sv, size_t n, std::vector<T, Alloc>& buffer) {
+            buffer.clear();
+            buffer.resize(n);
+            size_t read = 0;
+            if (n != 0) {
+                checked_result<T*> res = transcode_valid<EDest>(sv, buffer.data());
+                read = res.ok() ? sv.codeunits() : res.offset;
+                buffer.resize(res.dest - buffer.data());
+            }
+            if (read != sv.codeunits()) {
+                append_replaced<EDest>(sv, read, buffer);
+            }
+        }
+    }
+
+    // Converts sv to a new string of EDest codeunits. The output length is
+    // counted first, so the string is allocated once, at its final size, and
+    // the conversion writes straight into it. Invalid sequences, and
+    // characters EDest cannot encode, are replaced as by
+    // stringview::to<EDest, policy::replace>. Only invalid input, whose output
+    // length the count does not know, takes a second allocation, once the
+    // rest of it has been counted.
+    template <typename EDest, typename Iter, typename E>
+    typename internal::converted_string<EDest>::type convert(const stringview<Iter, E>& sv) {
+        typename internal::converted_string<EDest>::type res;
+        internal::overwrite<EDest>(sv, sv.template codeunits<EDest>(), res);
+        return res;
+    }
+
+    // as above, allocating the string with alloc
+    template <typename EDest, typename Iter, typename E, typename Alloc>
+    typename std::enable_if<!std::is_pointer<Alloc>::value, typename internal::converted_string<EDest, Alloc>::type>::type
+    convert(const stringview<Iter, E>& sv, const Alloc& alloc) {
+        typename internal::converted_string<EDest, Alloc>::type res(alloc);
+        internal::overwrite<EDest>(sv, sv.template codeunits<EDest>(), res);
+        return res;
+    }
+
+#ifdef UTFHPP_HAS_PMR
+    // as above, allocating the string from a memory resource
+    template <typename EDest, typename Iter, typename E>
+    typename internal::converted_string<EDest, std::pmr::polymorphic_allocator<typename internal::utf_traits<EDest>::codeunit_type> >::type
+    convert(const stringview<Iter, E>& sv, std::pmr::memory_resource* resource) {
+        typedef typename internal::utf_traits<EDest>::codeunit_type codeunit_type;
+        return convert<EDest>(sv, std::pmr::polymorphic_allocator<codeunit_type>(resource));
+    }
+#endif
+
+    // Replaces the contents of buffer (a std::basic_string or std::vector)
+    // with sv converted to EDest. Allocates only if the buffer's capacity is
+    // too small, so converting into the same buffer over and over allocates
+    // only until it has grown to fit the longest output. As with convert(),
+    // invalid sequences are replaced with U+FFFD.
+    template <typename EDest, typename Iter, typename E, typename Buffer>
+    void convert_into(const stringview<Iter, E>& sv, Buffer& buffer) {
+        internal::overwrite<EDest>(sv, sv.template codeunits<EDest>(), buffer);
+    }
+
+    // as above, converting to the native encoding of the buffer's codeunit type
+    template <typename Iter, typename E, typename Buffer>
+    void convert_into(const stringview<Iter, E>& sv, Buffer& buffer) {
+        typedef typename internal::native_encoding<typename Buffer::value_type>::type EDest;
+        internal::overwrite<EDest>(sv, sv.template codeunits<EDest>(), buffer);
+    }
+
+    // Maps between codepoint and codeunit offsets in a string in constant time
+    // plus a scan of fewer than stride codepoints. The offset of every stride'th
+    // codepoint is recorded, so the index takes about codepoints() / stride
+    // words of memory. Assumes the string is valid, and refers to it, so it
+    // must be rebuilt if the string changes.
+    template <typename Iter, typename E = typename internal::native_encoding<typename std::iterator_traits<Iter>::value_type>::type>
+    class codepoint_index {
+        typedef internal::utf_traits<E> traits_type;
+        typedef typename traits_type::codeunit_type codeunit_type;
+
+    public:
+        explicit codepoint_index(const stringview<Iter, E>& sv, size_t stride = 128)
+        : sv(sv), stride(stride), count(0) {
+            assert(stride > 0);
+            marks.reserve(sv.codeunits() / stride + 1);
+            count = internal::index_codepoints<E>(sv.raw_begin(), sv.raw_end(), stride, marks, internal::is_contiguous<Iter>());
+        }
+
+        size_t codepoints() const { return count; }
+
+        // the codeunit offset of codepoint cp, for cp <= codepoints()
+        size_t codeunit_offset(size_t cp) const {
+            if (cp >= count) {
+                return sv.codeunits();
+            }
+            Iter first = sv.raw_begin();
+            size_t offset = marks[cp / stride];
+            for (size_t n = cp % stride; n > 0; --n) {
+                offset += traits_type::read_length(static_cast<codeunit_type>(first[offset]));
+            }
+            return offset;
+        }
+
+        // the index of the codepoint which the codeunit at offset belongs to,
+        // for offset <= codeunits()
+        size_t codepoint_offset(size_t offset) const {
+            if (marks.empty()) {
+                return 0;
+            }
+            size_t mark = std::upper_bound(marks.begin(), marks.end(), offset) - marks.begin() - 1;
+            Iter first = sv.raw_begin();
+            size_t pos = marks[mark];
+            size_t cp = mark * stride;
+            while (cp < count) {
+                size_t next = pos + traits_type::read_length(static_cast<codeunit_type>(first[pos]));
+                if (next > offset) {
+                    break;
+                }
+                pos = next;
+                ++cp;
+            }
+            return cp;
+        }
+
+        // an iterator to codepoint cp, for cp <= codepoints()
+        codepoint_iterator<Iter, policy::unchecked, E> at(size_t cp) const {
+            return codepoint_iterator<Iter, policy::unchecked, E>(sv.raw_begin() + codeunit_offset(cp));
+        }
+
+    private:
+        stringview<Iter, E> sv;
+        size_t stride;
+        size_t count;
+        std::vector<size_t> marks;
+    };
+
+    // codeunits of a string literal converted at compile time, see literal()
+    template <typename E, size_t N>
+    struct encoded_literal {
+        typedef typename internal::utf_traits<E>::codeunit_type codeunit_type;
+        codeunit_type data[N]; // null terminated
+        size_t length;
+
+        constexpr const codeunit_type* begin() const { return data; }
+        constexpr const codeunit_type* end() const { return data + length; }
+        constexpr const codeunit_type* c_str() const { return data; }
+        constexpr size_t size() const { return length; }
+        constexpr codeunit_type operator[](size_t i) const { return data[i]; }
+        constexpr stringview<const codeunit_type*, E> view() const { return stringview<const codeunit_type*, E>(data, data + length); }
+    };
+
+    namespace internal {
+        template <typename EDest, size_t N, typename T>
+        constexpr encoded_literal<EDest, N> encode_literal(const T (&str)[N]) {
+            encoded_literal<EDest, N> res = {};
+            const T* last = str + N - 1;
+            for (const T* it = str; it != last;) {
+                size_t len = 0;
+                if (sequence_checker<utf8>::check(it, last, len) != error_kind::none) {
+                    // neither can be evaluated in a constant expression,
+                    // which therefore fails to compile
+#ifdef UTFHPP_HAS_EXCEPTIONS
+                    throw std::invalid_argument("utf::literal: invalid UTF-8");
+#else
+                    std::abort();
+#endif
+                }
+                typename utf_traits<EDest>::codeunit_type* out = res.data + res.length;
+                res.length = utf_traits<EDest>::encode(utf_traits<utf8>::decode(it), out) - res.data;
+                it += len;
+            }
+            return res;
+        }
+    }
+
+    // Converts a UTF-8 string literal to EDest at compile time, e.g.
+    //     static constexpr auto label = utf::literal<utf::utf16>(u8"Gr\u00f6\u00dfe");
+    // A literal which is not valid UTF-8 does not compile when converted in a
+    // constant expression, such as a constexpr variable. Converted at run time,
+    // it throws std::invalid_argument, or aborts when exceptions are disabled.
+    template <typename EDest, size_t N>
+    constexpr encoded_literal<EDest, N> literal(const char (&str)[N]) {
+        return internal::encode_literal<EDest>(str);
+    }
+
+#ifdef __cpp_char8_t
+    template <typename EDest, size_t N>
+    constexpr encoded_literal<EDest, N> literal(const char8_t (&str)[N]) {
+        return internal::encode_literal<EDest>(str);
+    }
+#endif
+
+    // result of a bulk conversion: the number of codeunits consumed from the
+    // source, and the number written to the destination
+    struct transcode_result {
+        size_t read;
+        size_t written;
+    };
+
+    // Converts a contiguous buffer in one go. dest must have room for the whole
+    // output (see stringview::codeunits<EDest>()). A sequence cut off by the end
+    // of the input is not consumed, so read is less than the input length then.
+    template <typename ESrc, typename EDest, typename S, typename D>
+    transcode_result transcode(const S* first, const S* last, D* dest) {
+        D* out = dest;
+        const S* end = internal::transcode_contiguous<ESrc, EDest>(first, last, out);
+        transcode_result res = { static_cast<size_t>(end - first), static_cast<size_t>(out - dest) };
+        return res;
+    }
+
+    template <typename ESrc, typename EDest, typename S, typename D>
+    transcode_result transcode(const S* src, size_t len, D* dest) {
+        return transcode<ESrc, EDest>(src, src + len, dest);
+    }
+
+#ifndef UTFHPP_NO_THREADS
+    // Converts a large contiguous buffer on several threads (one per hardware
+    // thread if threads is 0). The input is split at sequence boundaries, the
+    // output length of every part is counted, and each part is then written
+    // straight to its offset in dest, so the result is identical to
+    // transcode(). Like stringview::to, the input is assumed to be valid.
+    // Buffers too small to be worth splitting are converted on the calling thread.
+    template <typename ESrc, typename EDest, typename S, typename D>
+    transcode_result transcode_parallel(const S* first, const S* last, D* dest, unsigned threads = 0) {
+        const size_t min_part = size_t(1) << 16;
+        const size_t len = last - first;
+        if (threads == 0) {
+            threads = std::max(std::thread::hardware_concurrency(), 1u);
+        }
+        const size_t parts = std::min(static_cast<size_t>(threads), len / min_part);
+        if (parts <= 1) {
+            return transcode<ESrc, EDest>(first, last, dest);
+        }
+
+        std::vector<const S*> bounds(parts + 1);
+        bounds[0] = first;
+        bounds[parts] = last;
+        for (size_t i = 1; i < parts; ++i) {
+            bounds[i] = internal::sequence_boundary<ESrc>::next(first + len / parts * i, last);
+        }
+
+        std::vector<size_t> offsets(parts + 1);
+        internal::run_parallel(parts, [&](size_t i) {
+            offsets[i + 1] = internal::length_counter<ESrc, EDest>::run(bounds[i], bounds[i + 1]);
+        });
+        for (size_t i = 1; i <= parts; ++i) {
+            offsets[i] += offsets[i - 1];
+        }
+
+        // only the last part can end with a truncated sequence
+        std::vector<transcode_result> results(parts);
+        internal::run_parallel(parts, [&](size_t i) {
+            results[i] = transcode<ESrc, EDest>(bounds[i], bounds[i + 1], dest + offsets[i]);
+        });
+        transcode_result res = {
+            static_cast<size_t>(bounds[parts - 1] - first) + results[parts - 1].read,
+            offsets[parts - 1] + results[parts - 1].written
+        };
+        return res;
+    }
+
+    template <typename ESrc, typename EDest, typename S, typename D>
+    transcode_result transcode_parallel(const S* src, size_t len, D* dest, unsigned threads = 0) {
+        return transcode_parallel<ESrc, EDest>(src, src + len, dest, threads);
+    }
+#endif
+
+#ifdef UTFHPP_HAS_STRING_VIEW
+    template <typename ESrc, typename EDest, typename CharT, typename Traits, typename D>
+    transcode_result transcode(std::basic_string_view<CharT, Traits> src, D* dest) {
+        return transcode<ESrc, EDest>(src.data(), src.data() + src.size(), dest);
+    }
+#endif
+
+#ifdef UTFHPP_HAS_SPAN
+    template <typename ESrc, typename EDest, typename S, size_t N, typename D>
+    transcode_result transcode(std::span<S, N> src, D* dest) {
+        return transcode<ESrc, EDest>(src.data(), src.data() + src.size(), dest);
+    }
+#endif
+
+    // why transcode_bounded() stopped
+    enum class transcode_status {
+        complete, // the whole input was converted
+        output_full, // the next codepoint does not fit in the rest of the output
+        truncated // the input ends in the middle of a sequence
+    };
+
+    // result of a bounded conversion: the number of codeunits consumed from
+    // the source and written to the destination, and why it stopped
+    struct bounded_result {
+        size_t read;
+        size_t written;
+        transcode_status status;
+    };
+
+    // Converts as much of a contiguous buffer as fits in [dest, dest_last),
+    // stopping after the last whole codepoint that fits, so fixed-size output
+    // buffers can be filled back to back: the next call resumes at
+    // first + read. Nothing is written past dest_last. A sequence cut off by
+    // the end of the input is not consumed, as with transcode(). Like
+    // stringview::to, the input is assumed to be valid.
+    template <typename ESrc, typename EDest, typename S, typename D>
+    bounded_result transcode_bounded(const S* first, const S* last, D* dest, D* dest_last) {
+        typedef internal::utf_traits<EDest> dest_traits;
+        // below this many source codeunits, the bulk path is not worth it
+        const size_t min_chunk = 64;
+        const S* it = first;
+        D* out = dest;
+        bounded_result res = { 0, 0, transcode_status::complete };
+        while (it < last) {
+            // as long as the output has room for any input, convert in bulk
+            // as much input as is certain to fit
+            size_t chunk = std::min(static_cast<size_t>(last - it),
+                                    static_cast<size_t>(dest_last - out) / internal::expansion_factor<ESrc, EDest>::value);
+            if (chunk >= min_chunk) {
+                it = internal::transcode_contiguous<ESrc, EDest>(it, it + chunk, out);
+                continue;
+            }
+            // then one codepoint at a time, until the next one does not fit
+            codepoint_type c = 0;
+            size_t len = internal::sequence_decoder<ESrc>::next(it, last, c);
+            if (len == 0) {
+                res.status = transcode_status::truncated;
+                break;
+            }
+            if (static_cast<size_t>(dest_last - out) < dest_traits::write_length(c)) {
+                res.status = transcode_status::output_full;
+                break;
+            }
+            out = dest_traits::encode(c, out);
+            it += len;
+        }
+        res.read = it - first;
+        res.written = out - dest;
+        return res;
+    }
+
+    template <typename ESrc, typename EDest, typename S, typename D>
+    bounded_result transcode_bounded(const S* src, size_t len, D* dest, size_t dest_len) {
+        return transcode_bounded<ESrc, EDest>(src, src + len, dest, dest + dest_len);
+    }
+
+#ifdef UTFHPP_HAS_SPAN
+    template <typename ESrc, typename EDest, typename S, size_t N, typename D, size_t M>
+    bounded_result transcode_bounded(std::span<S, N> src, std::span<D, M> dest) {
+        return transcode_bounded<ESrc, EDest>(src.data(), src.data() + src.size(), dest.data(), dest.data() + dest.size());
+    }
+
+    // transcode() into a span, which is never written past its end. If the
+    // output does not fit, converts what does, as transcode_bounded() does,
+    // so read is less than the input length then
+    template <typename ESrc, typename EDest, typename S, size_t N, typename D, size_t M>
+    transcode_result transcode(std::span<S, N> src, std::span<D, M> dest) {
+        if (dest.size() >= src.size() * internal::expansion_factor<ESrc, EDest>::value) {
+            return transcode<ESrc, EDest>(src.data(), src.data() + src.size(), dest.data());
+        }
+        bounded_result bounded = transcode_bounded<ESrc, EDest>(src, dest);
+        transcode_result res = { bounded.read, bounded.written };
+        return res;
+    }
+#endif
+
+    // Converts a stream delivered in chunks. A sequence split between chunks
+    // is held back (at most 3 codeunits) and completed by the next chunk, so
+    // the output is the same as converting the whole stream in one go.
+    // Like stringview::to, the input is assumed to be valid.
+    template <typename ESrc, typename EDest>
+    class stream_transcoder {
+        typedef internal::utf_traits<ESrc> src_traits;
+        typedef typename src_traits::codeunit_type codeunit_type;
+        codeunit_type partial[4];
+        size_t partial_len;
+
+    public:
+        stream_transcoder() : partial(), partial_len(0) {}
+
+        // converts the chunk [first, last), returning the end of the output
+        template <typename Iter, typename OutIt>
+        OutIt write(Iter first, Iter last, OutIt dest) {
+            if (partial_len != 0) {
+                size_t len = src_traits::read_length(partial[0]);
+                for (; partial_len < len && first != last; ++first) {
+                    partial[partial_len++] = static_cast<codeunit_type>(*first);
+                }
+                if (partial_len < len) {
+                    return dest;
+                }
+                dest = internal::utf_traits<EDest>::encode(src_traits::decode(partial), dest);
+                partial_len = 0;
+            }
+            Iter rest = internal::transcode_complete<ESrc, EDest>(first, last, dest, internal::is_contiguous<Iter>());
+            for (; rest != last; ++rest) {
+                partial[partial_len++] = static_cast<codeunit_type>(*rest);
+            }
+            return dest;
+        }
+
+        template <typename S, typename OutIt>
+        OutIt write(const S* src, size_t len, OutIt dest) {
+            return write(src, src + len, dest);
+        }
+
+        // the number of codeunits held back for the next chunk
+        size_t pending() const { return partial_len; }
+
+        // ends the stream, discarding any incomplete sequence. Returns false
+        // if the stream ended in the middle of a sequence
+        bool finish() {
+            bool complete = partial_len == 0;
+            partial_len = 0;
+            return complete;
+        }
+    };
+
+    // the encodings detect_encoding() tells apart
+    enum class encoding_kind {
+        unknown, // the input is not valid in any of the others
+        utf8,
+        utf16le,
+        utf16be,
+        utf32le,
+        utf32be
+    };
+
+    // the most likely encoding of a string, and the length in bytes of the
+    // byte order mark to skip before the text (0 if there is none)
+    struct detected_encoding {
+        encoding_kind encoding;
+        size_t bom_length;
+    };
+
+    namespace internal {
+        // Statistics over the start of a string of unknown encoding, gathered
+        // in a single pass: zero bytes by offset modulo 4, bytes equal to the
+        // byte one UTF-16 codeunit back by offset parity, and codeunits which
+        // are invalid in UTF-16 (unpaired surrogates) and UTF-32, for each
+        // byte order (little endian first).
+        struct encoding_stats {
+            size_t zeros[4];
+            size_t repeats[2];
+            size_t utf16_errors[2];
+            size_t utf32_errors[2];
+
+            // whether the last UTF-16 codeunit seen was a lead surrogate
+            bool lead[2];
+
+            encoding_stats() : zeros(), repeats(), utf16_errors(), utf32_errors(), lead() {}
+
+            void add_utf16(size_t order, uint16_t c) {
+                bool is_lead = (c & 0xfc00) == 0xd800;
+                bool is_trail = (c & 0xfc00) == 0xdc00;
+                utf16_errors[order] += lead[order] != is_trail;
+                lead[order] = is_lead;
+            }
+
+            void add_utf32(size_t order, uint32_t c) {
+                utf32_errors[order] += !validate_codepoint(c);
+            }
+
+#ifdef UTFHPP_SSE2
+            // accumulates the invalid UTF-16 and UTF-32 codeunits of a block
+            // in one byte order, in 16 and 32-bit lane counters
+            template <bool Swap>
+            static void add_block(__m128i v, __m128i& prev_lead, __m128i& errors16, __m128i& errors32) {
+                const __m128i zero = _mm_setzero_si128();
+                __m128i u16 = _mm_and_si128(lanes<2, Swap>::order(v), _mm_set1_epi16(static_cast<short>(0xfc00)));
+                __m128i is_lead = _mm_cmpeq_epi16(u16, _mm_set1_epi16(static_cast<short>(0xd800)));
+                __m128i is_trail = _mm_cmpeq_epi16(u16, _mm_set1_epi16(static_cast<short>(0xdc00)));
+                // a trail is expected exactly after each lead
+                __m128i follows_lead = _mm_or_si128(_mm_slli_si128(is_lead, 2), _mm_srli_si128(prev_lead, 14));
+                errors16 = _mm_sub_epi16(errors16, _mm_xor_si128(is_trail, follows_lead));
+                prev_lead = is_lead;
+
+                // signed comparisons, so values above 0x7fffffff are caught as negative
+                __m128i u32 = lanes<4, Swap>::order(v);
+                __m128i invalid = _mm_or_si128(_mm_cmpgt_epi32(u32, _mm_set1_epi32(0x10ffff)), _mm_cmplt_epi32(u32, zero));
+                invalid = _mm_or_si128(invalid, _mm_cmpeq_epi32(_mm_and_si128(u32, _mm_set1_epi32(static_cast<int>(0xfffff800))), _mm_set1_epi32(0xd800)));
+                errors32 = _mm_sub_epi32(errors32, invalid);
+            }
+
+            static size_t sum_epi32(__m128i v) {
+                v = _mm_add_epi32(v, _mm_srli_si128(v, 8));
+                v = _mm_add_epi32(v, _mm_srli_si128(v, 4));
+                return static_cast<size_t>(_mm_cvtsi128_si32(v));
+            }
+#endif
+
+            void run(const unsigned char* p, size_t n) {
+                size_t i = 0;
+#ifdef UTFHPP_SSE2
+                if (simd_enabled(simd_level::sse2) && n >= 16) {
+                    const __m128i zero = _mm_setzero_si128();
+                    // the previous block, for comparing the first codeunit of a
+                    // block with the one before it. Its last two bytes start as
+                    // the complement of the first two, which have nothing
+                    // before them to repeat
+                    __m128i prev = _mm_slli_si128(_mm_cvtsi32_si128(~(p[0] | p[1] << 8) & 0xffff), 14);
+                    __m128i prev_lead[2] = { zero, zero };
+                    while (n - i >= 16) {
+                        // per-byte counters are flushed before they can overflow
+                        size_t blocks = std::min<size_t>((n - i) / 16, 255);
+                        __m128i zero_acc = zero;
+                        __m128i repeat_acc = zero;
+                        __m128i errors16[2] = { zero, zero };
+                        __m128i errors32[2] = { zero, zero };
+                        for (size_t b = 0; b < blocks; ++b, i += 16) {
+                            __m128i v = load128(p + i);
+                            zero_acc = _mm_sub_epi8(zero_acc, _mm_cmpeq_epi8(v, zero));
+                            __m128i back = _mm_or_si128(_mm_slli_si128(v, 2), _mm_srli_si128(prev, 14));
+                            repeat_acc = _mm_sub_epi8(repeat_acc, _mm_cmpeq_epi8(v, back));
+                            prev = v;
+                            add_block<byte_order<utf16le>::swapped>(v, prev_lead[0], errors16[0], errors32[0]);
+                            add_block<byte_order<utf16be>::swapped>(v, prev_lead[1], errors16[1], errors32[1]);
+                        }
+                        unsigned char bytes[32];
+                        store128(bytes, zero_acc);
+                        store128(bytes + 16, repeat_acc);
+                        for (size_t k = 0; k < 16; ++k) {
+                            zeros[k % 4] += bytes[k];
+                            repeats[k % 2] += bytes[16 + k];
+                        }
+                        for (size_t order = 0; order < 2; ++order) {
+                            utf16_errors[order] += sum_epi32(_mm_madd_epi16(errors16[order], _mm_set1_epi16(1)));
+                            utf32_errors[order] += sum_epi32(errors32[order]);
+                        }
+                    }
+                    for (size_t order = 0; order < 2; ++order) {
+                        lead[order] = (_mm_movemask_epi8(prev_lead[order]) & 0x8000) != 0;
+                    }
+                }
+#endif
+                for (; i < n; ++i) {
+                    zeros[i % 4] += p[i] == 0;
+                    if (i >= 2) {
+                        repeats[i % 2] += p[i] == p[i - 2];
+                    }
+                    if (i % 2 == 1) {
+                        add_utf16(0, static_cast<uint16_t>(p[i - 1] | p[i] << 8));
+                        add_utf16(1, static_cast<uint16_t>(p[i - 1] << 8 | p[i]));
+                    }
+                    if (i % 4 == 3) {
+                        add_utf32(0, static_cast<uint32_t>(p[i - 3]) | static_cast<uint32_t>(p[i - 2]) << 8
+                                   | static_cast<uint32_t>(p[i - 1]) << 16 | static_cast<uint32_t>(p[i]) << 24);
+                        add_utf32(1, static_cast<uint32_t>(p[i - 3]) << 24 | static_cast<uint32_t>(p[i - 2]) << 16
+                                   | static_cast<uint32_t>(p[i - 1]) << 8 | static_cast<uint32_t>(p[i]));
+                    }
+                }
+            }
+        };
+
+        inline encoding_kind detect_bom(const unsigned char* p, size_t len, size_t& bom_length) {
+            if (len >= 3 && p[0] == 0xef && p[1] == 0xbb && p[2] == 0xbf) { bom_length = 3; return encoding_kind::utf8; }
+            if (len >= 4 && p[0] == 0xff && p[1] == 0xfe && p[2] == 0 && p[3] == 0) { bom_length = 4; return encoding_kind::utf32le; }
+            if (len >= 4 && p[0] == 0 && p[1] == 0 && p[2] == 0xfe && p[3] == 0xff) { bom_length = 4; return encoding_kind::utf32be; }
+            if (len >= 2 && p[0] == 0xff && p[1] == 0xfe) { bom_length = 2; return encoding_kind::utf16le; }
+            if (len >= 2 && p[0] == 0xfe && p[1] == 0xff) { bom_length = 2; return encoding_kind::utf16be; }
+            bom_length = 0;
+            return encoding_kind::unknown;
+        }
+    }
+
+    // Guesses the encoding of the len bytes at data. A byte order mark
+    // decides it; otherwise the first 64 KiB are scanned once for the
+    // statistics in encoding_stats, and then validated as UTF-8 in a second
+    // pass by the UTF-8 block validator, while they are still in cache (a
+    // sequence cut off by the end of the scan is not an error unless the
+    // input ends there). UTF-32 is chosen if the text is valid in it, then UTF-8 if the
+    // text is valid and free of zero bytes, then a byte order of UTF-16 which
+    // it is valid in, telling them apart by which bytes are zero or repeat
+    // most (the high bytes of UTF-16 codeunits vary least), then UTF-8 with
+    // the odd zero byte. Anything else is unknown.
+    inline detected_encoding detect_encoding(const void* data, size_t len) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        detected_encoding res = { encoding_kind::unknown, 0 };
+        res.encoding = internal::detect_bom(p, len, res.bom_length);
+        if (res.encoding != encoding_kind::unknown) {
+            return res;
+        }
+
+        const size_t limit = size_t(1) << 16;
+        bool complete = len <= limit;
+        size_t n = complete ? len : limit;
+        internal::encoding_stats stats;
+        stats.run(p, n);
+        const char* text = static_cast<const char*>(data);
+        const char* end = complete ? text + n : internal::sequence_boundary<utf8>::next(text + n, text + len);
+        bool utf8_valid = internal::contiguous_validator<utf8>::run(text, end);
+        size_t zeros = stats.zeros[0] + stats.zeros[1] + stats.zeros[2] + stats.zeros[3];
+
+        for (size_t order = 0; order < 2; ++order) {
+            if (n >= 4 && stats.utf32_errors[order] == 0 && (!complete || len % 4 == 0)) {
+                res.encoding = order == 0 ? encoding_kind::utf32le : encoding_kind::utf32be;
+                return res;
+            }
+        }
+        if (utf8_valid && zeros == 0) {
+            res.encoding = encoding_kind::utf8;
+            return res;
+        }
+        bool le = stats.utf16_errors[0] == 0 && !(complete && (len % 2 != 0 || stats.lead[0]));
+        bool be = stats.utf16_errors[1] == 0 && !(complete && (len % 2 != 0 || stats.lead[1]));
+        if ((le || be) && (!utf8_valid || zeros * 8 >= n)) {
+            if (le && be) {
+                le = stats.zeros[1] + stats.zeros[3] + stats.repeats[1] >= stats.zeros[0] + stats.zeros[2] + stats.repeats[0];
+            }
+            res.encoding = le ? encoding_kind::utf16le : encoding_kind::utf16be;
+            return res;
+        }
+        if (utf8_valid) {
+            res.encoding = encoding_kind::utf8;
+        }
+        return res;
     }
 
     // convenience stuff
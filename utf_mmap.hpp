@@ -0,0 +1,266 @@
+//          Copyright Jesper Dam 2013.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// File conversion on top of utf.hpp. The input file is memory mapped and
+// converted in place, a chunk at a time, through a fixed-size output buffer,
+// so files of any size are converted with bounded extra memory. Input which
+// is not a regular file, such as a pipe, is read a chunk at a time instead.
+// Requires POSIX (mmap).
+
+#ifndef NP_UTF_MMAP_HPP
+#define NP_UTF_MMAP_HPP
+
+#include "utf.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace utf {
+    enum class file_status {
+        ok,
+        open_failed, // the input could not be opened, or the output created
+        map_failed, // the input could not be memory mapped
+        read_failed, // reading the input failed
+        same_file, // the output is the input file
+        invalid_input, // the input is not valid, or EDest cannot encode it (see error)
+        write_failed // writing the output failed
+    };
+
+    // result of a file conversion. read and written count codeunits. On
+    // invalid input, read is the offset of the invalid sequence, error says
+    // what is wrong with it, and everything before it has been written.
+    struct file_result {
+        file_status status;
+        error_kind error;
+        size_t read;
+        size_t written;
+    };
+
+    namespace internal {
+        // closes a file descriptor and unmaps a mapping on scope exit
+        struct file_handles {
+            int in;
+            int out;
+            bool close_out;
+            void* map;
+            size_t map_len;
+
+            file_handles() : in(-1), out(-1), close_out(false), map(MAP_FAILED), map_len(0) {}
+            ~file_handles() {
+                if (map != MAP_FAILED) { munmap(map, map_len); }
+                if (in >= 0) { close(in); }
+                if (close_out && out >= 0) { close(out); }
+            }
+        };
+
+        inline bool write_all(int fd, const void* data, size_t len) {
+            const char* p = static_cast<const char*>(data);
+            while (len > 0) {
+                ssize_t n = write(fd, p, len);
+                if (n < 0) {
+                    if (errno == EINTR) { continue; }
+                    return false;
+                }
+                p += n;
+                len -= static_cast<size_t>(n);
+            }
+            return true;
+        }
+
+        // validates and converts [first, last) in chunks split at sequence
+        // boundaries, writing each converted chunk to fd
+        template <typename ESrc, typename EDest, typename S>
+        file_result transcode_mapped(const S* first, const S* last, int fd) {
+            typedef typename utf_traits<EDest>::codeunit_type D;
+            const size_t chunk = size_t(1) << 18;
+            std::vector<D> buf((chunk + 4) * expansion_factor<ESrc, EDest>::value);
+
+            file_result res = { file_status::ok, error_kind::none, 0, 0 };
+            for (const S* it = first; it != last; ) {
+                const S* end = static_cast<size_t>(last - it) > chunk
+                    ? sequence_boundary<ESrc>::next(it + chunk, last)
+                    : last;
+                checked_result<D*> part = stringview<const S*, ESrc>(it, end).template to_checked<EDest>(buf.data());
+                size_t written = part.dest - buf.data();
+                if (!write_all(fd, buf.data(), written * sizeof(D))) {
+                    res.status = file_status::write_failed;
+                    return res;
+                }
+                res.written += written;
+                if (!part.ok()) {
+                    res.status = file_status::invalid_input;
+                    res.error = part.error;
+                    res.read += part.offset;
+                    return res;
+                }
+                res.read += end - it;
+                it = end;
+            }
+            return res;
+        }
+
+        // reads fd to its end a chunk at a time, converting each chunk up to
+        // its last sequence, which is carried over to the next chunk as it
+        // may continue there
+        template <typename ESrc, typename EDest>
+        file_result transcode_read(int in_fd, int out_fd) {
+            typedef typename utf_traits<ESrc>::codeunit_type S;
+            const size_t chunk = size_t(1) << 18;
+            std::vector<S> buf(chunk + 4);
+            char* bytes = reinterpret_cast<char*>(buf.data());
+
+            file_result res = { file_status::ok, error_kind::none, 0, 0 };
+            size_t have = 0; // bytes in buf
+            for (;;) {
+                ssize_t n = read(in_fd, bytes + have, buf.size() * sizeof(S) - have);
+                if (n < 0) {
+                    if (errno == EINTR) { continue; }
+                    res.status = file_status::read_failed;
+                    return res;
+                }
+                have += static_cast<size_t>(n);
+                const S* first = buf.data();
+                const S* last = first + have / sizeof(S);
+                const S* end = n == 0 || first == last
+                    ? last
+                    : sequence_boundary<ESrc>::prev(last, static_cast<size_t>(last - first));
+                file_result part = transcode_mapped<ESrc, EDest>(first, end, out_fd);
+                res.read += part.read;
+                res.written += part.written;
+                if (part.status != file_status::ok) {
+                    res.status = part.status;
+                    res.error = part.error;
+                    return res;
+                }
+                if (n == 0) {
+                    // trailing bytes too few to make up a whole codeunit
+                    if (have % sizeof(S) != 0) {
+                        res.status = file_status::invalid_input;
+                        res.error = error_kind::truncated;
+                    }
+                    return res;
+                }
+                size_t used = (end - first) * sizeof(S);
+                std::memmove(bytes, bytes + used, have - used);
+                have -= used;
+            }
+        }
+
+        inline bool same_file(const struct stat& a, const struct stat& b) {
+            return a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        }
+
+        // maps the input opened in files, which st describes, if it is a
+        // non-empty regular file
+        inline file_status map_input(file_handles& files, const struct stat& st) {
+            size_t size = static_cast<size_t>(st.st_size);
+            if (!S_ISREG(st.st_mode) || size == 0) {
+                return file_status::ok;
+            }
+            files.map = mmap(0, size, PROT_READ, MAP_PRIVATE, files.in, 0);
+            if (files.map == MAP_FAILED) {
+                return file_status::map_failed;
+            }
+            files.map_len = size;
+            madvise(files.map, size, MADV_SEQUENTIAL);
+            return file_status::ok;
+        }
+
+        // converts the input prepared by map_input to out_fd
+        template <typename ESrc, typename EDest>
+        file_result transcode_opened(const file_handles& files, const struct stat& st, int out_fd) {
+            typedef typename utf_traits<ESrc>::codeunit_type S;
+            if (!S_ISREG(st.st_mode)) {
+                return transcode_read<ESrc, EDest>(files.in, out_fd);
+            }
+            file_result res = { file_status::ok, error_kind::none, 0, 0 };
+            size_t size = static_cast<size_t>(st.st_size);
+            if (size == 0) {
+                return res;
+            }
+            const S* first = static_cast<const S*>(files.map);
+            const S* last = first + size / sizeof(S);
+            res = transcode_mapped<ESrc, EDest>(first, last, out_fd);
+            // trailing bytes too few to make up a whole codeunit
+            if (res.status == file_status::ok && size % sizeof(S) != 0) {
+                res.status = file_status::invalid_input;
+                res.error = error_kind::truncated;
+            }
+            return res;
+        }
+    }
+
+    // Converts the file at src_path from ESrc to EDest, writing the output to
+    // the file descriptor out_fd, which must not refer to the input file.
+    template <typename ESrc, typename EDest>
+    file_result transcode_file(const char* src_path, int out_fd) {
+        file_result res = { file_status::ok, error_kind::none, 0, 0 };
+        internal::file_handles files;
+        files.out = out_fd;
+
+        files.in = open(src_path, O_RDONLY);
+        struct stat st;
+        if (files.in < 0 || fstat(files.in, &st) != 0) {
+            res.status = file_status::open_failed;
+            return res;
+        }
+        struct stat out_st;
+        if (fstat(out_fd, &out_st) == 0 && internal::same_file(st, out_st)) {
+            res.status = file_status::same_file;
+            return res;
+        }
+        res.status = internal::map_input(files, st);
+        if (res.status != file_status::ok) {
+            return res;
+        }
+        return internal::transcode_opened<ESrc, EDest>(files, st, out_fd);
+    }
+
+    // Converts the file at src_path from ESrc to EDest, creating or
+    // truncating the file at dest_path for the output. The output is only
+    // created once the input has been opened and mapped, and never if it is
+    // the input.
+    template <typename ESrc, typename EDest>
+    file_result transcode_file(const char* src_path, const char* dest_path) {
+        file_result res = { file_status::ok, error_kind::none, 0, 0 };
+        internal::file_handles files;
+
+        files.in = open(src_path, O_RDONLY);
+        struct stat st;
+        if (files.in < 0 || fstat(files.in, &st) != 0) {
+            res.status = file_status::open_failed;
+            return res;
+        }
+        // checked before opening, as opening truncates the output
+        struct stat out_st;
+        if (stat(dest_path, &out_st) == 0 && internal::same_file(st, out_st)) {
+            res.status = file_status::same_file;
+            return res;
+        }
+        res.status = internal::map_input(files, st);
+        if (res.status != file_status::ok) {
+            return res;
+        }
+        files.out = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (files.out < 0) {
+            res.status = file_status::open_failed;
+            return res;
+        }
+        files.close_out = true;
+        res = internal::transcode_opened<ESrc, EDest>(files, st, files.out);
+        int out = files.out;
+        files.close_out = false;
+        if (close(out) != 0 && res.status == file_status::ok) {
+            res.status = file_status::write_failed;
+        }
+        return res;
+    }
+}
+
+#endif
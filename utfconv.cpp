@@ -0,0 +1,117 @@
+//          Copyright Jesper Dam 2013.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// utfconv: converts a file between UTF-8, UTF-16, UTF-32 and Latin-1. utf16
+// and utf32 are in native byte order, utf16le, utf16be, utf32le and utf32be in
+// a fixed one. Conversion stops at the first invalid sequence, or at the first
+// character the output encoding cannot encode (as Latin-1 cannot encode most),
+// after writing the output up to it.
+//
+// usage: utfconv -f <encoding> -t <encoding> <input> [<output>]
+//
+// Without an output file, the result is written to standard output. The
+// output file may not be the input file. The input may be a pipe, such as
+// /dev/stdin.
+
+#include <cstdio>
+#include <cstring>
+#include "utf_mmap.hpp"
+
+namespace {
+    typedef utf::file_result (*converter)(const char*, const char*);
+
+    // converts to the file at dest_path, or to standard output if it is null
+    template <typename ESrc, typename EDest>
+    utf::file_result convert_file(const char* src_path, const char* dest_path) {
+        if (dest_path) {
+            return utf::transcode_file<ESrc, EDest>(src_path, dest_path);
+        }
+        return utf::transcode_file<ESrc, EDest>(src_path, STDOUT_FILENO);
+    }
+
+    template <typename ESrc>
+    converter pick_dest(const char* name) {
+        if (std::strcmp(name, "utf8") == 0) { return &convert_file<ESrc, utf::utf8>; }
+        if (std::strcmp(name, "utf16") == 0) { return &convert_file<ESrc, utf::utf16>; }
+        if (std::strcmp(name, "utf32") == 0) { return &convert_file<ESrc, utf::utf32>; }
+        if (std::strcmp(name, "utf16le") == 0) { return &convert_file<ESrc, utf::utf16le>; }
+        if (std::strcmp(name, "utf16be") == 0) { return &convert_file<ESrc, utf::utf16be>; }
+        if (std::strcmp(name, "utf32le") == 0) { return &convert_file<ESrc, utf::utf32le>; }
+        if (std::strcmp(name, "utf32be") == 0) { return &convert_file<ESrc, utf::utf32be>; }
+        if (std::strcmp(name, "latin1") == 0) { return &convert_file<ESrc, utf::latin1>; }
+        return 0;
+    }
+
+    converter pick(const char* from, const char* to) {
+        if (std::strcmp(from, "utf8") == 0) { return pick_dest<utf::utf8>(to); }
+        if (std::strcmp(from, "utf16") == 0) { return pick_dest<utf::utf16>(to); }
+        if (std::strcmp(from, "utf32") == 0) { return pick_dest<utf::utf32>(to); }
+        if (std::strcmp(from, "utf16le") == 0) { return pick_dest<utf::utf16le>(to); }
+        if (std::strcmp(from, "utf16be") == 0) { return pick_dest<utf::utf16be>(to); }
+        if (std::strcmp(from, "utf32le") == 0) { return pick_dest<utf::utf32le>(to); }
+        if (std::strcmp(from, "utf32be") == 0) { return pick_dest<utf::utf32be>(to); }
+        if (std::strcmp(from, "latin1") == 0) { return pick_dest<utf::latin1>(to); }
+        return 0;
+    }
+
+    int usage() {
+        std::fprintf(stderr, "usage: utfconv -f <encoding> -t <encoding> <input> [<output>]\n"
+                             "encodings: utf8, utf16, utf32, utf16le, utf16be, utf32le, utf32be, latin1\n");
+        return 2;
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* from = "utf8";
+    const char* to = "utf8";
+    const char* files[2] = { 0, 0 };
+    int nfiles = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-f") == 0 && i + 1 < argc) { from = argv[++i]; }
+        else if (std::strcmp(argv[i], "-t") == 0 && i + 1 < argc) { to = argv[++i]; }
+        else if (nfiles < 2 && argv[i][0] != '-') { files[nfiles++] = argv[i]; }
+        else { return usage(); }
+    }
+    converter convert = pick(from, to);
+    if (!convert || nfiles == 0) {
+        return usage();
+    }
+
+    utf::file_result res = convert(files[0], files[1]);
+
+    switch (res.status) {
+    case utf::file_status::ok:
+        return 0;
+    case utf::file_status::open_failed:
+        if (nfiles == 2) {
+            std::fprintf(stderr, "utfconv: cannot open %s or create %s\n", files[0], files[1]);
+        }
+        else {
+            std::fprintf(stderr, "utfconv: cannot open %s\n", files[0]);
+        }
+        break;
+    case utf::file_status::map_failed:
+        std::fprintf(stderr, "utfconv: cannot map %s\n", files[0]);
+        break;
+    case utf::file_status::read_failed:
+        std::fprintf(stderr, "utfconv: cannot read %s\n", files[0]);
+        break;
+    case utf::file_status::same_file:
+        std::fprintf(stderr, "utfconv: %s is also the input\n", files[1] ? files[1] : "the output");
+        break;
+    case utf::file_status::invalid_input:
+        if (res.error == utf::error_kind::unrepresentable) {
+            std::fprintf(stderr, "utfconv: character at codeunit %lu cannot be encoded in %s\n", static_cast<unsigned long>(res.read), to);
+        }
+        else {
+            std::fprintf(stderr, "utfconv: invalid %s at codeunit %lu\n", from, static_cast<unsigned long>(res.read));
+        }
+        break;
+    case utf::file_status::write_failed:
+        std::fprintf(stderr, "utfconv: write failed\n");
+        break;
+    }
+    return 1;
+}